@@ -0,0 +1,64 @@
+#ifndef BATTERY_H
+#define BATTERY_H
+
+#include <Arduino.h>
+
+/*
+Battery monitor
+===============
+The battery pin is sampled in the background by a low rate esp_timer, one
+analogReadMilliVolts() call every BATT_SAMPLE_PERIOD_MS, and the samples are
+run through an exponential filter.  Reading the battery from the draw code is
+then a single load of the cached filtered value instead of 75 blocking ADC
+conversions.  The timer is one-shot, re-armed after each sample, and
+batteryIdle() parks it while the main loop waits or light sleeps, so it never
+wakes the CPU on its own; a sample that fell due meanwhile is taken when the
+loop resumes.
+
+The cell sags while the radio transmits, so samples are only taken in radio
+idle windows: SendData() marks the start of an exchange with batterySetLoad()
+and the end of the reply wait marks it idle again.  The state of charge comes
+from a Li-ion discharge curve and is kept in RTC memory, so a wake from deep
+sleep shows the last estimate until fresh idle samples are in.
+*/
+
+#define BATT_SAMPLE_PERIOD_MS 2000  //time between battery samples
+#define BATT_FILTER_SHIFT 2       //filter weight of a new sample is 1/2^BATT_FILTER_SHIFT
+#define BATT_LEGACY_SAMPLES 75    //samples the old blocking readADCVolts() averaged, timed once for the report
+#define BATT_FULL_ADC_MV 680      //ADC mV of a full cell through the voltage divider
+#define BATT_FULL_CELL_MV 4200    //cell mV of a full cell
+#define BATT_SETTLE_MS 200        //time the cell needs to recover after a TX before sampling again
+#define BATT_TX_TIMEOUT_MS 30000  //an exchange that never ended is treated as idle after this
+#define BATT_SOC_MIN_SAMPLES 4    //idle samples needed before the measured SoC replaces the stored one
+#define BATT_SOC_BLEND_SHIFT 2    //until then each idle sample moves the stored SoC 1/2^BATT_SOC_BLEND_SHIFT of the way
+#define BATT_LOW_SOC 15           //SoC (%) that starts the low battery mode
+#define BATT_LOW_SOC_EXIT 20      //SoC (%) that ends the low battery mode
+
+enum BattLoad
+{
+  BATT_LOAD_IDLE,  //radio idle, samples are taken
+  BATT_LOAD_TX     //exchange with the controller in progress, samples are skipped
+};
+
+struct BatteryStats
+{
+  uint32_t samples;       //number of idle samples since the monitor started
+  uint32_t skipped;       //samples skipped because the radio was busy
+  uint16_t minMilliVolts;
+  uint16_t maxMilliVolts;
+  float meanMilliVolts;
+  float stdDevMilliVolts;  //sample noise
+  uint32_t legacyReadMicros;  //time one blocking 75 sample average took
+  uint32_t cachedReadMicros;  //time one cached read takes
+};
+
+void batteryBegin(uint8_t pin);
+void batterySetLoad(BattLoad load);
+void batteryIdle(bool idle);
+uint16_t batteryMilliVolts();
+uint8_t batterySoC();
+bool batteryLow();
+void batteryStats(BatteryStats &stats);
+void batteryReport();
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include <Arduino.h>
+
+/*
+ESP-NOW bulk transfer
+=====================
+Moves a block of up to BULK_MAX_SIZE bytes (a log dump, the calibration
+table, a metrics snapshot) between the remote and the controller over
+ESP-NOW, no WiFi needed.  Each frame uses the full 250 byte ESP-NOW payload:
+a 4 byte header and up to BULK_CHUNK bytes of content.
+
+The remote can start a transfer, or ask for one with bulkRequest(), in any
+mode: the radio is turned on for it and kept on while bulkActive(), which
+includes the wait for the OFFER that answers a request.  In normal mode the
+radio is off between exchanges (Radio.h), so the controller can only start
+one, with an OFFER or a REQUEST, in Cal or OTA mode or in the linger time
+after an exchange with the remote.
+
+Frames, little endian.  The first byte is the kind, above the controller's
+command numbers, so a bulk frame is never taken for a DataStruct:
+
+  OFFER    B0 id 0     type u8, size u32, crc32 u32  start of a transfer
+  DATA     B1 id seq   content from seq * BULK_CHUNK
+  POLL     B2 id seq   DATA that asks for an ACK at once
+  ACK      B3 id base  bitmap u32, status u8          chunks before base are in,
+                                                      bit i: chunk base+1+i is in
+  ABORT    B4 id side  reason u8                      side 0: from the sender,
+                                                      1: from the receiver
+  REQUEST  B5 0  0     type u8                        ask the peer to send a type
+
+The sender keeps up to BULK_WINDOW chunks past the first missing one in
+flight and at most BULK_INFLIGHT frames queued in ESP-NOW (paced by the send
+callbacks).  The receiver acks every BULK_ACK_EVERY chunks, on a POLL and at
+the end.  The link delivers in order, so a chunk missing from an ACK that
+was sent before a chunk the ACK has is lost, and only those are sent again
+(selective retransmit).  With no ACK for BULK_ACK_TIMEOUT_MS the first
+missing chunk is polled, up to BULK_MAX_RETRIES times in a row.  The ACK
+that completes the transfer carries the CRC-32 check (status 0, 1 on a
+mismatch).  There is no retry for a REQUEST, ask again if no OFFER comes.
+
+Frames arrive in the WiFi task.  bulkFrame() only copies them into a small
+queue and posts EV_BULK; all protocol work is in bulkPump() on the main
+thread.  The last BULK_HISTORY transfers are kept for bulkReport(): size,
+frames, retransmits, time and throughput, with the test loss that was set.
+bulkSetTestLoss() drops a share of the outgoing frames on purpose, so a
+sweep over a few settings shows how throughput holds up under loss.
+*/
+
+#define BULK_FRAME_MAX 250       //ESP-NOW payload limit
+#define BULK_HEADER_SIZE 4
+#define BULK_CHUNK (BULK_FRAME_MAX - BULK_HEADER_SIZE)
+#define BULK_MAX_SIZE 16384
+#define BULK_MAX_CHUNKS ((BULK_MAX_SIZE + BULK_CHUNK - 1) / BULK_CHUNK)
+#define BULK_WINDOW 16           //chunks past the first missing one, at most 32 (the ACK bitmap)
+#define BULK_ACK_EVERY 8
+#define BULK_INFLIGHT 4          //frames handed to ESP-NOW before their send callback
+#define BULK_ACK_TIMEOUT_MS 60
+#define BULK_MAX_RETRIES 8
+#define BULK_RX_QUEUE 8          //frames from the WiFi task waiting for bulkPump(), power of 2
+#define BULK_RX_TIMEOUT_MS 2000  //an incoming transfer that goes quiet is dropped
+#define BULK_HISTORY 8           //transfers kept for bulkReport()
+#define BULK_REPORT_SIZE 768     //buffer needed by bulkReport()
+
+enum BulkType
+{
+  BULK_LOG,      //text, the log ring
+  BULK_CAL,      //the calibration table, raw
+  BULK_METRICS,  //text, Prometheus format
+  BULK_TYPE_COUNT
+};
+
+typedef bool (*BulkTransmit)(const uint8_t *frame, size_t len);               //send one frame to the peer
+typedef void (*BulkReceived)(uint8_t type, const uint8_t *data, size_t len);  //a transfer came in, CRC checked
+typedef void (*BulkRequested)(uint8_t type);                                  //the peer asked for a type
+
+void bulkBegin(BulkTransmit transmit, BulkReceived received, BulkRequested requested);
+bool bulkSend(uint8_t type, const uint8_t *data, size_t len);
+bool bulkRequest(uint8_t type);
+bool bulkFrame(const uint8_t *data, int len);
+void bulkPump();
+bool bulkSendDone();
+bool bulkActive();
+uint32_t bulkNextDeadline();
+void bulkSetTestLoss(uint8_t percent);
+const char *bulkTypeName(uint8_t type);
+size_t bulkReport(char *buf, size_t len);
+
+#endif
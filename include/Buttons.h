@@ -0,0 +1,73 @@
+#ifndef BUTTONS_H
+#define BUTTONS_H
+
+#include <Arduino.h>
+
+/*
+Button event engine
+===================
+Each button pin has a CHANGE interrupt that only posts the button and the new
+level as an EV_BUTTON event (see Events.h).  The main loop hands those edges
+to buttonsEdge(), which runs a debounce state machine per button: a level
+counts once it has been stable for BTN_DEBOUNCE_MS.  Because the edges carry
+their own level and timestamp, a short press that happens while loop() is
+busy is still seen later with its real timing.
+
+The state machine emits typed events into a queue read with buttonEventGet():
+press, release, hold after BTN_HOLD_MS, and auto-repeat while held.  The
+repeat interval starts at BTN_REPEAT_START_MS and shrinks on every repeat
+down to BTN_REPEAT_MIN_MS, so a long hold accelerates.
+
+A chord can be set with buttonsSetChord(): when every button of the chord is
+pressed within the window a single chord event is emitted instead of their
+presses.  The press of the first chord button is held back for the window,
+then released as a normal press if the chord does not complete.  Once a chord
+fires, the members' events are swallowed until all of them are released.
+*/
+
+#define BTN_DEBOUNCE_MS 30       //time a level must be stable to count
+#define BTN_HOLD_MS 600          //time pressed before a hold event
+#define BTN_REPEAT_START_MS 400  //first auto-repeat interval after the hold
+#define BTN_REPEAT_MIN_MS 100    //fastest auto-repeat interval
+#define BTN_REPEAT_ACCEL 80      //each repeat interval is this % of the previous one
+#define BTN_EVENT_QUEUE 16       //events buffered for the consumers, power of 2
+#define BTN_CHORD_WINDOW_MS 100  //default time between the presses of a chord
+
+enum ButtonId
+{
+  BTN_UP,
+  BTN_DOWN,
+  BTN_CAL,
+  BTN_OTA,
+  BTN_COUNT
+};
+
+enum ButtonEventType
+{
+  BTN_PRESS,
+  BTN_RELEASE,
+  BTN_HOLD,
+  BTN_REPEAT,
+  BTN_CHORD   //button is the member that completed the chord
+};
+
+struct ButtonEvent
+{
+  uint8_t button;  //ButtonId
+  uint8_t type;    //ButtonEventType
+  uint32_t time;   //event timestamp (us, see eventTimeNow()) of the edge or timer
+};
+
+void buttonsBegin(const uint8_t pins[BTN_COUNT], uint8_t repeatMask);
+void buttonsEdge(uint8_t id, uint8_t level, uint32_t time);
+void buttonsWakePress(uint8_t id);
+void buttonsSetChord(uint8_t mask, uint16_t windowMs);
+void buttonsUpdate();
+uint32_t buttonsNextDeadline();
+bool buttonsAnyLow();
+void buttonsResync();
+bool buttonEventGet(ButtonEvent &event);
+bool buttonDown(ButtonId button);
+const char *buttonEventName(const ButtonEvent &event);
+
+#endif
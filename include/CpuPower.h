@@ -0,0 +1,42 @@
+#ifndef CPUPOWER_H
+#define CPUPOWER_H
+
+#include <Arduino.h>
+
+/*
+CPU frequency policy
+====================
+Power management (esp_pm) runs the CPU at CPU_MIN_MHZ with automatic light
+sleep whenever nothing holds it up.  The main task holds a CPU_FREQ_MAX lock
+with cpuBoost(true) only while it has work to do, rendering a screen or
+handling ESP-NOW frames and button events, and drops it just before it blocks
+(the reply wait, the send wait and the end of loop()).  The WiFi driver takes
+its own locks while the radio needs a fast clock.
+
+If the build has no power management the CPU stays at full speed and the
+boost is counted as always on in the energy accounting.
+
+Bench builds (env:esp32-s2-saola-1-bench) can compare wake to display
+latency with and without the policy: every CPU_BASELINE_EVERY-th wake, and
+the first after power on, leaves power management unconfigured and runs the
+whole wake at full speed.  The latency of each kind of wake goes into a
+running average kept in RTC memory, and cpuPowerReport() prints both
+averages and their difference.  setup() holds the boost in both kinds, so
+the difference is the boot time the policy adds (esp_pm_configure() and the
+lock), not its effect on handling events later in the wake.  Off by default,
+a baseline wake gives up the policy's saving for the whole wake.
+*/
+
+#define CPU_MAX_MHZ 240
+#define CPU_MIN_MHZ 40   //XTAL, lowest the S2 runs at
+#ifndef CPU_BASELINE_EVERY
+#define CPU_BASELINE_EVERY 0  //wakes per baseline wake with the policy off, 0 for none
+#endif
+#define CPU_LATENCY_SHIFT 3    //running average weight of a new latency is 1/2^CPU_LATENCY_SHIFT
+
+bool cpuPowerBegin();
+void cpuBoost(bool on);
+void cpuMarkDisplayed();
+void cpuPowerReport();
+
+#endif
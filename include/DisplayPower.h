@@ -0,0 +1,53 @@
+#ifndef DISPLAYPOWER_H
+#define DISPLAYPOWER_H
+
+#include <Arduino.h>
+#include <U8g2lib.h>
+
+/*
+Display power manager
+=====================
+The OLED steps down from full contrast to dim and then blank on timers while
+nothing happens, and comes straight back on any input or new data from the
+controller.  There is one set of timers for waiting on a controller reply and
+one for idle, both halved in the low battery mode.  Time spent at each level
+is accumulated over the whole interaction, from the wake to deep sleep, and
+the on-time saved is reported once at its end.
+*/
+
+#define DISP_CONTRAST_FULL 255
+#define DISP_CONTRAST_DIM 16
+
+enum DisplayProfile
+{
+  DISP_PROFILE_IDLE,  //showing the flow, waiting for the user
+  DISP_PROFILE_WAIT   //showing "waiting...", waiting for the controller
+};
+
+enum DisplayLevel
+{
+  DISP_FULL,
+  DISP_DIM,
+  DISP_BLANK
+};
+
+struct DisplayTimers
+{
+  uint32_t dimAfterMs;    //time at full contrast before dimming
+  uint32_t blankAfterMs;  //time since the last activity before blanking
+};
+
+extern DisplayTimers DisplayIdleTimers;
+extern DisplayTimers DisplayWaitTimers;
+
+void displayPowerBegin(U8G2 &display);
+void displayActivity();
+void displaySetProfile(DisplayProfile profile);
+void displaySetLowPower(bool lowPower);
+void displayPowerUpdate();
+uint32_t displayPowerNextDeadline();
+DisplayLevel displayLevel();
+void displayPowerReport();
+void displayEndInteraction();
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <Arduino.h>
+
+/*
+Energy accounting
+=================
+Time is accumulated per state and multiplied by an estimated current to get
+the charge used.  The CPU is in exactly one of active, light sleep or deep
+sleep; the other states are loads on top of it (the display keeps drawing in
+light sleep, the radio does not).  The currents are estimates for the
+ESP32-S2 and SH1106, edit EnergyCurrentMA to match measurements.
+
+An interaction runs from a wake to the next deep sleep (or restart).  At its
+end the times are added to totals kept in RTC memory, which survive deep
+sleep and software restarts, so the report also gives the charge per day
+from everything seen since power on.
+*/
+
+#define ENERGY_REPORT_SIZE 1024  //buffer needed by energyFormat()
+
+enum EnergyState
+{
+  EN_CPU,          //CPU active (derived: awake time less light sleep)
+  EN_CPU_BOOST,    //CPU held at max frequency, on top of EN_CPU
+  EN_RADIO,        //WiFi/ESP-NOW receiver on
+  EN_TX,           //ESP-NOW send in progress
+  EN_WAIT,         //waiting for the controller reply
+  EN_DISPLAY,      //OLED not blanked
+  EN_LIGHT_SLEEP,
+  EN_DEEP_SLEEP,
+  EN_COUNT
+};
+
+extern float EnergyCurrentMA[EN_COUNT];  //current drawn in (or added by) each state
+
+void energyBegin();
+void energySet(EnergyState state, bool on);
+void energyLightSleep(uint64_t sleptUs);
+void energyEndInteraction(bool deepSleep);
+size_t energyFormat(char *buf, size_t len);
+void energyReport();
+int64_t energyWallTimeUs();
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <Arduino.h>
+
+/*
+ISR to main loop event queue
+============================
+Interrupts and the WiFi task never touch application state.  They only post
+a small event: a type, a couple of bytes of payload and a timestamp from the
+esp_timer counter.  The queue is a bounded lock-free multi producer, single
+consumer ring (sequence number per slot), so posting is safe from IRAM ISRs
+and from other tasks without a mutex.  Every post also notifies the main
+task, so loop() can block in eventWait() instead of spinning, and all state
+changes happen on the main thread when the events are handled.
+*/
+
+#define EVENT_QUEUE_SIZE 64  //power of 2
+
+enum EventType
+{
+  EV_NONE,
+  EV_BUTTON,     //button edge: arg = ButtonId, value = pin level
+  EV_SEND_DONE,  //ESP-NOW send callback: arg = 1 on success
+  EV_DATA_RECV,  //ESP-NOW data from the controller: arg = cmd, value = potADC, aux = RSSI
+  EV_BULK        //bulk transfer frame queued for bulkPump()
+};
+
+struct Event
+{
+  uint8_t type;    //EventType
+  uint8_t arg;
+  int8_t aux;
+  uint16_t value;
+  uint32_t time;   //esp_timer counter (us) when the event was posted
+};
+
+void eventsBegin();
+bool eventPost(uint8_t type, uint8_t arg, uint16_t value, int8_t aux);
+bool eventPostFromISR(uint8_t type, uint8_t arg, uint16_t value, int8_t aux);
+bool eventGet(Event &event);
+bool eventWait(uint32_t timeoutMs);
+bool eventsPending();
+uint32_t eventsDropped();
+uint32_t eventTimeNow();
+
+#endif
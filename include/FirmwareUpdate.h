@@ -0,0 +1,52 @@
+#ifndef FIRMWAREUPDATE_H
+#define FIRMWAREUPDATE_H
+
+#include <Arduino.h>
+
+/*
+Streaming firmware update
+=========================
+The image is written straight into the inactive OTA partition as it arrives,
+one flash sector at a time (erase, then write the full sector from a RAM
+buffer), and hashed with SHA-256 on the way in.  Nothing else is buffered,
+so the image size is only limited by the partition.
+
+An upload names the total size and the expected SHA-256 and starts at an
+offset.  Offset 0 starts over; any other offset must equal the bytes already
+received, so an upload cut off by a bad link resumes where it stopped
+(fwOffset(), also in the status) instead of starting again.  The state is in
+RAM, a restart loses it.  When the last byte is in, the hash is compared and
+the partition is set to boot only if it matches and the image checks out.
+
+A gzip compressed image (tools/pack_firmware.py) is inflated on the way in
+by the ROM's tinfl, through a 32 kB window that is also the output buffer,
+so RAM stays bounded (about 43 kB, only while a compressed upload is in).
+Size and offset then count compressed bytes, the SHA-256 is of the image
+itself.  The transfer time saved is printed and given in the status.
+*/
+
+#define FW_SECTOR_SIZE 4096
+#define FW_STATUS_SIZE 256  //buffer needed by fwStatus()
+
+enum FwEncoding
+{
+  FW_RAW,
+  FW_GZIP
+};
+
+enum FwState
+{
+  FW_IDLE,
+  FW_RECEIVING,  //part of the image is in, waiting for more (or a resume)
+  FW_VERIFIED,   //complete, hash matched, set to boot
+  FW_FAILED      //the upload was rejected, start again at offset 0
+};
+
+bool fwBegin(uint32_t offset, uint32_t size, const char *sha256Hex, FwEncoding encoding);
+bool fwWrite(const uint8_t *data, size_t len);
+FwState fwEnd(bool aborted);
+FwState fwState();
+uint32_t fwOffset();
+size_t fwStatus(char *buf, size_t len);
+
+#endif
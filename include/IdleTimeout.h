@@ -0,0 +1,37 @@
+#ifndef IDLETIMEOUT_H
+#define IDLETIMEOUT_H
+
+#include <Arduino.h>
+
+/*
+Adaptive idle timeout
+=====================
+The time between button presses (also across deep sleep, on the RTC wall
+clock) is counted in a histogram kept in RTC memory.  From it the timeout
+before deep sleep is chosen to minimise the expected charge per idle period:
+
+  gap <= T : stay awake for the gap at the idle current
+  gap >  T : stay awake for T, then pay a wake and status re-query
+
+subject to the chance of a gap shorter than IDLE_SESSION_GAP_MS (the user is
+still adjusting) outlasting T staying under IdleMidSessionMax.  Candidates
+are the histogram bucket edges between IDLE_MIN_MS and IDLE_MAX_MS.  Old
+counts are halved now and then so the timeout follows changes in use.  Until
+IDLE_MIN_SAMPLES gaps are in, the default timeout is used.
+*/
+
+#define IDLE_MIN_MS 3000            //shortest timeout chosen
+#define IDLE_MAX_MS 30000           //longest timeout chosen
+#define IDLE_SESSION_GAP_MS 60000   //a shorter gap is a pause within a session
+#define IDLE_MIN_SAMPLES 20         //gaps needed before the timeout adapts
+#define IDLE_DECAY_TOTAL 1000       //halve the histogram when it holds this many gaps
+
+extern float IdleMidSessionMax;  //bound on the chance of sleeping during a pause
+
+void idleTimeoutBegin(uint32_t defaultMs);
+void idleRecordPress();
+void idleSetWakeCost(uint32_t wakeMs);
+uint32_t idleTimeout();
+void idleTimeoutReport();
+
+#endif
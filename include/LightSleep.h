@@ -0,0 +1,29 @@
+#ifndef LIGHTSLEEP_H
+#define LIGHTSLEEP_H
+
+#include <Arduino.h>
+
+/*
+Tickless idle
+=============
+When loop() has nothing to do until its next deadline (idle timeout, button
+debounce/hold/repeat, a scheduled task, a display timer) it calls
+lightSleep() instead of polling.  The chip goes into light sleep with a timer
+wake for the deadline and a low level GPIO wake on every button; RAM, the
+display contents and the ESP-NOW peer survive.  The button CHANGE interrupts
+are parked while asleep and the caller re-reads the pins afterwards.
+
+The radio is not serviced in light sleep, so the caller must not sleep while
+an ESP-NOW send or reply is pending.
+
+Each sleep is counted in the energy accounting (Energy.h), and the CPU duty
+cycle from wake to deep sleep can be printed with lightSleepReport().
+*/
+
+#define LS_MIN_SLEEP_MS 10     //shorter waits are not worth the sleep entry/exit
+
+void lightSleepBegin(const uint8_t *pins, uint8_t count);
+bool lightSleep(uint32_t maxMs);
+void lightSleepReport();
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <Arduino.h>
+#include <type_traits>
+
+/*
+Deferred logging
+================
+Serial.print() waits on the UART, about 87 us per character at 115200 baud
+once the TX FIFO is full.  LOGE/LOGW/LOGI/LOGD only store a binary record in
+a RAM ring: the time, the level, a pointer to the format string (a literal,
+it stays in flash) and up to LOG_MAX_ARGS 32-bit arguments, ints or floats.
+The text is only formatted later, on the main thread:
+
+- logDrain() at the end of loop() prints what fits in the UART's TX buffer,
+  so it never blocks and the rest waits for the next pass
+- logFlush() prints everything, before deep sleep or a restart
+- logDump() hands the whole ring to a sink on demand (GET /LOG in OTA mode)
+
+The ring keeps the newest LOG_RING_SIZE records, so older ones are overwritten
+and counted as lost if the serial drain falls behind.  Recording is safe
+from any task, e.g. the WiFi task (a short critical section guards the ring).  Levels
+above LOG_LEVEL (build flag, default LOG_LEVEL_INFO) compile to nothing, their
+arguments are not even evaluated.  %s is only for string literals, the pointer
+is kept, not the text.
+*/
+
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE 128  //records, power of 2
+#define LOG_MAX_ARGS 4
+#define LOG_LINE_SIZE 128  //longest formatted line
+
+typedef void (*LogSink)(const char *text, size_t len);
+
+void logWrite(uint8_t level, const char *fmt, const uint32_t *args, uint8_t count, uint8_t floats);
+void logDrain();
+void logFlush();
+void logDump(LogSink sink);
+uint32_t logLost();
+
+/**
+ * @brief Raw bits of a log argument.  Floats are stored as float and flagged.
+ *
+ */
+template <typename T> inline uint32_t logBits(T value, uint8_t &floats, uint8_t index)
+{
+  if constexpr (std::is_floating_point<T>::value)
+  {
+    float f = value;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    floats |= 1 << index;
+    return bits;
+  } else if constexpr (std::is_pointer<T>::value)
+  {
+    return (uint32_t)(uintptr_t)value;
+  } else {
+    return (uint32_t)value;
+  }
+}
+
+template <typename... Args> inline void logRecord(uint8_t level, const char *fmt, Args... args)
+{
+  static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+  uint8_t floats = 0;
+  uint8_t index = 0;
+  uint32_t bits[sizeof...(Args) + 1] = {logBits(args, floats, index++)...};
+  (void)index;
+  logWrite(level, fmt, bits, sizeof...(Args), floats);
+}
+
+#define LOG_AT(level, fmt, ...) do {if ((level) <= LOG_LEVEL) {logRecord((level), fmt, ##__VA_ARGS__);}} while (0)
+#define LOGE(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define LOGW(fmt, ...) LOG_AT(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define LOGI(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define LOGD(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <Arduino.h>
+
+/*
+Metrics registry
+================
+A fixed set of counters, gauges and histograms, declared in the tables in
+Metrics.cpp and addressed by the enums below, so recording is an array
+increment and nothing is allocated.  Counters and histograms are kept in RTC
+memory (checked with a magic) so what happened in normal mode can still be
+read after the restart into OTA mode, where /metrics serves them.  Gauges are
+sampled with metricsSet() just before a scrape; so are the totals other
+modules keep themselves (events dropped, wake stub rejects), which are
+exported as counters.
+
+metricsWrite() renders the Prometheus text format line by line into a small
+stack buffer and hands each line to a sink, e.g. a chunked HTTP reply.
+*/
+
+#define METRICS_HIST_MAX_BUCKETS 10
+
+enum MetricCounter
+{
+  MC_BOOTS,
+  MC_WAKES,             //boots by a button wake from deep sleep
+  MC_ESPNOW_SENT,       //esp_now_send() accepted the packet
+  MC_ESPNOW_SEND_ERRORS,//esp_now_send() refused the packet
+  MC_ESPNOW_ACKED,      //send callback reported delivery
+  MC_ESPNOW_NOT_ACKED,  //send callback reported failure
+  MC_ESPNOW_REPLIES,    //data received from the controller
+  MC_REPLY_TIMEOUTS,    //reply waits that ran out
+  MC_BULK_FRAMES,       //bulk transfer frames sent
+  MC_BULK_RETRANSMITS,  //bulk transfer chunks sent again
+  MC_COUNT
+};
+
+enum MetricGauge
+{
+  MG_BATTERY_MV,
+  MG_HEAP_FREE,
+  MG_HEAP_LARGEST,
+  MG_EVENTS_DROPPED,
+  MG_WAKE_STUB_REJECTS,
+  MG_COUNT
+};
+
+enum MetricHist
+{
+  MH_REPLY_RTT_MS,  //send to reply from the controller
+  MH_LOOP_US,       //busy time of one loop() iteration
+  MH_COUNT
+};
+
+enum BootPhase
+{
+  BOOT_FS,       //LittleFS and the mode/calibration files
+  BOOT_RADIO,    //ESP-NOW and the web server routes, WiFi comes up later in the background
+  BOOT_DISPLAY,  //display, buttons and the first screen
+  BOOT_STATUS,   //controller status query
+  BOOT_PHASE_COUNT
+};
+
+typedef void (*MetricsSink)(const char *text, size_t len);
+
+void metricsBegin();
+void metricsInc(MetricCounter counter);
+void metricsSet(MetricGauge gauge, int32_t value);
+void metricsObserve(MetricHist hist, uint32_t value);
+void metricsBootPhase(BootPhase phase);
+void metricsWrite(MetricsSink sink);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef PAGES_H
+#define PAGES_H
+
+#include "Screens.h"
+
+//Screens of the remote, defined in Pages.cpp
+extern const Screen OTAScreen;
+extern const Screen WakeScreen;
+extern const Screen FlowScreen;
+extern const Screen NoFlowScreen;
+extern const Screen WaitingScreen;
+extern const Screen CalIntroScreen;
+extern const Screen CalStepScreen;
+extern const Screen CalSavedScreen;
+extern const Screen CalErrorScreen;
+
+//WiFi bring-up state shown on the OTA screen
+enum WifiStatus
+{
+  WIFI_ST_CONNECTING,  //joining with the saved credentials
+  WIFI_ST_PORTAL,      //configuration portal open on the "Chris Remote" AP
+  WIFI_ST_RETRY,       //waiting to retry after a failed connect
+  WIFI_ST_READY        //connected, OTA and the web server are running next to ESP-NOW
+};
+
+//Values the screens are bound to, provided by the application
+int32_t flowValue();     //flow in tenths of L/min
+int32_t battValue();     //battery state of charge (0-100)
+int32_t calPageValue();  //calibration page number
+int32_t ipValue();       //IPv4 address, first octet in the low byte
+int32_t wifiStatusValue();  //WifiStatus in the low byte, above it the retry countdown (s) or the AP channel if ESP-NOW can't follow
+
+void drawBattery(U8G2 &display, const ScreenField &field, int32_t chargeLevel);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <Arduino.h>
+
+/*
+Sampling CPU profiler
+=====================
+A hardware timer interrupts the CPU at a fixed rate and the ISR records the
+PC of the code it interrupted (from the exception frame saved on the task's
+stack) in a fixed hash table of PC -> sample count.  Nothing is allocated
+and a sample costs a few hundred cycles, so the profile shows where loop()
+really spends its time: busy waits, soft-float, U8g2 rendering, I2C.
+
+It is off until started at run time, over serial ("profile start [hz]",
+"profile stop", "profile dump") or GET /PROFILE?start=hz, ?stop.  The dump
+is a text block, one "0x<pc> <count>" line per PC between "# profile" and
+"# end" lines, so it can be cut out of a serial capture.
+tools/profile_report.py symbolises it against the firmware ELF and prints a
+flat profile.
+
+The default rate is off the 1 kHz FreeRTOS tick so the two don't run in step.
+Time in light sleep is not sampled (the CPU is stopped), samples in the idle
+task are time the loop was waiting.  PCs that find no free slot after
+PROFILE_PROBES tries are counted as lost.
+*/
+
+#define PROFILE_SLOTS 1024      //distinct PCs, power of 2
+#define PROFILE_PROBES 8        //slots tried before a sample is lost
+#define PROFILE_DEFAULT_HZ 997
+#define PROFILE_MAX_HZ 10000
+#define PROFILE_TIMER_HZ 1000000  //timer tick, 1 us
+
+typedef void (*ProfileSink)(const char *text, size_t len);
+
+bool profileStart(uint32_t hz);
+void profileStop();
+bool profileRunning();
+void profileDump(ProfileSink sink);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef RADIO_H
+#define RADIO_H
+
+#include <Arduino.h>
+
+/*
+Radio duty cycling
+==================
+In normal mode the WiFi radio is only needed around an exchange with the
+controller.  radioUpdate() stops it (esp_wifi_stop, ESP-NOW and the peer stay
+registered) once it has been idle for the linger time, and radioPrewarm()
+starts it again as soon as a command is known to be coming, e.g. on the flow
+button press that is sent DemandDelay later.
+
+Every restart is timed.  Cycling is only allowed while the slowest restart
+seen, plus a margin, fits in the lead time the caller guarantees between the
+prewarm and the send, so it never shows as latency.  A send that finds the
+radio off (no prewarm) starts it on the spot and is counted as a late start.
+The linger time grows with the restart cost so short gaps between exchanges
+do not pay for a restart.
+*/
+
+#define RADIO_LINGER_MS 200  //minimum idle time before the radio is stopped
+#define RADIO_MARGIN_MS 50   //restart must be this much shorter than the lead time
+
+void radioBegin();
+void radioSetLeadTime(uint32_t leadMs);
+void radioPrewarm();
+void radioEnsureOn();
+void radioActivity();
+void radioUpdate();
+uint32_t radioNextDeadline();
+bool radioIsOn();
+void radioReport();
+
+#endif
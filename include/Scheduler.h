@@ -0,0 +1,25 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Arduino.h>
+
+/*
+Deferred task scheduler
+=======================
+Small fixed table of one-shot tasks that run from loop() once their delay
+has passed.  Used in place of delay() so the main loop, buttons and the
+display keep running during timed transitions (e.g. the 5 s "Saving Data..."
+page at the end of calibration).
+*/
+
+#define SCHED_MAX_TASKS 8  //max number of tasks pending at the same time
+
+typedef void (*SchedTask)();
+
+bool scheduleTask(SchedTask task, uint32_t delayMs);
+void cancelTask(SchedTask task);
+bool taskPending(SchedTask task);
+void runScheduler();
+uint32_t schedulerNextDue();
+
+#endif
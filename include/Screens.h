@@ -0,0 +1,59 @@
+#ifndef SCREENS_H
+#define SCREENS_H
+
+#include <Arduino.h>
+#include <U8g2lib.h>
+
+/*
+Declarative OLED screens
+========================
+A screen is a const descriptor made of static text elements, which are drawn
+once when the screen is shown, and dynamic fields.  Each field owns a
+rectangle of the display and is bound to a value function.  screenUpdate()
+only redraws a field when its bound value changes, and then only sends the
+8 pixel tiles covering that field to the display instead of the whole buffer.
+*/
+
+#define SCREEN_MAX_FIELDS 4  //max dynamic fields on one screen
+
+struct ScreenField;
+
+typedef int32_t (*ScreenValueFn)();  //returns the value a field is bound to
+typedef void (*ScreenDrawFn)(U8G2 &display, const ScreenField &field, int32_t value);
+
+struct ScreenText
+{
+  u8g2_uint_t x, y;     //position of the string base line
+  const uint8_t *font;  //u8g2 font
+  const char *text;
+};
+
+struct ScreenField
+{
+  u8g2_uint_t x, y, w, h;  //area owned by the field (top left corner, size)
+  const uint8_t *font;     //font used by the draw function, may be NULL
+  ScreenValueFn value;     //value the field is bound to
+  ScreenDrawFn draw;       //draws the field for a value, inside its area
+};
+
+struct Screen
+{
+  const ScreenText *texts;
+  uint8_t numTexts;
+  const ScreenField *fields;
+  uint8_t numFields;
+};
+
+#define SCREEN_TEXTS(t) t, (uint8_t)(sizeof(t) / sizeof(t[0]))
+#define SCREEN_FIELDS(f) f, (uint8_t)(sizeof(f) / sizeof(f[0]))
+#define SCREEN_NO_FIELDS NULL, 0
+
+void screenBegin(U8G2 &display);
+void screenShow(const Screen *screen);
+void screenUpdate();
+void screenInvalidate();
+const Screen *screenCurrent();
+
+void drawFieldText(U8G2 &display, const ScreenField &field, const char *text);
+
+#endif
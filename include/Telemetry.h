@@ -0,0 +1,46 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+/*
+Live telemetry
+==============
+In OTA mode GET /events is a Server-Sent Events stream of what the remote
+does as it happens: flow changes, sends and replies with the pot. ADC value
+and RSSI, battery readings and button events.  GET /live is a small page
+that plots the stream.
+
+Records go into a bounded ring (main thread only, nothing is formatted until
+a client takes it).  Each client has its own cursor and one pending line,
+written with non-blocking socket sends from telemetryPump() in loop().  A
+client that can't keep up falls behind the ring and loses the oldest
+records (it is sent a "drop" event with the count) instead of ever making
+loop() wait.  With no client connected, posting a record costs nothing.
+*/
+
+#define TELEMETRY_RING_SIZE 64    //records, power of 2
+#define TELEMETRY_MAX_CLIENTS 2
+#define TELEMETRY_LINE_SIZE 128   //longest SSE message (or the response headers)
+#define TELEMETRY_PUMP_LINES 8    //most messages per client per loop()
+
+enum TelemetryType
+{
+  TEL_FLOW,      //a = flow in tenths of L/min
+  TEL_SEND,      //a = cmd, b = potADC sent
+  TEL_SEND_DONE, //a = 1 if the controller acknowledged
+  TEL_REPLY,     //a = potADC, b = RSSI
+  TEL_BATTERY,   //a = state of charge (0-100), b = mV
+  TEL_BUTTON     //a = ButtonId, b = ButtonEventType
+};
+
+extern const char TelemetryPage[];
+
+void telemetryPost(TelemetryType type, int32_t a, int32_t b);
+bool telemetryAddClient(WiFiClient &client);
+void telemetryPump();
+uint8_t telemetryClients();
+void telemetryStop();
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef WAKESTUB_H
+#define WAKESTUB_H
+
+#include <Arduino.h>
+
+/*
+Deep sleep wake stub
+====================
+A press that wakes the remote normally costs a full boot (bootloader, app
+start, LittleFS, display) even when it was only a bounce or a glitch on the
+line.  The wake stub runs from RTC fast memory straight out of deep sleep,
+before any of that.  It samples the RTC GPIO inputs of the wake pins every
+millisecond and only lets the boot continue once a pin has read pressed for
+WAKE_STUB_STABLE samples in a row.  If no pin does within WAKE_STUB_SAMPLES,
+the wake is counted as rejected and the chip goes straight back to sleep
+with ext1 still armed.  The pins seen pressed are left in RTC memory for the
+app.
+
+The pin mask is in RTC IO numbers, which are the GPIO numbers on the S2.
+*/
+
+#define WAKE_STUB_SAMPLES 30  //samples, 1 ms apart, before a wake is rejected
+#define WAKE_STUB_STABLE 5    //consecutive pressed samples that accept a wake
+
+void wakeStubArm(uint32_t pinMask);
+uint32_t wakeStubPressed();
+uint32_t wakeStubRejected();
+
+#endif
@@ -0,0 +1,281 @@
+#include "Battery.h"
+#include <esp_timer.h>
+
+static uint8_t BattADCPin;
+static esp_timer_handle_t BattTimer = NULL;
+static volatile uint32_t BattFiltered = 0;  //filtered battery mV, scaled by 2^BATT_FILTER_SHIFT
+static portMUX_TYPE BattMux = portMUX_INITIALIZER_UNLOCKED;
+
+//noise statistics of the raw samples
+static uint32_t BattSamples = 0;
+static uint64_t BattSum = 0;
+static uint64_t BattSumSq = 0;
+static uint16_t BattMin = 0xFFFF;
+static uint16_t BattMax = 0;
+RTC_DATA_ATTR static uint32_t LegacyReadMicros = 0;  //timed once per power on, by batteryStats()
+static uint32_t BattSkipped = 0;
+static volatile bool Parked = false;  //the main loop is waiting, no samples
+static volatile int64_t NextSampleUs = 0;  //esp_timer time the next sample is due
+
+static volatile BattLoad CurrentLoad = BATT_LOAD_IDLE;
+static volatile uint32_t LoadChangeTime = 0;  //millis() of the last batterySetLoad()
+static bool BattLow = false;
+
+//SoC estimate kept over deep sleep
+#define BATT_RTC_VALID 0xA5
+RTC_DATA_ATTR static uint8_t RtcSoC = 0;
+RTC_DATA_ATTR static uint8_t RtcSoCValid = 0;
+
+struct SoCPoint
+{
+  uint16_t cellMilliVolts;
+  uint8_t soc;
+};
+
+//resting Li-ion discharge curve, highest voltage first
+static const SoCPoint DischargeCurve[] = {
+  {4200, 100}, {4150, 95}, {4110, 90}, {4080, 85}, {4020, 80},
+  {3980, 75}, {3950, 70}, {3910, 65}, {3870, 60}, {3850, 55},
+  {3840, 50}, {3820, 45}, {3800, 40}, {3790, 35}, {3770, 30},
+  {3750, 25}, {3730, 20}, {3710, 15}, {3690, 10}, {3610, 5},
+  {3270, 0},
+};
+#define CURVE_POINTS (sizeof(DischargeCurve) / sizeof(DischargeCurve[0]))
+
+static uint8_t cellSoC(uint32_t cellMilliVolts);
+
+/**
+ * @brief Move the SoC stored in RTC memory towards one idle sample, so it
+ * follows the cell even over wakes too short for BATT_SOC_MIN_SAMPLES
+ *
+ */
+static void blendSoC(uint16_t milliVolts)
+{
+  int16_t soc = cellSoC((uint32_t)milliVolts * BATT_FULL_CELL_MV / BATT_FULL_ADC_MV);
+  if (RtcSoCValid != BATT_RTC_VALID)
+  {
+    RtcSoC = soc;
+    RtcSoCValid = BATT_RTC_VALID;
+    return;
+  }
+  int16_t diff = soc - RtcSoC;
+  int16_t step = diff / (1 << BATT_SOC_BLEND_SHIFT);
+  if (step == 0 && diff != 0) {step = diff > 0 ? 1 : -1;}  //a small error still closes
+  RtcSoC += step;
+}
+
+/**
+ * @brief Takes one battery sample, runs from the esp_timer task every
+ * BATT_SAMPLE_PERIOD_MS while the main loop is active, and arms the next one
+ *
+ */
+static void batterySample(void *arg)
+{
+  NextSampleUs = esp_timer_get_time() + BATT_SAMPLE_PERIOD_MS * 1000LL;
+  if (!Parked) {esp_timer_start_once(BattTimer, BATT_SAMPLE_PERIOD_MS * 1000ULL);}
+  uint32_t sinceChange = millis() - LoadChangeTime;
+  bool busy = (CurrentLoad == BATT_LOAD_TX && sinceChange < BATT_TX_TIMEOUT_MS)
+    || (CurrentLoad == BATT_LOAD_IDLE && sinceChange < BATT_SETTLE_MS);
+  if (busy)
+  {
+    BattSkipped++;
+    return;
+  }
+  uint16_t milliVolts = analogReadMilliVolts(BattADCPin);
+  if (BattSamples < BATT_SOC_MIN_SAMPLES) {blendSoC(milliVolts);}
+  uint32_t filtered = BattFiltered;
+  filtered = filtered - (filtered >> BATT_FILTER_SHIFT) + milliVolts;
+  portENTER_CRITICAL(&BattMux);
+  BattFiltered = filtered;
+  BattSamples++;
+  BattSum += milliVolts;
+  BattSumSq += (uint32_t)milliVolts * milliVolts;
+  if (milliVolts < BattMin) {BattMin = milliVolts;}
+  if (milliVolts > BattMax) {BattMax = milliVolts;}
+  portEXIT_CRITICAL(&BattMux);
+}
+
+/**
+ * @brief Start sampling the battery in the background.  Call after the ADC
+ * resolution and attenuation are set and before the first radio TX.  The
+ * filter is seeded with one reading so batteryMilliVolts() is valid straight
+ * away, and the reading, taken with the radio idle, refreshes the stored SoC.
+ *
+ * @param pin ADC pin of the battery voltage divider
+ */
+void batteryBegin(uint8_t pin)
+{
+  BattADCPin = pin;
+  uint16_t milliVolts = analogReadMilliVolts(BattADCPin);
+  BattFiltered = (uint32_t)milliVolts << BATT_FILTER_SHIFT;
+  blendSoC(milliVolts);
+
+  if (BattTimer == NULL)
+  {
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = batterySample;
+    timerArgs.dispatch_method = ESP_TIMER_TASK;
+    timerArgs.name = "battery";
+    timerArgs.skip_unhandled_events = true;
+    if (esp_timer_create(&timerArgs, &BattTimer) != ESP_OK)
+    {
+      Serial.println("Battery timer create failed");
+      return;
+    }
+  }
+  NextSampleUs = esp_timer_get_time() + BATT_SAMPLE_PERIOD_MS * 1000LL;
+  esp_timer_start_once(BattTimer, BATT_SAMPLE_PERIOD_MS * 1000ULL);
+}
+
+/**
+ * @brief Park the sample timer while the main loop waits or light sleeps, and
+ * re-arm it for the time left when the loop resumes (at once if a sample fell
+ * due meanwhile).  Main task only.
+ *
+ */
+void batteryIdle(bool idle)
+{
+  if (BattTimer == NULL || idle == Parked) {return;}
+  Parked = idle;
+  if (idle)
+  {
+    esp_timer_stop(BattTimer);
+    return;
+  }
+  int64_t left = NextSampleUs - esp_timer_get_time();
+  esp_timer_start_once(BattTimer, left > 0 ? left : 0);
+}
+
+/**
+ * @brief Tell the monitor whether the radio is busy.  Samples are skipped
+ * during a TX exchange and for BATT_SETTLE_MS after it ends.
+ *
+ * @param load current radio load
+ */
+void batterySetLoad(BattLoad load)
+{
+  if (load == CurrentLoad) {return;}
+  CurrentLoad = load;
+  LoadChangeTime = millis();
+}
+
+/**
+ * @brief Filtered battery voltage at the ADC pin
+ *
+ * @return millivolts
+ */
+uint16_t batteryMilliVolts()
+{
+  return BattFiltered >> BATT_FILTER_SHIFT;
+}
+
+/**
+ * @brief Look up the state of charge of a cell voltage on the discharge curve
+ *
+ */
+static uint8_t cellSoC(uint32_t cellMilliVolts)
+{
+  if (cellMilliVolts >= DischargeCurve[0].cellMilliVolts) {return 100;}
+  for (uint8_t i = 1; i < CURVE_POINTS; i++)
+  {
+    const SoCPoint &low = DischargeCurve[i];
+    if (cellMilliVolts >= low.cellMilliVolts)
+    {
+      const SoCPoint &high = DischargeCurve[i - 1];
+      return low.soc + (cellMilliVolts - low.cellMilliVolts) * (high.soc - low.soc)
+        / (high.cellMilliVolts - low.cellMilliVolts);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Battery state of charge.  Until enough idle samples are in after a
+ * wake the estimate stored in RTC memory is used, moved towards each sample
+ * taken so far.
+ *
+ * @return state of charge in percent
+ */
+uint8_t batterySoC()
+{
+  if (BattSamples < BATT_SOC_MIN_SAMPLES && RtcSoCValid == BATT_RTC_VALID)
+  {
+    return RtcSoC;
+  }
+  uint32_t cellMilliVolts = (uint32_t)batteryMilliVolts() * BATT_FULL_CELL_MV / BATT_FULL_ADC_MV;
+  RtcSoC = cellSoC(cellMilliVolts);
+  RtcSoCValid = BATT_RTC_VALID;
+  return RtcSoC;
+}
+
+/**
+ * @brief Check for low battery, with hysteresis between BATT_LOW_SOC and
+ * BATT_LOW_SOC_EXIT so the mode does not toggle on noise
+ *
+ */
+bool batteryLow()
+{
+  uint8_t soc = batterySoC();
+  if (BattLow && soc >= BATT_LOW_SOC_EXIT) {BattLow = false;}
+  else if (!BattLow && soc < BATT_LOW_SOC) {BattLow = true;}
+  return BattLow;
+}
+
+/**
+ * @brief Snapshot of the sample noise statistics and read timings
+ *
+ */
+void batteryStats(BatteryStats &stats)
+{
+  portENTER_CRITICAL(&BattMux);
+  uint32_t samples = BattSamples;
+  uint64_t sum = BattSum;
+  uint64_t sumSq = BattSumSq;
+  stats.minMilliVolts = BattMin;
+  stats.maxMilliVolts = BattMax;
+  portEXIT_CRITICAL(&BattMux);
+
+  stats.samples = samples;
+  stats.skipped = BattSkipped;
+  stats.meanMilliVolts = 0;
+  stats.stdDevMilliVolts = 0;
+  if (samples > 0)
+  {
+    double mean = (double)sum / samples;
+    double variance = (double)sumSq / samples - mean * mean;
+    stats.meanMilliVolts = mean;
+    stats.stdDevMilliVolts = variance > 0 ? sqrt(variance) : 0;
+  }
+
+  uint32_t start = micros();
+  volatile uint16_t milliVolts = batteryMilliVolts();
+  (void)milliVolts;
+  stats.cachedReadMicros = micros() - start;
+
+  if (LegacyReadMicros == 0)  //the old blocking average, timed once so the saving shows in the report
+  {
+    start = micros();
+    uint32_t legacy = 0;
+    for (int i = 0; i < BATT_LEGACY_SAMPLES; i++) {legacy += analogReadMilliVolts(BattADCPin);}
+    (void)legacy;
+    LegacyReadMicros = micros() - start;
+  }
+  stats.legacyReadMicros = LegacyReadMicros;
+}
+
+/**
+ * @brief Print the battery statistics and the time saved on each redraw
+ *
+ */
+void batteryReport()
+{
+  BatteryStats stats;
+  batteryStats(stats);
+  Serial.printf("Battery: SoC %u%%, %lu samples skipped for radio load\n", batterySoC(), (unsigned long)stats.skipped);
+  Serial.printf("Battery: %u mV filtered, %lu samples, mean %.1f mV, noise %.2f mV rms, min %u, max %u\n",
+    batteryMilliVolts(), (unsigned long)stats.samples, stats.meanMilliVolts, stats.stdDevMilliVolts,
+    stats.minMilliVolts, stats.maxMilliVolts);
+  Serial.printf("Battery read: blocking %lu us, cached %lu us, saved per redraw %lu us\n",
+    (unsigned long)stats.legacyReadMicros, (unsigned long)stats.cachedReadMicros,
+    (unsigned long)(stats.legacyReadMicros - stats.cachedReadMicros));
+}
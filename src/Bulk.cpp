@@ -0,0 +1,686 @@
+#include "Bulk.h"
+#include "Events.h"
+#include "Metrics.h"
+#include "Log.h"
+#include <atomic>
+#include <esp_random.h>
+#include <esp_rom_crc.h>
+
+enum BulkKind
+{
+  BK_OFFER = 0xB0,
+  BK_DATA,
+  BK_POLL,
+  BK_ACK,
+  BK_ABORT,
+  BK_REQUEST
+};
+
+enum BulkAbort
+{
+  BA_GAVE_UP,    //no ACK after BULK_MAX_RETRIES polls
+  BA_TOO_BIG,
+  BA_NO_MEMORY,
+  BA_UNKNOWN,    //data for a transfer the receiver doesn't have
+  BA_COUNT
+};
+
+enum TxState
+{
+  TX_IDLE,
+  TX_OFFER,  //waiting for the ACK of the offer
+  TX_DATA
+};
+
+#define BULK_MAP_SIZE ((BULK_MAX_CHUNKS + 7) / 8)
+
+struct TxTransfer
+{
+  uint8_t state;                     //TxState
+  uint8_t id;
+  uint8_t type;
+  uint8_t *data;                     //copy of the content
+  uint32_t size;
+  uint32_t crc;
+  uint16_t chunks;
+  uint16_t base;                     //first chunk not acked
+  uint16_t next;                     //first chunk never sent
+  uint8_t acked[BULK_MAP_SIZE];
+  uint8_t resend[BULK_MAP_SIZE];     //found lost, sent again before new chunks
+  uint32_t stamp[BULK_MAX_CHUNKS];   //frame number of the last copy sent
+  uint32_t frameNo;
+  uint32_t lastActivity;             //millis() of the last frame sent or ACK with news
+  uint8_t retries;                   //timeouts in a row
+  uint32_t start;
+  uint16_t frames;
+  uint16_t retransmits;
+};
+
+struct RxTransfer
+{
+  bool active;
+  bool done;                         //complete, kept to ack the sender's duplicates
+  uint8_t id;
+  uint8_t type;
+  uint8_t status;                    //of the final ACK
+  uint8_t *data;
+  uint32_t size;
+  uint32_t crc;
+  uint16_t chunks;
+  uint16_t base;                     //first chunk missing
+  uint8_t got[BULK_MAP_SIZE];
+  uint8_t sinceAck;                  //new chunks since the last ACK
+  uint32_t last;                     //millis() of the last frame
+  uint32_t start;
+  uint16_t frames;
+  uint16_t duplicates;
+};
+
+struct BulkResult
+{
+  bool sent;          //false for a transfer received
+  bool ok;
+  uint8_t type;
+  uint8_t loss;       //test loss in percent while it ran
+  uint32_t size;
+  uint16_t frames;    //frames sent, ACKs for a transfer received
+  uint16_t repeats;   //retransmits, duplicates for a transfer received
+  uint32_t ms;
+};
+
+struct RxSlot
+{
+  uint8_t len;
+  uint8_t frame[BULK_FRAME_MAX];
+};
+
+static BulkTransmit Transmit = NULL;
+static BulkReceived Received = NULL;
+static BulkRequested Requested = NULL;
+static TxTransfer Tx;
+static RxTransfer Rx;
+static uint8_t NextId = 0;
+static uint8_t Pending = 0;   //bulk frames handed to ESP-NOW, send callback not seen yet
+static uint8_t TestLoss = 0;
+static bool Awaiting = false;  //a REQUEST went out, its OFFER has not come yet
+static uint32_t RequestTime = 0;
+
+//frames from the WiFi task, single producer (bulkFrame) and single consumer (bulkPump)
+static RxSlot Queue[BULK_RX_QUEUE];
+static std::atomic<uint32_t> QueueHead(0);
+static std::atomic<uint32_t> QueueTail(0);
+static std::atomic<uint32_t> QueueDropped(0);
+
+static BulkResult History[BULK_HISTORY];
+static uint32_t HistoryCount = 0;
+
+static bool testBit(const uint8_t *map, uint16_t i) {return map[i >> 3] & (1 << (i & 7));}
+static void setBit(uint8_t *map, uint16_t i) {map[i >> 3] |= 1 << (i & 7);}
+static void clearBit(uint8_t *map, uint16_t i) {map[i >> 3] &= ~(1 << (i & 7));}
+
+static void putHeader(uint8_t *frame, uint8_t kind, uint8_t id, uint16_t seq)
+{
+  frame[0] = kind;
+  frame[1] = id;
+  memcpy(frame + 2, &seq, sizeof(seq));
+}
+
+/**
+ * @brief Hand a frame to the radio, or drop it when the test loss says so
+ *
+ * @return false if the radio refused it, try again later
+ */
+static bool sendFrame(const uint8_t *frame, size_t len)
+{
+  if (TestLoss && esp_random() % 100 < TestLoss) {return true;}  //lost on purpose, as if on the air
+  if (!Transmit(frame, len)) {return false;}
+  Pending++;
+  metricsInc(MC_BULK_FRAMES);
+  return true;
+}
+
+static void sendAbort(uint8_t id, uint8_t side, uint8_t reason)
+{
+  uint8_t frame[BULK_HEADER_SIZE + 1];
+  putHeader(frame, BK_ABORT, id, side);
+  frame[BULK_HEADER_SIZE] = reason;
+  sendFrame(frame, sizeof(frame));
+}
+
+static void record(bool sent, bool ok, uint8_t type, uint32_t size, uint16_t frames, uint16_t repeats, uint32_t start)
+{
+  BulkResult &r = History[HistoryCount % BULK_HISTORY];
+  r.sent = sent;
+  r.ok = ok;
+  r.type = type;
+  r.loss = TestLoss;
+  r.size = size;
+  r.frames = frames;
+  r.repeats = repeats;
+  r.ms = millis() - start;
+  HistoryCount++;
+  LOGI("Bulk %s %s, %u bytes in %u ms", bulkTypeName(type),
+    sent ? (ok ? "sent" : "not sent") : (ok ? "received" : "not received"), size, r.ms);
+}
+
+/* ---------------------------------- sender ---------------------------------- */
+
+static void txFinish(bool ok)
+{
+  record(true, ok, Tx.type, Tx.size, Tx.frames, Tx.retransmits, Tx.start);
+  free(Tx.data);
+  Tx.data = NULL;
+  Tx.state = TX_IDLE;
+}
+
+static bool txOffer()
+{
+  uint8_t frame[BULK_HEADER_SIZE + 9];
+  putHeader(frame, BK_OFFER, Tx.id, 0);
+  frame[BULK_HEADER_SIZE] = Tx.type;
+  memcpy(frame + BULK_HEADER_SIZE + 1, &Tx.size, 4);
+  memcpy(frame + BULK_HEADER_SIZE + 5, &Tx.crc, 4);
+  if (!sendFrame(frame, sizeof(frame))) {return false;}
+  Tx.frames++;
+  Tx.lastActivity = millis();
+  return true;
+}
+
+static bool txChunk(uint16_t c, bool poll)
+{
+  uint8_t frame[BULK_FRAME_MAX];
+  uint32_t offset = (uint32_t)c * BULK_CHUNK;
+  size_t n = min((uint32_t)BULK_CHUNK, Tx.size - offset);
+  putHeader(frame, poll ? BK_POLL : BK_DATA, Tx.id, c);
+  memcpy(frame + BULK_HEADER_SIZE, Tx.data + offset, n);
+  if (!sendFrame(frame, BULK_HEADER_SIZE + n)) {return false;}
+  Tx.stamp[c] = ++Tx.frameNo;
+  Tx.frames++;
+  Tx.lastActivity = millis();
+  return true;
+}
+
+/**
+ * @brief First chunk found lost, or -1
+ *
+ */
+static int32_t txLost()
+{
+  for (uint16_t c = Tx.base; c < Tx.next; c++)
+  {
+    if (testBit(Tx.resend, c)) {return c;}
+  }
+  return -1;
+}
+
+static bool txWindowOpen()
+{
+  return Tx.next < Tx.chunks && Tx.next < Tx.base + BULK_WINDOW;
+}
+
+/**
+ * @brief Send lost chunks, then new ones, while ESP-NOW takes them.  The last
+ * frame before the window closes is a POLL, so the ACK comes right away.
+ *
+ */
+static void txSendWindow()
+{
+  while (Pending < BULK_INFLIGHT)
+  {
+    int32_t c = txLost();
+    if (c >= 0)
+    {
+      clearBit(Tx.resend, c);
+      if (!txChunk(c, txLost() < 0 && !txWindowOpen()))
+      {
+        setBit(Tx.resend, c);
+        return;
+      }
+      Tx.retransmits++;
+      metricsInc(MC_BULK_RETRANSMITS);
+    } else {
+      if (!txWindowOpen()) {return;}
+      Tx.next++;  //the window is judged without this chunk
+      if (!txChunk(Tx.next - 1, !txWindowOpen()))
+      {
+        Tx.next--;
+        return;
+      }
+    }
+  }
+}
+
+static void txAck(const uint8_t *frame, int len)
+{
+  if (len < BULK_HEADER_SIZE + 5) {return;}
+  uint16_t base;
+  uint32_t bitmap;
+  memcpy(&base, frame + 2, sizeof(base));
+  memcpy(&bitmap, frame + BULK_HEADER_SIZE, sizeof(bitmap));
+  uint8_t status = frame[BULK_HEADER_SIZE + 4];
+  if (base > Tx.chunks) {return;}
+  if (Tx.state == TX_OFFER)
+  {
+    Tx.state = TX_DATA;
+    Tx.retries = 0;
+  }
+  //the newest frame the receiver is known to have, anything sent before it and still missing is lost
+  uint32_t newest = 0;
+  bool news = false;
+  for (uint16_t c = Tx.base; c < base; c++)
+  {
+    if (!testBit(Tx.acked, c))
+    {
+      setBit(Tx.acked, c);
+      news = true;
+    }
+    newest = max(newest, Tx.stamp[c]);
+  }
+  for (uint8_t i = 0; i < 32 && base + 1 + i < Tx.chunks; i++)
+  {
+    uint16_t c = base + 1 + i;
+    if (!(bitmap & (1UL << i))) {continue;}
+    if (!testBit(Tx.acked, c))
+    {
+      setBit(Tx.acked, c);
+      news = true;
+    }
+    newest = max(newest, Tx.stamp[c]);
+  }
+  while (Tx.base < Tx.chunks && testBit(Tx.acked, Tx.base)) {Tx.base++;}
+  if (base == Tx.chunks)
+  {
+    if (status != 0) {LOGW("Bulk %s: CRC mismatch at the receiver", bulkTypeName(Tx.type));}
+    txFinish(status == 0);
+    return;
+  }
+  for (uint16_t c = Tx.base; c < Tx.next; c++)
+  {
+    if (!testBit(Tx.acked, c) && Tx.stamp[c] < newest) {setBit(Tx.resend, c);}
+  }
+  if (news)
+  {
+    Tx.retries = 0;
+    Tx.lastActivity = millis();
+  }
+}
+
+/**
+ * @brief Send what the window allows, resend the offer or poll on a timeout
+ *
+ */
+static void txPump()
+{
+  if (Tx.state == TX_IDLE) {return;}
+  if (Tx.state == TX_DATA) {txSendWindow();}
+  if (millis() - Tx.lastActivity < BULK_ACK_TIMEOUT_MS) {return;}
+  if (++Tx.retries > BULK_MAX_RETRIES)
+  {
+    LOGW("Bulk %s: no ACK, giving up", bulkTypeName(Tx.type));
+    sendAbort(Tx.id, 0, BA_GAVE_UP);
+    txFinish(false);
+    return;
+  }
+  Pending = 0;  //send callbacks this late are not coming
+  if (Tx.state == TX_OFFER)
+  {
+    txOffer();
+  } else if (txChunk(Tx.base, true))
+  {
+    clearBit(Tx.resend, Tx.base);
+    Tx.retransmits++;
+    metricsInc(MC_BULK_RETRANSMITS);
+  }
+  Tx.lastActivity = millis();  //a refused frame waits for the next timeout as well
+}
+
+/* --------------------------------- receiver --------------------------------- */
+
+static void rxAck()
+{
+  uint8_t frame[BULK_HEADER_SIZE + 5];
+  uint32_t bitmap = 0;
+  for (uint8_t i = 0; i < 32 && Rx.base + 1 + i < Rx.chunks; i++)
+  {
+    if (testBit(Rx.got, Rx.base + 1 + i)) {bitmap |= 1UL << i;}
+  }
+  putHeader(frame, BK_ACK, Rx.id, Rx.base);
+  memcpy(frame + BULK_HEADER_SIZE, &bitmap, sizeof(bitmap));
+  frame[BULK_HEADER_SIZE + 4] = Rx.status;
+  if (sendFrame(frame, sizeof(frame))) {Rx.frames++;}
+  Rx.sinceAck = 0;
+}
+
+static void rxDrop()
+{
+  free(Rx.data);
+  Rx.data = NULL;
+  Rx.active = false;
+}
+
+static void rxOffer(const uint8_t *frame, int len)
+{
+  if (len < BULK_HEADER_SIZE + 9) {return;}
+  uint8_t id = frame[1];
+  if ((Rx.active || Rx.done) && id == Rx.id)  //our ACK was lost, the sender offers again
+  {
+    rxAck();
+    return;
+  }
+  if (Rx.active)
+  {
+    LOGW("Bulk %s: replaced by a new offer", bulkTypeName(Rx.type));
+    record(false, false, Rx.type, Rx.size, Rx.frames, Rx.duplicates, Rx.start);
+    rxDrop();
+  }
+  uint32_t size;
+  memcpy(&size, frame + BULK_HEADER_SIZE + 1, sizeof(size));
+  if (size == 0 || size > BULK_MAX_SIZE)
+  {
+    sendAbort(id, 1, BA_TOO_BIG);
+    return;
+  }
+  Rx.data = (uint8_t *)malloc(size);
+  if (Rx.data == NULL)
+  {
+    sendAbort(id, 1, BA_NO_MEMORY);
+    return;
+  }
+  Rx.id = id;
+  Rx.type = frame[BULK_HEADER_SIZE];
+  Rx.size = size;
+  memcpy(&Rx.crc, frame + BULK_HEADER_SIZE + 5, sizeof(Rx.crc));
+  Rx.chunks = (size + BULK_CHUNK - 1) / BULK_CHUNK;
+  Rx.base = 0;
+  memset(Rx.got, 0, sizeof(Rx.got));
+  Rx.status = 0;
+  Rx.sinceAck = 0;
+  Rx.frames = 0;
+  Rx.duplicates = 0;
+  Rx.start = Rx.last = millis();
+  Rx.active = true;
+  Rx.done = false;
+  rxAck();
+}
+
+static void rxComplete()
+{
+  bool ok = esp_rom_crc32_le(0, Rx.data, Rx.size) == Rx.crc;
+  Rx.status = ok ? 0 : 1;
+  rxAck();
+  record(false, ok, Rx.type, Rx.size, Rx.frames, Rx.duplicates, Rx.start);
+  if (ok && Received) {Received(Rx.type, Rx.data, Rx.size);}
+  rxDrop();
+  Rx.done = true;
+}
+
+static void rxData(const uint8_t *frame, int len)
+{
+  uint8_t id = frame[1];
+  uint16_t seq;
+  memcpy(&seq, frame + 2, sizeof(seq));
+  bool poll = frame[0] == BK_POLL;
+  if (id != Rx.id || (!Rx.active && !Rx.done))
+  {
+    sendAbort(id, 1, BA_UNKNOWN);
+    return;
+  }
+  if (Rx.done)  //the final ACK was lost
+  {
+    rxAck();
+    return;
+  }
+  if (seq >= Rx.chunks) {return;}
+  uint32_t offset = (uint32_t)seq * BULK_CHUNK;
+  if ((uint32_t)(len - BULK_HEADER_SIZE) != min((uint32_t)BULK_CHUNK, Rx.size - offset)) {return;}
+  Rx.last = millis();
+  if (testBit(Rx.got, seq))
+  {
+    Rx.duplicates++;
+  } else {
+    memcpy(Rx.data + offset, frame + BULK_HEADER_SIZE, len - BULK_HEADER_SIZE);
+    setBit(Rx.got, seq);
+    Rx.sinceAck++;
+  }
+  while (Rx.base < Rx.chunks && testBit(Rx.got, Rx.base)) {Rx.base++;}
+  if (Rx.base == Rx.chunks)
+  {
+    rxComplete();
+    return;
+  }
+  if (poll || Rx.sinceAck >= BULK_ACK_EVERY) {rxAck();}
+}
+
+static void rxAbort(const uint8_t *frame, int len)
+{
+  uint16_t side;
+  memcpy(&side, frame + 2, sizeof(side));
+  uint8_t reason = len > BULK_HEADER_SIZE ? frame[BULK_HEADER_SIZE] : BA_COUNT;
+  if (side == 1 && Tx.state != TX_IDLE && frame[1] == Tx.id)
+  {
+    LOGW("Bulk %s: refused by the receiver, reason %u", bulkTypeName(Tx.type), reason);
+    txFinish(false);
+  } else if (side == 0 && Rx.active && frame[1] == Rx.id)
+  {
+    LOGW("Bulk %s: the sender gave up, reason %u", bulkTypeName(Rx.type), reason);
+    record(false, false, Rx.type, Rx.size, Rx.frames, Rx.duplicates, Rx.start);
+    rxDrop();
+  }
+}
+
+static void handleFrame(const uint8_t *frame, int len)
+{
+  switch (frame[0])
+  {
+    case BK_OFFER:
+      Awaiting = false;
+      rxOffer(frame, len);
+      break;
+    case BK_DATA:
+    case BK_POLL:
+      rxData(frame, len);
+      break;
+    case BK_ACK:
+      if (Tx.state != TX_IDLE && frame[1] == Tx.id) {txAck(frame, len);}
+      break;
+    case BK_ABORT:
+      rxAbort(frame, len);
+      break;
+    case BK_REQUEST:
+      if (len > BULK_HEADER_SIZE && Requested) {Requested(frame[BULK_HEADER_SIZE]);}
+      break;
+  }
+}
+
+/* ------------------------------------ API ----------------------------------- */
+
+/**
+ * @brief Set the function that sends a frame to the peer and the ones that
+ * take what the peer sends or asks for
+ *
+ */
+void bulkBegin(BulkTransmit transmit, BulkReceived received, BulkRequested requested)
+{
+  Transmit = transmit;
+  Received = received;
+  Requested = requested;
+}
+
+/**
+ * @brief Start sending a block, the content is copied.  Main task only.
+ *
+ * @return false if a transfer is already going, or the block is empty or too big
+ */
+bool bulkSend(uint8_t type, const uint8_t *data, size_t len)
+{
+  if (Tx.state != TX_IDLE || len == 0 || len > BULK_MAX_SIZE) {return false;}
+  Tx.data = (uint8_t *)malloc(len);
+  if (Tx.data == NULL) {return false;}
+  memcpy(Tx.data, data, len);
+  Tx.id = ++NextId;
+  Tx.type = type;
+  Tx.size = len;
+  Tx.crc = esp_rom_crc32_le(0, data, len);
+  Tx.chunks = (len + BULK_CHUNK - 1) / BULK_CHUNK;
+  Tx.base = Tx.next = 0;
+  memset(Tx.acked, 0, sizeof(Tx.acked));
+  memset(Tx.resend, 0, sizeof(Tx.resend));
+  memset(Tx.stamp, 0, sizeof(Tx.stamp));
+  Tx.frameNo = 0;
+  Tx.retries = 0;
+  Tx.frames = Tx.retransmits = 0;
+  Tx.start = millis();
+  Tx.state = TX_OFFER;
+  if (!txOffer()) {Tx.lastActivity = millis();}  //offered again on the timeout
+  return true;
+}
+
+/**
+ * @brief Ask the peer to send a type.  The answer is an ordinary transfer;
+ * bulkActive() stays true until its OFFER comes or BULK_RX_TIMEOUT_MS, so
+ * the radio is kept on for it.
+ *
+ */
+bool bulkRequest(uint8_t type)
+{
+  uint8_t frame[BULK_HEADER_SIZE + 1];
+  putHeader(frame, BK_REQUEST, 0, 0);
+  frame[BULK_HEADER_SIZE] = type;
+  if (!sendFrame(frame, sizeof(frame))) {return false;}
+  Awaiting = true;
+  RequestTime = millis();
+  return true;
+}
+
+/**
+ * @brief Take a bulk frame from the ESP-NOW receive callback (WiFi task).
+ * Copies it for bulkPump() and wakes the main loop.
+ *
+ * @return false if it is not a bulk frame
+ */
+bool bulkFrame(const uint8_t *data, int len)
+{
+  if (len < BULK_HEADER_SIZE || len > BULK_FRAME_MAX || data[0] < BK_OFFER || data[0] > BK_REQUEST) {return false;}
+  uint32_t head = QueueHead.load(std::memory_order_relaxed);
+  if (head - QueueTail.load(std::memory_order_acquire) >= BULK_RX_QUEUE)
+  {
+    QueueDropped.fetch_add(1, std::memory_order_relaxed);  //lost like on the air, the protocol recovers
+    return true;
+  }
+  RxSlot &slot = Queue[head & (BULK_RX_QUEUE - 1)];
+  slot.len = len;
+  memcpy(slot.frame, data, len);
+  QueueHead.store(head + 1, std::memory_order_release);
+  eventPost(EV_BULK, 0, 0, 0);
+  return true;
+}
+
+/**
+ * @brief Handle the frames received and move the transfers on.  Call from
+ * loop().
+ *
+ */
+void bulkPump()
+{
+  uint32_t tail = QueueTail.load(std::memory_order_relaxed);
+  while (tail != QueueHead.load(std::memory_order_acquire))
+  {
+    RxSlot &slot = Queue[tail & (BULK_RX_QUEUE - 1)];
+    handleFrame(slot.frame, slot.len);
+    QueueTail.store(++tail, std::memory_order_release);
+  }
+  txPump();
+  if (Awaiting && millis() - RequestTime > BULK_RX_TIMEOUT_MS)
+  {
+    LOGW("Bulk: no offer for the request");
+    Awaiting = false;
+  }
+  if (Rx.active && millis() - Rx.last > BULK_RX_TIMEOUT_MS)
+  {
+    LOGW("Bulk %s: the sender went quiet", bulkTypeName(Rx.type));
+    record(false, false, Rx.type, Rx.size, Rx.frames, Rx.duplicates, Rx.start);
+    rxDrop();
+  }
+}
+
+/**
+ * @brief Send callbacks come in the order of the sends, so while bulk frames
+ * are waiting for theirs the next EV_SEND_DONE belongs to bulk
+ *
+ * @return true if the event was taken
+ */
+bool bulkSendDone()
+{
+  if (Pending == 0) {return false;}
+  Pending--;
+  return true;
+}
+
+bool bulkActive()
+{
+  return Tx.state != TX_IDLE || Rx.active || Awaiting;
+}
+
+/**
+ * @brief Time until bulkPump() has to run with no frame coming in
+ *
+ * @return milliseconds, UINT32_MAX with no transfer going
+ */
+uint32_t bulkNextDeadline()
+{
+  uint32_t next = UINT32_MAX;
+  uint32_t now = millis();
+  if (Tx.state != TX_IDLE)
+  {
+    if (Tx.state == TX_DATA && Pending < BULK_INFLIGHT && (txLost() >= 0 || txWindowOpen())) {return 0;}
+    uint32_t elapsed = now - Tx.lastActivity;
+    next = elapsed >= BULK_ACK_TIMEOUT_MS ? 0 : BULK_ACK_TIMEOUT_MS - elapsed;
+  }
+  if (Rx.active)
+  {
+    uint32_t elapsed = now - Rx.last;
+    next = min(next, elapsed >= BULK_RX_TIMEOUT_MS ? 0 : BULK_RX_TIMEOUT_MS - elapsed + 1);
+  }
+  if (Awaiting)
+  {
+    uint32_t elapsed = now - RequestTime;
+    next = min(next, elapsed >= BULK_RX_TIMEOUT_MS ? 0 : BULK_RX_TIMEOUT_MS - elapsed + 1);
+  }
+  return next;
+}
+
+/**
+ * @brief Drop this share of the outgoing bulk frames on purpose, 0 for none
+ *
+ */
+void bulkSetTestLoss(uint8_t percent)
+{
+  TestLoss = min(percent, (uint8_t)100);
+}
+
+const char *bulkTypeName(uint8_t type)
+{
+  static const char *const names[BULK_TYPE_COUNT] = {"log", "cal", "metrics"};
+  return type < BULK_TYPE_COUNT ? names[type] : "?";
+}
+
+/**
+ * @brief The last transfers, newest first, with their throughput
+ *
+ * @return number of characters written
+ */
+size_t bulkReport(char *buf, size_t len)
+{
+  int n = snprintf(buf, len, "test loss %u%%, %s, %lu frames dropped on a full queue\n", TestLoss,
+    bulkActive() ? "busy" : "idle", (unsigned long)QueueDropped.load(std::memory_order_relaxed));
+  uint32_t count = min(HistoryCount, (uint32_t)BULK_HISTORY);
+  for (uint32_t i = 0; i < count && n < (int)len; i++)
+  {
+    const BulkResult &r = History[(HistoryCount - 1 - i) % BULK_HISTORY];
+    float kBs = r.ms ? r.size / (float)r.ms : 0;  //bytes per ms is kB/s
+    n += snprintf(buf + n, len - n, "%s %s %lu B: %u frames, %u %s, %lu ms, %.1f kB/s, loss %u%%, %s\n",
+      r.sent ? "sent" : "recv", bulkTypeName(r.type), (unsigned long)r.size, r.frames, r.repeats,
+      r.sent ? "resent" : "dup", (unsigned long)r.ms, kBs, r.loss, r.ok ? "ok" : "failed");
+  }
+  return n < (int)len ? n : len - 1;
+}
@@ -0,0 +1,358 @@
+#include "Buttons.h"
+#include "Events.h"
+#include <soc/gpio_reg.h>
+
+#define MS_TO_US(ms) ((uint32_t)(ms) * 1000)
+
+struct ButtonState
+{
+  uint8_t pin;
+  bool pressed;         //debounced state
+  uint8_t rawLevel;     //level after the last edge
+  uint32_t rawTime;     //time of the last edge, us
+  uint32_t pressTime;   //time the debounced press started, us
+  bool holdSent;
+  uint32_t nextRepeat;  //time of the next auto-repeat event, us
+  uint32_t repeatInterval;  //ms
+};
+
+static ButtonState Buttons[BTN_COUNT];
+static uint8_t RepeatMask = 0;  //bit per ButtonId that auto-repeats
+
+//chord recognition
+static uint8_t ChordMask = 0;        //bit per ButtonId in the chord, 0 if off
+static uint32_t ChordWindowUs = 0;
+static int8_t ChordPending = -1;     //member whose press is held back
+static uint32_t ChordPendingTime = 0;
+static bool ChordActive = false;     //chord fired, members are swallowed until all are up
+
+//event queue, written by buttonsUpdate() and read by the consumers in loop()
+static ButtonEvent EventQueue[BTN_EVENT_QUEUE];
+static uint8_t EventHead = 0;
+static uint8_t EventTail = 0;
+
+/**
+ * @brief Post the edge to the event queue.  Reads the GPIO input register
+ * directly, which is safe from IRAM while flash is busy.
+ *
+ */
+static void IRAM_ATTR edgeISR(uint8_t button)
+{
+  uint8_t level = (REG_READ(GPIO_IN_REG) >> Buttons[button].pin) & 1;
+  eventPostFromISR(EV_BUTTON, button, level, 0);
+}
+
+static void IRAM_ATTR upEdge() {edgeISR(BTN_UP);}
+static void IRAM_ATTR downEdge() {edgeISR(BTN_DOWN);}
+static void IRAM_ATTR calEdge() {edgeISR(BTN_CAL);}
+static void IRAM_ATTR otaEdge() {edgeISR(BTN_OTA);}
+
+static void pushEvent(uint8_t button, uint8_t type, uint32_t time)
+{
+  if ((uint8_t)(EventHead - EventTail) >= BTN_EVENT_QUEUE)
+  {
+    EventTail++;  //full, drop the oldest event
+  }
+  ButtonEvent &event = EventQueue[EventHead & (BTN_EVENT_QUEUE - 1)];
+  event.button = button;
+  event.type = type;
+  event.time = time;
+  EventHead++;
+}
+
+static bool chordMember(uint8_t id)
+{
+  return (ChordMask & (1 << id)) != 0;
+}
+
+/**
+ * @brief Emit the press that was held back for the chord window
+ *
+ */
+static void flushChordPending()
+{
+  if (ChordPending < 0) {return;}
+  pushEvent(ChordPending, BTN_PRESS, ChordPendingTime);
+  ChordPending = -1;
+}
+
+/**
+ * @brief Chord handling of a debounced press or release of a member
+ *
+ * @return true if the event was taken by the chord and must not be emitted
+ */
+static bool chordEdge(uint8_t id, bool pressed, uint32_t time)
+{
+  if (ChordActive)
+  {
+    if (!pressed)
+    {
+      bool anyDown = false;
+      for (uint8_t i = 0; i < BTN_COUNT; i++)
+      {
+        if (chordMember(i) && Buttons[i].pressed) {anyDown = true;}
+      }
+      ChordActive = anyDown;
+    }
+    return true;
+  }
+  if (!pressed)
+  {
+    if (ChordPending == id) {flushChordPending();}  //a tap shorter than the window
+    return false;
+  }
+  if (ChordPending >= 0 && ChordPending != id && time - ChordPendingTime <= ChordWindowUs)
+  {
+    uint8_t downMask = 0;
+    for (uint8_t i = 0; i < BTN_COUNT; i++)
+    {
+      if (chordMember(i) && Buttons[i].pressed) {downMask |= (1 << i);}
+    }
+    if (downMask == ChordMask)
+    {
+      ChordPending = -1;
+      ChordActive = true;
+      pushEvent(id, BTN_CHORD, time);
+      return true;
+    }
+  }
+  flushChordPending();  //a press outside the window of the earlier one
+  ChordPending = id;
+  ChordPendingTime = time;
+  return true;
+}
+
+/**
+ * @brief The raw level of a button has been stable long enough, update the
+ * debounced state and emit press or release
+ *
+ */
+static void settle(uint8_t id, uint32_t time)
+{
+  ButtonState &button = Buttons[id];
+  bool pressed = (button.rawLevel == LOW);
+  if (pressed == button.pressed) {return;}
+  button.pressed = pressed;
+  if (pressed)
+  {
+    button.pressTime = time;
+    button.holdSent = false;
+    button.repeatInterval = BTN_REPEAT_START_MS;
+  }
+  if (chordMember(id) && chordEdge(id, pressed, time)) {return;}
+  pushEvent(id, pressed ? BTN_PRESS : BTN_RELEASE, time);
+}
+
+/**
+ * @brief Start the engine.  The pins must already be set up as inputs with
+ * pull ups, pressed reads LOW.
+ *
+ * @param pins GPIO of each ButtonId
+ * @param repeatMask bit (1 << ButtonId) set for every button that auto-repeats
+ */
+void buttonsBegin(const uint8_t pins[BTN_COUNT], uint8_t repeatMask)
+{
+  static void (*const isrs[BTN_COUNT])() = {upEdge, downEdge, calEdge, otaEdge};
+  RepeatMask = repeatMask;
+  for (uint8_t i = 0; i < BTN_COUNT; i++)
+  {
+    ButtonState &button = Buttons[i];
+    button.pin = pins[i];
+    button.rawLevel = digitalRead(button.pin);
+    button.rawTime = eventTimeNow();
+    button.pressed = (button.rawLevel == LOW);
+    button.pressTime = button.rawTime;
+    button.holdSent = false;
+    button.repeatInterval = BTN_REPEAT_START_MS;
+    attachInterrupt(digitalPinToInterrupt(button.pin), isrs[i], CHANGE);
+  }
+}
+
+/**
+ * @brief Feed an EV_BUTTON edge from the event queue to the debounce state
+ * machine.  The level before the edge counts if it lasted BTN_DEBOUNCE_MS.
+ *
+ * @param id ButtonId
+ * @param level pin level after the edge
+ * @param time event time (us)
+ */
+void buttonsEdge(uint8_t id, uint8_t level, uint32_t time)
+{
+  if (id >= BTN_COUNT) {return;}
+  ButtonState &button = Buttons[id];
+  if (time - button.rawTime >= MS_TO_US(BTN_DEBOUNCE_MS))
+  {
+    settle(id, button.rawTime);  //the level before this edge was stable
+  }
+  button.rawLevel = level;
+  button.rawTime = time;
+}
+
+/**
+ * @brief Recognise the buttons in mask pressed together as a chord
+ *
+ * @param mask bit (1 << ButtonId) for each member, 0 turns chords off
+ * @param windowMs longest time between the first and the last press
+ */
+void buttonsSetChord(uint8_t mask, uint16_t windowMs)
+{
+  flushChordPending();
+  ChordMask = mask;
+  ChordWindowUs = MS_TO_US(windowMs);
+  ChordActive = false;
+}
+
+/**
+ * @brief Queue the press that woke the chip from deep sleep, timed at boot.
+ * The release follows at once if the button is already up, otherwise the
+ * press is held from boot and the hold and repeat timers run as usual.
+ * Call right after buttonsBegin().
+ *
+ * @param id ButtonId
+ */
+void buttonsWakePress(uint8_t id)
+{
+  if (id >= BTN_COUNT) {return;}
+  ButtonState &button = Buttons[id];
+  pushEvent(id, BTN_PRESS, 0);
+  if (button.pressed)
+  {
+    button.pressTime = 0;
+  } else {
+    pushEvent(id, BTN_RELEASE, button.rawTime);
+  }
+}
+
+/**
+ * @brief Settle levels that have been stable long enough and run the hold and
+ * repeat timers.  Call from loop() and from any wait loop.
+ *
+ */
+void buttonsUpdate()
+{
+  uint32_t now = eventTimeNow();
+  for (uint8_t i = 0; i < BTN_COUNT; i++)
+  {
+    ButtonState &button = Buttons[i];
+    if (now - button.rawTime >= MS_TO_US(BTN_DEBOUNCE_MS))
+    {
+      settle(i, button.rawTime);
+    }
+    if (!button.pressed || i == ChordPending) {continue;}
+    if (ChordActive && chordMember(i)) {continue;}  //no hold or repeat from a chord
+    if (!button.holdSent && now - button.pressTime >= MS_TO_US(BTN_HOLD_MS))
+    {
+      button.holdSent = true;
+      button.nextRepeat = now + MS_TO_US(button.repeatInterval);
+      pushEvent(i, BTN_HOLD, now);
+    } else if (button.holdSent && (RepeatMask & (1 << i)) && (int32_t)(now - button.nextRepeat) >= 0)
+    {
+      pushEvent(i, BTN_REPEAT, now);
+      button.repeatInterval = button.repeatInterval * BTN_REPEAT_ACCEL / 100;
+      if (button.repeatInterval < BTN_REPEAT_MIN_MS) {button.repeatInterval = BTN_REPEAT_MIN_MS;}
+      button.nextRepeat = now + MS_TO_US(button.repeatInterval);
+    }
+  }
+  //the other press may be debounced after the window, the edge time decides
+  if (ChordPending >= 0 && now - ChordPendingTime > ChordWindowUs + MS_TO_US(BTN_DEBOUNCE_MS))
+  {
+    flushChordPending();
+  }
+}
+
+/**
+ * @brief Time until buttonsUpdate() has something to do: a level to settle,
+ * a hold or an auto-repeat
+ *
+ * @return milliseconds (rounded up), 0 if due now, UINT32_MAX if all buttons are idle
+ */
+uint32_t buttonsNextDeadline()
+{
+  uint32_t now = eventTimeNow();
+  uint32_t next = UINT32_MAX;
+  for (uint8_t i = 0; i < BTN_COUNT; i++)
+  {
+    ButtonState &button = Buttons[i];
+    uint32_t due = UINT32_MAX;
+    if ((button.rawLevel == LOW) != button.pressed)
+    {
+      due = button.rawTime + MS_TO_US(BTN_DEBOUNCE_MS);
+    } else if (i == ChordPending)
+    {
+      due = ChordPendingTime + ChordWindowUs + MS_TO_US(BTN_DEBOUNCE_MS) + 1;
+    } else if (ChordActive && chordMember(i))
+    {
+      continue;  //swallowed until released
+    } else if (button.pressed && !button.holdSent)
+    {
+      due = button.pressTime + MS_TO_US(BTN_HOLD_MS);
+    } else if (button.pressed && (RepeatMask & (1 << i)))
+    {
+      due = button.nextRepeat;
+    }
+    if (due == UINT32_MAX) {continue;}
+    int32_t left = (int32_t)(due - now);
+    uint32_t leftMs = left <= 0 ? 0 : ((uint32_t)left + 999) / 1000;
+    if (leftMs < next) {next = leftMs;}
+  }
+  return next;
+}
+
+/**
+ * @brief Check if any button pin reads pressed right now
+ *
+ */
+bool buttonsAnyLow()
+{
+  for (uint8_t i = 0; i < BTN_COUNT; i++)
+  {
+    if (digitalRead(Buttons[i].pin) == LOW) {return true;}
+  }
+  return false;
+}
+
+/**
+ * @brief Re-read the pins after their interrupts were off (e.g. light sleep)
+ * and feed any level change as an edge
+ *
+ */
+void buttonsResync()
+{
+  uint32_t now = eventTimeNow();
+  for (uint8_t i = 0; i < BTN_COUNT; i++)
+  {
+    uint8_t level = digitalRead(Buttons[i].pin);
+    if (level != Buttons[i].rawLevel) {buttonsEdge(i, level, now);}
+  }
+}
+
+/**
+ * @brief Take the oldest button event from the queue
+ *
+ * @return false if the queue is empty
+ */
+bool buttonEventGet(ButtonEvent &event)
+{
+  if (EventTail == EventHead) {return false;}
+  event = EventQueue[EventTail & (BTN_EVENT_QUEUE - 1)];
+  EventTail++;
+  return true;
+}
+
+/**
+ * @brief Debounced state of a button
+ *
+ */
+bool buttonDown(ButtonId button)
+{
+  return Buttons[button].pressed;
+}
+
+const char *buttonEventName(const ButtonEvent &event)
+{
+  static const char *const buttons[BTN_COUNT] = {"Up", "Down", "Cal", "OTA"};
+  static const char *const types[] = {"press", "release", "hold", "repeat", "chord"};
+  static char name[16];
+  snprintf(name, sizeof(name), "%s %s", buttons[event.button], types[event.type]);
+  return name;
+}
@@ -0,0 +1,128 @@
+#include "CpuPower.h"
+#include "Energy.h"
+#include <esp_pm.h>
+#include <esp_timer.h>
+
+static esp_pm_lock_handle_t BoostLock = NULL;
+static bool Boosted = false;
+static bool PmActive = false;
+static bool AutoLightSleep = false;
+
+static uint64_t BoostUs = 0;      //time at max frequency since the wake
+static int64_t BoostStart = 0;
+static int64_t WakeToDisplayUs = -1;
+static bool Baseline = false;     //this wake runs with the policy off
+
+//wake to display, running average in us and sample count: [0] policy off, [1] on
+RTC_DATA_ATTR static uint32_t LatencyAvgUs[2] = {0, 0};
+RTC_DATA_ATTR static uint16_t LatencyCount[2] = {0, 0};
+#if CPU_BASELINE_EVERY > 0
+RTC_DATA_ATTR static uint16_t WakeCount = 0;
+#endif
+
+/**
+ * @brief Configure power management and create the boost lock.  Call first
+ * thing in setup(); the boost is taken at once so the boot runs at full speed.
+ *
+ * @return false if power management is not available in this build
+ */
+bool cpuPowerBegin()
+{
+#if CPU_BASELINE_EVERY > 0
+  Baseline = (WakeCount++ % CPU_BASELINE_EVERY) == 0;
+#endif
+  if (Baseline)
+  {
+    energySet(EN_CPU_BOOST, true);  //fixed at max for the whole wake
+    return false;
+  }
+  esp_pm_config_t config = {};
+  config.max_freq_mhz = CPU_MAX_MHZ;
+  config.min_freq_mhz = CPU_MIN_MHZ;
+  config.light_sleep_enable = true;
+  esp_err_t result = esp_pm_configure(&config);
+  if (result != ESP_OK)
+  {
+    config.light_sleep_enable = false;  //tickless idle not built in, scale the clock only
+    result = esp_pm_configure(&config);
+  } else {
+    AutoLightSleep = true;
+  }
+  if (result == ESP_OK) {result = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "busy", &BoostLock);}
+  PmActive = (result == ESP_OK);
+  if (!PmActive)
+  {
+    Serial.printf("Power management not available (%d), CPU stays at %d MHz\n", (int)result, CPU_MAX_MHZ);
+    energySet(EN_CPU_BOOST, true);  //always at max
+  }
+  cpuBoost(true);
+  return PmActive;
+}
+
+/**
+ * @brief Hold or release max CPU frequency.  Not nested: the main task takes
+ * it when it starts work and drops it when it blocks.
+ *
+ */
+void cpuBoost(bool on)
+{
+  if (on == Boosted || !PmActive) {return;}
+  Boosted = on;
+  int64_t now = esp_timer_get_time();
+  if (on)
+  {
+    BoostStart = now;
+  } else {
+    BoostUs += now - BoostStart;
+  }
+  if (on) {esp_pm_lock_acquire(BoostLock);}
+  else {esp_pm_lock_release(BoostLock);}
+  energySet(EN_CPU_BOOST, on);
+}
+
+/**
+ * @brief Record the wake to first display latency.  Call once the first
+ * screen is on the OLED.
+ *
+ */
+void cpuMarkDisplayed()
+{
+  if (WakeToDisplayUs >= 0) {return;}
+  WakeToDisplayUs = esp_timer_get_time();
+  uint8_t policy = Baseline ? 0 : 1;
+  if (LatencyCount[policy] == 0)
+  {
+    LatencyAvgUs[policy] = WakeToDisplayUs;
+  } else {
+    LatencyAvgUs[policy] += ((int32_t)WakeToDisplayUs - (int32_t)LatencyAvgUs[policy]) >> CPU_LATENCY_SHIFT;
+  }
+  if (LatencyCount[policy] < UINT16_MAX) {LatencyCount[policy]++;}
+}
+
+/**
+ * @brief Print the time at max frequency, the wake to display latency and
+ * what the policy adds to it over the baseline wakes.  Call just before deep
+ * sleep.
+ *
+ */
+void cpuPowerReport()
+{
+  uint64_t awake = esp_timer_get_time();
+  uint64_t boost = PmActive ? BoostUs + (Boosted ? awake - BoostStart : 0) : awake;
+  Serial.printf("CPU: %s, %d-%d MHz%s, boosted %lu of %lu ms awake, wake to display %ld ms\n",
+    Baseline ? "baseline, policy off" : PmActive ? "scaling" : "fixed", CPU_MIN_MHZ, CPU_MAX_MHZ,
+    AutoLightSleep ? " + auto light sleep" : "",
+    (unsigned long)(boost / 1000), (unsigned long)(awake / 1000), (long)(WakeToDisplayUs / 1000));
+  if (LatencyCount[0] > 0 && LatencyCount[1] > 0)
+  {
+    Serial.printf("CPU: wake to display %.1f ms with the policy (%u wakes), %.1f ms without (%u wakes), %+.1f ms\n",
+      LatencyAvgUs[1] / 1000.0f, LatencyCount[1], LatencyAvgUs[0] / 1000.0f, LatencyCount[0],
+      ((int32_t)LatencyAvgUs[1] - (int32_t)LatencyAvgUs[0]) / 1000.0f);
+  }
+  if (PmActive)
+  {
+    //what the unboosted time would have cost at max frequency
+    float savedMAh = EnergyCurrentMA[EN_CPU_BOOST] * (float)(awake - boost) / 3.6e9f;
+    Serial.printf("CPU: scaling saved about %.4f mAh this interaction\n", savedMAh);
+  }
+}
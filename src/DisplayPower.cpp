@@ -0,0 +1,161 @@
+#include "DisplayPower.h"
+#include "Energy.h"
+
+DisplayTimers DisplayIdleTimers = {5000, 10000};
+DisplayTimers DisplayWaitTimers = {2000, 6000};
+
+static U8G2 *Display = NULL;
+static DisplayProfile Profile = DISP_PROFILE_IDLE;
+static DisplayLevel Level = DISP_FULL;
+static bool LowPower = false;
+static uint32_t LastActivity = 0;   //millis() of the last input or new data
+static uint32_t LevelStart = 0;     //millis() the current level started
+
+//time at each level in the current interaction
+static uint32_t FullMs = 0;
+static uint32_t DimMs = 0;
+static uint32_t BlankMs = 0;
+
+/**
+ * @brief Add the time spent at the current level to the interaction totals
+ *
+ */
+static void accountLevel()
+{
+  uint32_t now = millis();
+  uint32_t spent = now - LevelStart;
+  LevelStart = now;
+  if (Level == DISP_FULL) {FullMs += spent;}
+  else if (Level == DISP_DIM) {DimMs += spent;}
+  else {BlankMs += spent;}
+}
+
+static void setLevel(DisplayLevel level)
+{
+  if (level == Level || Display == NULL) {return;}
+  accountLevel();
+  if (level == DISP_BLANK)
+  {
+    Display->setPowerSave(1);
+  } else {
+    if (Level == DISP_BLANK) {Display->setPowerSave(0);}
+    Display->setContrast(level == DISP_DIM ? DISP_CONTRAST_DIM : DISP_CONTRAST_FULL);
+  }
+  Level = level;
+  energySet(EN_DISPLAY, level != DISP_BLANK);
+}
+
+/**
+ * @brief Start managing the display power.  Call after u8g2.begin()
+ *
+ */
+void displayPowerBegin(U8G2 &display)
+{
+  Display = &display;
+  Display->setContrast(DISP_CONTRAST_FULL);
+  energySet(EN_DISPLAY, true);
+  LastActivity = millis();
+  LevelStart = LastActivity;
+}
+
+/**
+ * @brief Input or new data: restore full contrast at once and restart the
+ * level timers.  The interaction goes on, its totals are kept.
+ *
+ */
+void displayActivity()
+{
+  setLevel(DISP_FULL);
+  LastActivity = millis();
+}
+
+/**
+ * @brief Select the timers to use, the timers are not restarted
+ *
+ */
+void displaySetProfile(DisplayProfile profile)
+{
+  Profile = profile;
+}
+
+/**
+ * @brief In the low battery mode the dim and blank timers are halved
+ *
+ */
+void displaySetLowPower(bool lowPower)
+{
+  LowPower = lowPower;
+}
+
+/**
+ * @brief Dim and blank times of the current profile
+ *
+ */
+static void currentTimers(uint32_t &dimAfter, uint32_t &blankAfter)
+{
+  const DisplayTimers &timers = (Profile == DISP_PROFILE_WAIT) ? DisplayWaitTimers : DisplayIdleTimers;
+  dimAfter = LowPower ? timers.dimAfterMs / 2 : timers.dimAfterMs;
+  blankAfter = LowPower ? timers.blankAfterMs / 2 : timers.blankAfterMs;
+}
+
+/**
+ * @brief Step the display down when its timers run out.  Call from loop() and
+ * from any wait loop.
+ *
+ */
+void displayPowerUpdate()
+{
+  uint32_t dimAfter, blankAfter;
+  currentTimers(dimAfter, blankAfter);
+  uint32_t sinceActivity = millis() - LastActivity;
+  if (sinceActivity >= blankAfter) {setLevel(DISP_BLANK);}
+  else if (sinceActivity >= dimAfter) {setLevel(DISP_DIM);}
+}
+
+/**
+ * @brief Time until the display steps down again
+ *
+ * @return milliseconds, UINT32_MAX once the display is blank
+ */
+uint32_t displayPowerNextDeadline()
+{
+  uint32_t dimAfter, blankAfter;
+  currentTimers(dimAfter, blankAfter);
+  uint32_t sinceActivity = millis() - LastActivity;
+  uint32_t due = (Level == DISP_FULL) ? dimAfter : blankAfter;
+  if (Level == DISP_BLANK) {return UINT32_MAX;}
+  return sinceActivity >= due ? 0 : due - sinceActivity;
+}
+
+DisplayLevel displayLevel()
+{
+  return Level;
+}
+
+/**
+ * @brief Print the display time at each level for the current interaction.
+ * The on-time saved is the time spent dim or blank instead of at full contrast.
+ * Call once, at the end of the interaction.
+ *
+ */
+void displayPowerReport()
+{
+  accountLevel();
+  uint32_t total = FullMs + DimMs + BlankMs;
+  if (total == 0) {return;}
+  Serial.printf("Display: full %lu ms, dim %lu ms, blank %lu ms, saved %lu ms of %lu ms on-time\n",
+    (unsigned long)FullMs, (unsigned long)DimMs, (unsigned long)BlankMs,
+    (unsigned long)(DimMs + BlankMs), (unsigned long)total);
+}
+
+/**
+ * @brief Clear the totals, next to energyEndInteraction() before deep sleep or a restart
+ *
+ */
+void displayEndInteraction()
+{
+  accountLevel();
+  FullMs = 0;
+  DimMs = 0;
+  BlankMs = 0;
+}
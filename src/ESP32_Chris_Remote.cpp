@@ -12,6 +12,27 @@
 #include <Wire.h> // Include the Wire library for I2C communication
 #include <SPI.h>  // Include the SPI library for SPI communication
 #include<esp_now.h>
+#include <esp_wifi.h>
+#include "Scheduler.h"
+#include "Screens.h"
+#include "Pages.h"
+#include "Battery.h"
+#include "DisplayPower.h"
+#include "Buttons.h"
+#include "Events.h"
+#include "LightSleep.h"
+#include "Energy.h"
+#include "CpuPower.h"
+#include "Radio.h"
+#include "IdleTimeout.h"
+#include "WakeStub.h"
+#include "FirmwareUpdate.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "Telemetry.h"
+#include "Bulk.h"
+#include "Profiler.h"
+#include <esp_heap_caps.h>
 
 /**WARNING*********************************************************
  * *******WARNING**************************************************
@@ -56,14 +77,16 @@ source. They are pins: 0-21 for ESP32-S2
 
 //**Modes of operation variables */
 
-volatile bool OTAMode=false; // Flag to check if OTA mode is activated
-volatile bool updateOTA=false; // Flag to check if OTA update is needed
-volatile bool CalMode=false;
-volatile int8_t rssiVal;
-uint32_t LastOTAPress=0; // Last time the OTA button was pressed
-uint32_t PressInterval=500; // Interval to check for OTA button press
+//Only changed on the main thread by setMode().  ISRs and the WiFi task post events instead.
+enum RemoteMode {MODE_NORMAL, MODE_CAL, MODE_OTA};
+bool OTAMode=false; // Flag to check if OTA mode is activated
+bool updateOTA=false; // Flag to bring WiFi up or down after OTA mode was toggled
+bool OTAPageShown=false; // OTA mode shows the WiFi page until the first flow press
+bool CalMode=false;
+int8_t rssiVal;
 uint32_t LastCalPress=0; // Last time the Cal button was pressed
 uint32_t LastDemandTime=0;// Last time up or down flow button pressed
+uint32_t DemandDelay=1000; //time after the last flow button press before the controller is updated
 bool UpButtonPressed=false;
 bool DownButtonPressed=false;
 bool DemandButtonPressed=false;//An up or down demand button was pressed
@@ -71,14 +94,18 @@ bool SleepPermmissive=false;//flag to allow to go to sleep
 uint32_t preMillis=0; //  Previous Millis, used to wait for ESP-NOW data
 uint32_t timeoutMillis=30000; //time to wait for new data once sent.
 uint32_t LastIdleTime=0; //Last time idle time was set
-uint32_t IdleInterval=15000;//Idle time before sleeping
-uint32_t LastEnterActive=0;
-uint32_t EnterDelayInterval=1000;
+uint32_t IdleInterval=15000;//Idle time before sleeping, until the adaptive timeout has learned the usage
+uint32_t LowBattIdleInterval=5000;//Idle time before sleeping when the battery is low
+bool LowPowerMode=false;//battery is low, shorten the time awake
+uint16_t EnterChordWindow=BTN_CHORD_WINDOW_MS; //max time between the Up and Down presses of "Enter"
 uint8_t BattState=0;
 
 bool DeliverySuccess=false; // Flag to check if the data was delivered successfully
+bool SendPending=false; // Waiting for the send callback of the last packet
+uint32_t SendDoneTimeout=100; // Max time to wait for the send callback
+uint32_t LoopWaitMax=20; // Max time loop() blocks waiting for an event
+uint32_t SendTimeUs=0; // event time of the last send, 0 once its reply is in, for the reply RTT
 bool NewData=false; //flag to check if we've recieved a new data command
-bool EnterActive=true; //flag to allow up and down buttons to activate and "Enter" command
 uint16_t CalPageNum=1; //current calibration page number
 
 uint16_t CalData[17]; //array to hold calibration data
@@ -89,6 +116,7 @@ unsigned long previousMillis = 0; // Store the last time O2Flow was updated
 const long interval = 1000; // Interval for updates (1 second)
 
 uint8_t ControllerAddress[]={0x68, 0xB6, 0xB3, 0x08, 0xD7, 0x6A}; //MAC address of Chris Controller
+#define ESPNOW_CHANNEL 1  //channel the controller listens on, the portal AP is kept on it too
 
 struct DataStruct
 {
@@ -105,6 +133,7 @@ WiFiManager wifiManager;  //start wifiManager
 
 // Define bitmask for multiple GPIOs
 uint64_t bitmask = BUTTON_PIN_BITMASK(DownButton) | BUTTON_PIN_BITMASK(UpButton);
+int8_t WakeButton=-1; //ButtonId that woke the remote from deep sleep, -1 for any other boot
 //RTC_DATA_ATTR int bootCount = 0; //RTC_DATA_ATTR is used to store data in RTC memory
 //RTC memory is retained over deep sleep and reboots
 
@@ -123,6 +152,14 @@ esp_now_peer_info_t peerInfo;
 //String ESPHostName="Salt_Monitor";
 String ESPHostName="Chris_Remote";
 bool WiFiExits = false;  // flag to see if we should have a WiFi connection
+#define WIFI_CONNECT_TIMEOUT 15000  //time to join with the saved credentials before opening the portal
+#define WIFI_PORTAL_TIMEOUT 120  //seconds the configuration portal stays open
+#define WIFI_RETRY_MIN 5000  //first backoff after the portal times out
+#define WIFI_RETRY_MAX 300000  //the backoff doubles up to this
+WifiStatus WiFiState = WIFI_ST_CONNECTING;
+uint32_t WiFiStateStart = 0;  //millis() the current WiFi state started
+uint32_t WiFiRetryDelay = WIFI_RETRY_MIN;  //backoff before the next retry
+uint32_t WiFiRetryAt = 0;  //millis() of the pending retry
 
 /**
  * @brief start the LittleFS file system.  For first time, set FORMAT_LITTLEFS_IF_FAILED to true
@@ -138,50 +175,518 @@ void prepareLittleFS()
 }
 
 /**
- * @brief looks to see if the OTAMode button is pressed 
+ * @brief Change the operating mode.  Every mode transition goes through here,
+ * on the main thread.  OTA mode is saved to file and WiFi is brought up or
+ * down by loop(), ESP-NOW keeps running either way.
  * 
- * Note: IRAM_ATTR should be used with ESP32 chips.  This places the interupt routine
- * in RAM.  This is faster than keeping it in flash.  Also, the interrupt may be 
- * missed if flash is being used at the time of interrupt if it's not placed in RAM
  */
-void IRAM_ATTR OTAButtonPress()
+void setMode(RemoteMode mode)
 {
-  if(millis()-LastOTAPress>PressInterval) // prevent button bouncing
+  bool ota = (mode==MODE_OTA);
+  bool cal = (mode==MODE_CAL);
+  if(ota != OTAMode)
   {
-    LastOTAPress=millis(); // Update the last press time
-    OTAMode =!OTAMode;
+    OTAMode=ota;
     updateOTA=true;
   }
+  if(cal != CalMode)
+  {
+    CalMode=cal;
+    FirstDraw=true;
+    LastIdleTime=millis();
+    //Up+Down is "Enter" in calibration, normal mode keeps the presses instant
+    buttonsSetChord(cal ? (1 << BTN_UP) | (1 << BTN_DOWN) : 0, EnterChordWindow);
+  }
+  //calibration steps are sent on the press and WiFi shares the radio in OTA mode, so it stays on
+  radioSetLeadTime((OTAMode || CalMode) ? 0 : DemandDelay);
+  if(OTAMode || CalMode) {radioPrewarm();}
+}
+
+/**
+ * @brief The OTA button was pressed, toggle OTA mode
+ * 
+ */
+void OTAButtonPress()
+{
+  setMode(OTAMode ? MODE_NORMAL : MODE_OTA);
 }
 
 /**
- * @brief looks to see if the CalMode button is pressed 
+ * @brief The Cal button was pressed, toggle calibration mode
  * 
- * Note: IRAM_ATTR should be used with ESP32 chips.  This places the interupt routine
- * in RAM.  This is faster than keeping it in flash.  Also, the interrupt may be 
- * missed if flash is being used at the time of interrupt if it's not placed in RAM
  */
-void IRAM_ATTR CalButtonPress()
+void CalButtonPress()
 {
-  if(millis()-LastCalPress>PressInterval) // prevent button bouncing
+  LastCalPress=millis(); // Update the last press time
+  setMode(CalMode ? MODE_NORMAL : MODE_CAL);
+}
+
+#define CAL_POINTS (sizeof(CalData)/sizeof(CalData[0])) //flow 2.0 to 10.0 L/min in 0.5 steps
+#define CAL_BODY_MAX 512 //largest calibration upload accepted
+#define CAL_ADC_MAX 4095 //12 bit ADC
+
+/**
+ * @brief Write a calibration table to /Caldata.txt.  It goes to a temporary
+ * file first so a failed write never leaves a half table behind.
+ * 
+ * @return true if the table was saved
+ */
+bool writeCalFile(const uint16_t *data)
+{
+  File myFile = LittleFS.open("/Caldata.tmp", FILE_WRITE);
+  if(!myFile) {return false;}
+  size_t written=myFile.write((const byte *)data, sizeof(CalData));
+  myFile.close();
+  if(written!=sizeof(CalData)) {return false;}
+  LittleFS.remove("/Caldata.txt");
+  return LittleFS.rename("/Caldata.tmp", "/Caldata.txt");
+}
+
+/**
+ * @brief A table is usable if every point is a valid ADC value and the points
+ * rise strictly with the flow, which interpolateData() relies on
+ * 
+ */
+bool validCalData(const uint16_t *data)
+{
+  for(size_t i=0;i<CAL_POINTS;i++)
   {
-    LastCalPress=millis(); // Update the last press time
-    LastIdleTime=LastCalPress;
-    CalMode =!CalMode;
-    FirstDraw=true;
+    if(data[i]>CAL_ADC_MAX) {return false;}
+    if(i>0 && data[i]<=data[i-1]) {return false;}
   }
+  return true;
 }
 
 /**
- * @brief Can be used to set the Calibration Offset/Xtalk for the VL53L1X
- * This is called from the web server
+ * @brief Read the "adc":[...] array of a calibration upload
+ * 
+ * @return true if exactly CAL_POINTS numbers were found
+ */
+bool parseCalJson(const char *json, uint16_t *data)
+{
+  const char *p=strstr(json, "\"adc\"");
+  if(p==NULL) {return false;}
+  p=strchr(p, '[');
+  if(p==NULL) {return false;}
+  p++;
+  size_t count=0;
+  while(true)
+  {
+    while(*p==' ' || *p=='\t' || *p=='\r' || *p=='\n') {p++;}
+    if(*p==']') {break;}
+    char *end;
+    long value=strtol(p, &end, 10);
+    if(end==p || value<0 || value>CAL_ADC_MAX || count>=CAL_POINTS) {return false;}
+    data[count++]=(uint16_t)value;
+    p=end;
+    while(*p==' ' || *p=='\t' || *p=='\r' || *p=='\n') {p++;}
+    if(*p==',') {p++;}
+    else if(*p!=']') {return false;}
+  }
+  return count==CAL_POINTS;
+}
+
+/**
+ * @brief Send the calibration table, GET /CAL as JSON or GET /CAL?format=raw as
+ * the binary /Caldata.txt record.  Streamed from small stack buffers.
  * 
  */
 void handle_CAL()
 {
-/*
-  myServer.send(200,"text/plain", calOff); 
-  */
+  File myFile=LittleFS.open("/Caldata.txt", FILE_READ);
+  if(!myFile)
+  {
+    server.send(404, "text/plain", "no calibration");
+    return;
+  }
+  if(server.arg("format")=="raw")
+  {
+    server.streamFile(myFile, "application/octet-stream");
+    myFile.close();
+    return;
+  }
+  uint16_t data[CAL_POINTS];
+  size_t got=myFile.read((byte *)data, sizeof(data));
+  myFile.close();
+  if(got!=sizeof(data))
+  {
+    server.send(500, "text/plain", "calibration file is short");
+    return;
+  }
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  char chunk[48];
+  server.sendContent("{\"flowStart\":2.0,\"flowStep\":0.5,\"adc\":[");
+  for(size_t i=0;i<CAL_POINTS;i++)
+  {
+    int n=snprintf(chunk, sizeof(chunk), i==0 ? "%u" : ",%u", data[i]);
+    server.sendContent(chunk, n);
+  }
+  server.sendContent("]}");
+  server.sendContent("");  //end of the chunked reply
+}
+
+static char CalBody[CAL_BODY_MAX+1]; //calibration upload, fixed so no heap is used
+static size_t CalBodyLen=0;
+static bool CalBodyOverflow=false;
+
+/**
+ * @brief Body of a calibration upload, PUT /CAL with {"adc":[...]} or
+ * PUT /CAL?format=raw with the binary record
+ * 
+ */
+void handle_CAL_data()
+{
+  HTTPRaw &raw=server.raw();
+  if(raw.status==RAW_START)
+  {
+    CalBodyLen=0;
+    CalBodyOverflow=false;
+  } else if(raw.status==RAW_WRITE)
+  {
+    if(CalBodyLen+raw.currentSize>CAL_BODY_MAX)
+    {
+      CalBodyOverflow=true;
+      return;
+    }
+    memcpy(CalBody+CalBodyLen, raw.buf, raw.currentSize);
+    CalBodyLen+=raw.currentSize;
+  }
+}
+
+/**
+ * @brief Validate the uploaded table and save it
+ * 
+ */
+void handle_CAL_done()
+{
+  uint16_t data[CAL_POINTS];
+  bool parsed;
+  if(server.arg("format")=="raw")
+  {
+    parsed=!CalBodyOverflow && CalBodyLen==sizeof(data);
+    if(parsed) {memcpy(data, CalBody, sizeof(data));}
+  } else {
+    CalBody[CalBodyLen]=0;
+    parsed=!CalBodyOverflow && parseCalJson(CalBody, data);
+  }
+  if(!parsed)
+  {
+    server.send(400, "text/plain", "expected {\"adc\":[17 values]} or a 34 byte raw record");
+    return;
+  }
+  if(!validCalData(data))
+  {
+    server.send(422, "text/plain", "calibration must rise strictly and stay within 0-4095");
+    return;
+  }
+  if(!writeCalFile(data))
+  {
+    server.send(500, "text/plain", "write failed");
+    return;
+  }
+  memcpy(CalData, data, sizeof(CalData));
+  Serial.println("Calibration data restored from upload");
+  server.send(200, "text/plain", "saved");
+}
+
+/**
+ * @brief Send the energy accounting report to the browser
+ * 
+ */
+void handle_ENERGY()
+{
+  static char report[ENERGY_REPORT_SIZE];
+  energyFormat(report, sizeof(report));
+  server.send(200, "text/plain", report);
+}
+
+/**
+ * @brief Chunk of a chunked reply (/metrics, /LOG, /PROFILE)
+ * 
+ */
+void sendChunk(const char *text, size_t len)
+{
+  server.sendContent(text, len);
+}
+
+/**
+ * @brief Sample the gauges, before the metrics are written out
+ * 
+ */
+void updateGauges()
+{
+  metricsSet(MG_BATTERY_MV, batteryMilliVolts());
+  metricsSet(MG_HEAP_FREE, heap_caps_get_free_size(MALLOC_CAP_8BIT));
+  metricsSet(MG_HEAP_LARGEST, heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  metricsSet(MG_EVENTS_DROPPED, eventsDropped());
+  metricsSet(MG_WAKE_STUB_REJECTS, wakeStubRejected());
+}
+
+/**
+ * @brief Serve the metrics registry in the Prometheus text format, streamed
+ * as a chunked reply
+ * 
+ */
+void handle_METRICS()
+{
+  updateGauges();
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain; version=0.0.4", "");
+  metricsWrite(sendChunk);
+  server.sendContent("");  //end of the chunked reply
+}
+
+/**
+ * @brief Dump the log ring, GET /LOG, oldest record first
+ * 
+ */
+void handle_LOG()
+{
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain", "");
+  logDump(sendChunk);
+  server.sendContent("");  //end of the chunked reply
+}
+
+/**
+ * @brief CPU profiler, GET /PROFILE.  ?start=hz clears the histogram and
+ * starts sampling (0 or empty for the default rate), ?stop stops it.  The
+ * reply is the dump, for tools/profile_report.py.
+ * 
+ */
+void handle_PROFILE()
+{
+  if(server.hasArg("start") && !profileStart(server.arg("start").toInt()))
+  {
+    server.send(400, "text/plain", "rate out of range or no timer free");
+    return;
+  }
+  if(server.hasArg("stop")) {profileStop();}
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain", "");
+  profileDump(sendChunk);
+  server.sendContent("");  //end of the chunked reply
+}
+
+/**
+ * @brief Live telemetry stream, GET /events (Server-Sent Events).  The socket
+ * is handed to the telemetry module, which writes the headers itself.
+ * 
+ */
+void handle_EVENTS()
+{
+  WiFiClient client=server.client();
+  if(!telemetryAddClient(client)) {server.send(503, "text/plain", "too many telemetry clients");}
+}
+
+/**
+ * @brief Page plotting the telemetry stream, GET /live
+ * 
+ */
+void handle_LIVE()
+{
+  server.send_P(200, "text/html", TelemetryPage);
+}
+
+char *BulkText=NULL;  //log or metrics being rendered for a bulk transfer
+size_t BulkTextLen=0;
+uint8_t *BulkInbox=NULL;  //last log or metrics received from the controller
+size_t BulkInboxLen=0;
+uint8_t BulkInboxType=BULK_LOG;
+
+/**
+ * @brief Send one bulk transfer frame to the controller
+ * 
+ */
+bool bulkTransmit(const uint8_t *frame, size_t len)
+{
+  radioEnsureOn();
+  return esp_now_send(ControllerAddress, frame, len)==ESP_OK;
+}
+
+/**
+ * @brief Collect the lines of a log or metrics dump for a bulk transfer,
+ * what doesn't fit in BULK_MAX_SIZE is left out
+ * 
+ */
+void bulkTextSink(const char *text, size_t len)
+{
+  if(BulkTextLen+len>BULK_MAX_SIZE) {return;}
+  memcpy(BulkText+BulkTextLen, text, len);
+  BulkTextLen+=len;
+}
+
+/**
+ * @brief Start sending the log ring, the calibration table or a metrics
+ * snapshot to the controller over ESP-NOW
+ * 
+ * @return false if a transfer is already going or there is no memory
+ */
+bool sendBulk(uint8_t type)
+{
+  if(type==BULK_CAL) {return bulkSend(BULK_CAL, (const uint8_t *)CalData, sizeof(CalData));}
+  BulkText=(char *)malloc(BULK_MAX_SIZE);
+  if(BulkText==NULL) {return false;}
+  BulkTextLen=0;
+  if(type==BULK_LOG) {logDump(bulkTextSink);}
+  else
+  {
+    updateGauges();
+    metricsWrite(bulkTextSink);
+  }
+  bool started=bulkSend(type, (const uint8_t *)BulkText, BulkTextLen);  //the module keeps a copy
+  free(BulkText);
+  BulkText=NULL;
+  return started;
+}
+
+/**
+ * @brief A bulk transfer came in from the controller.  A calibration table is
+ * checked and saved like an upload to PUT /CAL, a log or metrics dump is kept
+ * for GET /BULK?show.
+ * 
+ */
+void bulkReceived(uint8_t type, const uint8_t *data, size_t len)
+{
+  if(type==BULK_CAL)
+  {
+    uint16_t table[CAL_POINTS];
+    if(len!=sizeof(table)) {LOGW("Bulk cal: %u bytes, expected %u", len, sizeof(table)); return;}
+    memcpy(table, data, sizeof(table));
+    if(!validCalData(table)) {LOGW("Bulk cal: table rejected"); return;}
+    if(!writeCalFile(table)) {LOGE("Bulk cal: write failed"); return;}
+    memcpy(CalData, table, sizeof(CalData));
+    LOGI("Calibration data restored from the controller");
+    return;
+  }
+  free(BulkInbox);
+  BulkInbox=(uint8_t *)malloc(len);
+  BulkInboxLen=BulkInbox ? len : 0;
+  if(BulkInbox) {memcpy(BulkInbox, data, len);}
+  BulkInboxType=type;
+}
+
+/**
+ * @brief The controller asked for a dump
+ * 
+ */
+void bulkRequested(uint8_t type)
+{
+  if(type>=BULK_TYPE_COUNT || !sendBulk(type)) {LOGW("Bulk request for type %u refused", type);}
+}
+
+/**
+ * @brief Bulk transfer type from its name, BULK_TYPE_COUNT if unknown
+ * 
+ */
+uint8_t bulkTypeFromName(const String &name)
+{
+  uint8_t type=0;
+  while(type<BULK_TYPE_COUNT && name!=bulkTypeName(type)) {type++;}
+  return type;
+}
+
+/**
+ * @brief ESP-NOW bulk transfers, GET /BULK.  ?loss=N sets the test loss in
+ * percent, ?send=log|cal|metrics sends to the controller, ?get=... asks the
+ * controller to send, ?show returns the last log or metrics received.  The
+ * reply is the transfer report.
+ * 
+ */
+void handle_BULK()
+{
+  if(server.hasArg("show"))
+  {
+    if(BulkInbox==NULL) {server.send(404, "text/plain", "nothing received");}
+    else {server.send(200, "text/plain", BulkInbox, BulkInboxLen);}
+    return;
+  }
+  if(server.hasArg("loss")) {bulkSetTestLoss(server.arg("loss").toInt());}
+  if(server.hasArg("send") || server.hasArg("get"))
+  {
+    bool send=server.hasArg("send");
+    uint8_t type=bulkTypeFromName(server.arg(send ? "send" : "get"));
+    if(type>=BULK_TYPE_COUNT)
+    {
+      server.send(400, "text/plain", "expected log, cal or metrics");
+      return;
+    }
+    if(!(send ? sendBulk(type) : bulkRequest(type)))
+    {
+      server.send(409, "text/plain", "a transfer is already going");
+      return;
+    }
+  }
+  static char report[BULK_REPORT_SIZE];
+  bulkReport(report, sizeof(report));
+  server.send(200, "text/plain", report);
+}
+
+/**
+ * @brief Restart into the new firmware, run by the scheduler after the upload reply is out
+ * 
+ */
+void restartDevice()
+{
+  logFlush();
+  displayPowerReport();
+  displayEndInteraction();
+  energyEndInteraction(false);
+  ESP.restart();
+}
+
+bool FwRequestOk=false; //the current firmware upload request was accepted
+
+/**
+ * @brief Body of a firmware upload, POST /FIRMWARE?offset=&size=&sha256=[&encoding=gzip]
+ * with the image bytes from offset on (Content-Type: application/octet-stream).
+ * With encoding=gzip, size and offset count the compressed bytes.
+ * 
+ */
+void handle_FW_data()
+{
+  HTTPRaw &raw=server.raw();
+  if(raw.status==RAW_START)
+  {
+    FwEncoding encoding=(server.arg("encoding")=="gzip") ? FW_GZIP : FW_RAW;  //images packed by tools/pack_firmware.py
+    FwRequestOk=fwBegin(server.arg("offset").toInt(), server.arg("size").toInt(), server.arg("sha256").c_str(), encoding);
+  } else if(raw.status==RAW_WRITE && FwRequestOk)
+  {
+    FwRequestOk=fwWrite(raw.buf, raw.currentSize);
+  } else if(raw.status==RAW_END && FwRequestOk)
+  {
+    fwEnd(false);
+  } else if(raw.status==RAW_ABORTED && FwRequestOk)
+  {
+    fwEnd(true);  //keep what came in, the client resumes from the offset in the status
+  }
+}
+
+/**
+ * @brief Reply to a firmware upload once its body is in.  202 asks for the rest
+ * of the image from the offset in the status, 409 means rejected.
+ * 
+ */
+void handle_FW_done()
+{
+  char status[FW_STATUS_SIZE];
+  fwStatus(status, sizeof(status));
+  FwState state=fwState();
+  int code=(!FwRequestOk || state==FW_FAILED) ? 409 : (state==FW_VERIFIED ? 200 : 202);
+  server.send(code, "application/json", status);
+  if(state==FW_VERIFIED) {scheduleTask(restartDevice, 1000);}
+}
+
+/**
+ * @brief Firmware upload status, GET /FIRMWARE, the offset to resume from
+ * 
+ */
+void handle_FW_status()
+{
+  char status[FW_STATUS_SIZE];
+  fwStatus(status, sizeof(status));
+  server.send(200, "application/json", status);
 }
 
 /**
@@ -205,7 +710,7 @@ void handle_MAC(){
 void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status) {
   // Serial.print("\r\nLast Packet Send Status:\t");
   // Serial.println(status == ESP_NOW_SEND_SUCCESS ? "Delivery Success" : "Delivery Fail");
-   if (status==ESP_NOW_SEND_SUCCESS){DeliverySuccess=true;}  else {DeliverySuccess=false;}
+   eventPost(EV_SEND_DONE, status==ESP_NOW_SEND_SUCCESS, 0, 0);  //handled on the main thread
  }
  
  /**
@@ -216,11 +721,111 @@ void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status) {
   * @param len Length of incoming data, Can only have a max of 250 bytes so use integer
   */
  void OnDataRecv(const esp_now_recv_info_t *esp_now_info, const uint8_t *incomingData, int len) {
-   memcpy(&ControllerData, incomingData, sizeof(ControllerData));
-   Serial.print("Data Recieved: "); Serial.println(ControllerData.potADC);
-   NewData=true;
-   rssiVal=WiFi.RSSI();
+   if(bulkFrame(incomingData, len)) {return;}  //queued for bulkPump()
+   if(len < (int)sizeof(DataStruct))
+   {
+     LOGW("ESP-NOW: short packet, %d bytes", len);  //WiFi task, the record is printed by loop()
+     return;
+   }
+   DataStruct received;
+   memcpy(&received, incomingData, sizeof(received));
+   int8_t rssi = esp_now_info->rx_ctrl ? esp_now_info->rx_ctrl->rssi : 0;
+   eventPost(EV_DATA_RECV, received.cmdESP_Now, received.potADC, rssi);  //handled on the main thread
  }
+
+/**
+ * @brief Write a dump straight to the serial port, after the pending log records
+ * 
+ */
+void serialSink(const char *text, size_t len)
+{
+  Serial.write((const uint8_t *)text, len);
+}
+
+/**
+ * @brief Serial console commands, one per line: "profile start [hz]",
+ * "profile stop", "profile dump".  Only read while loop() runs, light sleep
+ * loses what comes in meanwhile.
+ * 
+ */
+void handleSerialCommands()
+{
+  static char line[32];
+  static uint8_t len=0;
+  while(Serial.available())
+  {
+    char c=Serial.read();
+    if(c!='\n' && c!='\r')
+    {
+      if(len<sizeof(line)-1) {line[len++]=c;}
+      continue;
+    }
+    if(len==0) {continue;}
+    line[len]=0;
+    len=0;
+    if(strncmp(line, "profile start", 13)==0)
+    {
+      uint32_t hz=atoi(line+13);
+      if(profileStart(hz)) {LOGI("Profiler started at %u Hz", hz ? hz : PROFILE_DEFAULT_HZ);}
+      else {LOGW("Profiler: rate out of range or no timer free");}
+    } else if(strcmp(line, "profile stop")==0)
+    {
+      profileStop();
+      LOGI("Profiler stopped");
+    } else if(strcmp(line, "profile dump")==0)
+    {
+      logFlush();  //keep the dump block in one piece
+      profileDump(serialSink);
+    } else {
+      LOGW("Unknown command, expected profile start [hz], profile stop or profile dump");
+    }
+  }
+}
+
+/**
+ * @brief Handle the queued events from the ISRs and the WiFi task.  This is the
+ * only place the shared radio state and the button edges are updated.
+ * 
+ */
+void pumpEvents()
+{
+  Event event;
+  while(eventGet(event))
+  {
+    switch(event.type)
+    {
+      case EV_BUTTON:
+        buttonsEdge(event.arg, event.value, event.time);
+        break;
+      case EV_SEND_DONE:
+        if(bulkSendDone()) {break;}  //callback for a bulk transfer frame
+        DeliverySuccess = event.arg;
+        SendPending = false;
+        metricsInc(DeliverySuccess ? MC_ESPNOW_ACKED : MC_ESPNOW_NOT_ACKED);
+        telemetryPost(TEL_SEND_DONE, DeliverySuccess, 0);
+        energySet(EN_TX, false);
+        if(!DeliverySuccess) {batterySetLoad(BATT_LOAD_IDLE);}
+        break;
+      case EV_DATA_RECV:
+        ControllerData.cmdESP_Now = event.arg;
+        ControllerData.potADC = event.value;
+        rssiVal = event.aux;
+        NewData = true;
+        metricsInc(MC_ESPNOW_REPLIES);
+        if(SendTimeUs!=0)
+        {
+          metricsObserve(MH_REPLY_RTT_MS, (event.time-SendTimeUs)/1000);
+          SendTimeUs=0;
+        }
+        LOGI("Data Recieved: %u, RSSI %d", ControllerData.potADC, rssiVal);
+        telemetryPost(TEL_REPLY, ControllerData.potADC, rssiVal);
+        break;
+      case EV_BULK:  //only wakes loop(), the frames are handled by bulkPump()
+        break;
+    }
+  }
+  buttonsUpdate();
+}
  
 /**
  * @brief Send  data to the Chris Controller 
@@ -230,20 +835,81 @@ void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status) {
 void SendData(DataStruct OutData)
 {
     //Send Data
+    radioEnsureOn();
+    batterySetLoad(BATT_LOAD_TX);  //battery sags while the radio transmits
+    energySet(EN_TX, true);
+    DeliverySuccess=false;
+    SendPending=true;
     esp_err_t result = esp_now_send(ControllerAddress, (uint8_t *) &OutData, sizeof(OutData) );
 
     if (result==ESP_OK){
-      //test code
-      char buffer[100];
-      sprintf(buffer,"Data sent with success");
-      Serial.println(buffer);
+      metricsInc(MC_ESPNOW_SENT);
+      SendTimeUs=eventTimeNow();
+      LOGI("Data sent with success: cmd %u, potADC %u", OutData.cmdESP_Now, OutData.potADC);
+      telemetryPost(TEL_SEND, OutData.cmdESP_Now, OutData.potADC);
+      //wait for the send callback so DeliverySuccess is for this packet
+      uint32_t start=millis();
+      while(SendPending && millis()-start<SendDoneTimeout)
+      {
+        cpuBoost(false);
+        eventWait(SendDoneTimeout);
+        cpuBoost(true);
+        pumpEvents();
+      }
     }
     else {
-      Serial.println("Error sending the data");
+      SendPending=false;
+      metricsInc(MC_ESPNOW_SEND_ERRORS);
+      energySet(EN_TX, false);
+      batterySetLoad(BATT_LOAD_IDLE);
+      LOGE("Error sending the data (%d)", result);
     }
 
 }
 
+/**
+ * @brief Wait for the controller to answer the last command, up to timeoutMillis.
+ * The battery is not sampled while the exchange is in progress and the display
+ * steps down on the wait timers.
+ *
+ * @return true if new data was received, false on time out
+ */
+bool waitForReply()
+{
+  bool received=false;
+  preMillis=millis();
+  displaySetProfile(DISP_PROFILE_WAIT);
+  energySet(EN_WAIT, true);
+  while(millis()-preMillis<timeoutMillis)
+  {
+    pumpEvents();  //keep debouncing, the button events are handled after the wait
+    displayPowerUpdate();  //dim, then blank the display during long waits
+    if(NewData)
+    {
+      NewData=false;
+      received=true;
+      break;
+    }
+    //the radio must stay on, so block (no light sleep) until the reply, another event or the next timer
+    uint32_t wait=timeoutMillis-(millis()-preMillis);
+    wait=min(wait, displayPowerNextDeadline());
+    wait=min(wait, buttonsNextDeadline());
+    if(wait>0)
+    {
+      cpuBoost(false);
+      eventWait(wait);
+      cpuBoost(true);
+    }
+  }
+  energySet(EN_WAIT, false);
+  if(!received) {metricsInc(MC_REPLY_TIMEOUTS);}
+  radioActivity();
+  batterySetLoad(BATT_LOAD_IDLE);
+  displaySetProfile(DISP_PROFILE_IDLE);
+  if(received) {displayActivity();}  //new data, display back to full
+  return received;
+}
+
 float interpolateData(uint16_t inputValue) {
   // Find the nearest two values in CalData
   uint16_t lowerValue = 0;
@@ -251,7 +917,7 @@ float interpolateData(uint16_t inputValue) {
   int lowerIndex = -1;
   int upperIndex = -1;
 
-  Serial.print("Input Value =");Serial.println(inputValue);
+  LOGD("Input Value = %u", inputValue);
   // Loop through CalData to find the nearest values
   for (int i = 0; i < 16; i++) {
       if (CalData[i] <= inputValue && (lowerIndex == -1 || CalData[i] > lowerValue)) {
@@ -263,11 +929,8 @@ float interpolateData(uint16_t inputValue) {
           upperIndex = i + 1;
       }
   }
-  char buffer[50];
-  snprintf(buffer,sizeof(buffer),"Lower Value = %d, Index = %d",lowerValue,lowerIndex);
-  Serial.println(buffer);
-  snprintf(buffer,sizeof(buffer),"Upper Value = %d, Index = %d",upperValue,upperIndex);
-  Serial.println(buffer);
+  LOGD("Lower Value = %d, Index = %d", lowerValue, lowerIndex);
+  LOGD("Upper Value = %d, Index = %d", upperValue, upperIndex);
   // If inputValue is out of bounds, clamp it
   if (lowerIndex == -1) {
       lowerValue = CalData[0];
@@ -284,8 +947,7 @@ float interpolateData(uint16_t inputValue) {
   {
   // Perform linear interpolation
   float ratio = (float)(inputValue - lowerValue) / (upperValue - lowerValue);
-  Serial.println(ratio);
-  Serial.print("lowerNum = ");Serial.print(lowerNum);Serial.print(": upperNum = ");Serial.println(upperNum);
+  LOGD("ratio = %.2f, lowerNum = %.2f: upperNum = %.2f", ratio, lowerNum, upperNum);
   interpolatedValue = lowerNum + ratio * (upperNum - lowerNum); // Map to range 
   // Round to the nearest 0.5
   interpolatedValue = round(interpolatedValue * 2) / 2.0;
@@ -295,14 +957,25 @@ float interpolateData(uint16_t inputValue) {
   return interpolatedValue;
 }
 
+/**
+ * @brief Put the radio on the controller's channel.  Only while the STA is not
+ * joined to an AP, then the AP decides the channel.
+ * 
+ */
+void setESPNowChannel()
+{
+  esp_wifi_set_channel(ESPNOW_CHANNEL, WIFI_SECOND_CHAN_NONE);
+}
+
 /**
  * @brief Initializes the ESP_NOW network
  * 
  */
 void initESP_NOW()
 {
- 
+  WiFi.hostname(ESPHostName.c_str());  //before the STA starts, OTA mode joins on the same interface
   WiFi.mode(WIFI_STA);//Set the device as a WiFi Station
+  setESPNowChannel();
   esp_now_init();  //initialize ESP-NOW
   esp_now_register_send_cb(OnDataSent); //register for Send Call back to get status of transmitted packet
   esp_now_register_recv_cb(OnDataRecv); //register call back function for when data is recieved
@@ -310,52 +983,46 @@ void initESP_NOW()
   peerInfo.channel=0;
   peerInfo.encrypt=false;
   esp_now_add_peer(&peerInfo);  //Add peer
+  radioBegin();
 }
 
 /**
- * @brief Initializes the WiFi Connection
+ * @brief Start a new step of the WiFi bring-up
  * 
  */
-void initWiFi()
+void setWiFiState(WifiStatus state)
 {
-  Serial.println("Booting");
-  WiFi.hostname(ESPHostName.c_str());
-  WiFi.mode(WIFI_STA);
-
-  wifiManager.setTimeout(120);
-  //wifiManager.resetSettings();  //For testing, reset credentials
- 
-
-  // Automatically connect using saved credentials,
-  // if connection fails, it starts an access point with the specified name ( "Salt Monitor"),
-  // if empty will auto generate SSID, if password is blank it will be anonymous AP (wm.autoConnect())
-  // then goes into a blocking loop awaiting configuration and will return success result
- 
-  bool res;
-  // res = wifiManager.autoConnect(); // auto generated AP name from chipid
-  res = wifiManager.autoConnect("Chris Remote"); // anonymous ap
-  //res = wifiManager.autoConnect("Feed Monitor"); // anonymous ap
-  
-
-  //res = wifiManager.autoConnect("Salt Monitor","password"); // password protected ap
+  WiFiState=state;
+  WiFiStateStart=millis();
+}
 
-if(!res) 
+/**
+ * @brief Join with the credentials saved by the configuration portal.  Returns at
+ * once, wifiUpdate() waits for the result.  Also the retry task after a backoff.
+ * 
+ */
+void wifiConnect()
 {
-  Serial.println("Failed to connect");
-  ESP.restart();
-} else 
+  Serial.println("Connecting to WiFi");
+  setWiFiState(WIFI_ST_CONNECTING);
+  WiFi.begin();
+}
+
+/**
+ * @brief Initializes the WiFi Connection on the STA interface ESP-NOW already
+ * runs on.  Nothing here blocks: joining, the configuration portal and the
+ * retries are stepped by wifiUpdate() from loop(), so the OLED, the buttons
+ * and the controller link stay live while WiFi comes up.
+ * 
+ */
+void initWiFi()
 {
-  //if you get here you have connected to the WiFi    
-  WiFiExits=true;
-  Serial.println("connected... :)");
-}   
-/*
-  while (WiFi.waitForConnectResult() != WL_CONNECTED) {
-    Serial.println("Connection Failed! Rebooting...");
-    delay(5000);
-    ESP.restart();
-  }
-*/
+  Serial.println("Booting");
+  //wifiManager.resetSettings();  //For testing, reset credentials
+  wifiManager.setConfigPortalBlocking(false);  //process() runs the portal from loop()
+  wifiManager.setConfigPortalTimeout(WIFI_PORTAL_TIMEOUT);
+  wifiManager.setWiFiAPChannel(ESPNOW_CHANNEL);  //the portal AP must not pull the radio off the controller's channel
+  wifiConnect();
 }
 
 /**
@@ -413,11 +1080,92 @@ void initOTA()
   ArduinoOTA.begin();
 
 
-  Serial.println("Ready");
-  Serial.print("IP address: ");
-  Serial.println(WiFi.localIP());
-  Serial.println(WiFi.getHostname());
+  Serial.println("Ready");
+  Serial.print("IP address: ");
+  Serial.println(WiFi.localIP());
+  Serial.println(WiFi.getHostname());
+
+}
+
+/**
+ * @brief WiFi is up: start ArduinoOTA and the web server
+ * 
+ */
+void wifiConnected()
+{
+  //if you get here you have connected to the WiFi
+  setWiFiState(WIFI_ST_READY);
+  WiFiExits=true;
+  WiFiRetryDelay=WIFI_RETRY_MIN;
+  Serial.println("connected... :)");
+  WiFi.setSleep(false);  //modem sleep would miss the controller's replies between beacons
+  if(WiFi.channel()!=ESPNOW_CHANNEL)
+  {
+    Serial.printf("AP is on channel %u, the controller on %u: no ESP-NOW while connected\n",
+      (unsigned)WiFi.channel(), (unsigned)ESPNOW_CHANNEL);
+  }
+  initOTA();
+  server.begin();
+  Serial.println("HTTP server started");
+}
+
+/**
+ * @brief Step the WiFi bring-up.  Call from loop() in OTA mode.  If the saved
+ * credentials don't connect, the "Chris Remote" configuration portal opens; if
+ * that times out, the join is retried after a backoff that doubles up to
+ * WIFI_RETRY_MAX instead of rebooting.
+ * 
+ */
+void wifiUpdate()
+{
+  if(WiFiState==WIFI_ST_CONNECTING)
+  {
+    if(WiFi.status()==WL_CONNECTED) {wifiConnected();}
+    else if(millis()-WiFiStateStart>=WIFI_CONNECT_TIMEOUT)
+    {
+      Serial.println("Failed to connect, starting the configuration portal");
+      setWiFiState(WIFI_ST_PORTAL);
+      wifiManager.startConfigPortal("Chris Remote");  //anonymous ap, returns at once in the non-blocking mode
+    }
+  } else if(WiFiState==WIFI_ST_PORTAL)
+  {
+    if(wifiManager.process()) {wifiConnected();}  //credentials entered and joined
+    else if(!wifiManager.getConfigPortalActive())  //portal timed out
+    {
+      Serial.printf("Failed to connect, retry in %lu s\n", (unsigned long)(WiFiRetryDelay/1000));
+      WiFi.disconnect();  //stop the STA scanning the other channels while we wait
+      setESPNowChannel();
+      setWiFiState(WIFI_ST_RETRY);
+      WiFiRetryAt=WiFiStateStart+WiFiRetryDelay;
+      scheduleTask(wifiConnect, WiFiRetryDelay);
+      WiFiRetryDelay=min(WiFiRetryDelay*2, (uint32_t)WIFI_RETRY_MAX);
+    }
+  }
+}
 
+/**
+ * @brief Leave OTA mode: stop OTA, the web server and the portal and drop the AP.
+ * The STA interface and ESP-NOW stay up, back on the controller's channel.
+ * 
+ */
+void wifiStop()
+{
+  cancelTask(wifiConnect);
+  if(WiFiState==WIFI_ST_READY)
+  {
+    telemetryStop();
+    ArduinoOTA.end();
+    server.stop();
+  }
+  if(wifiManager.getConfigPortalActive()) {wifiManager.stopConfigPortal();}
+  WiFi.disconnect();  //keeps the saved credentials
+  WiFi.mode(WIFI_STA);  //drops the portal AP if it was up
+  WiFi.setSleep(true);
+  setESPNowChannel();
+  setWiFiState(WIFI_ST_CONNECTING);
+  WiFiExits=false;
+  WiFiRetryDelay=WIFI_RETRY_MIN;
+  Serial.println("WiFi stopped");
 }
 
 /**
@@ -441,27 +1189,25 @@ void getFileData()
     myFile.close();
   }
   
-  if(!OTAMode) //if we are in normal mode, get Calibration data, if not create default
+  //Calibration data is used in every mode, create a default table if there is none
+  if(LittleFS.exists("/Caldata.txt"))
   {
-    if(LittleFS.exists("/Caldata.txt"))
+    File myFile=LittleFS.open("/Caldata.txt",FILE_READ);
+    myFile.read((byte *)&CalData, sizeof(CalData));
+    myFile.close();
+    char buffer[200];
+    sprintf(buffer, "CalData = %d, %d, %d, %d, %d, %d, %d, %d, %d", 
+      CalData[0], CalData[2], CalData[4], CalData[6], CalData[8],CalData[10], CalData[12],CalData[14], CalData[16]); // Convert the integer to a string
+    Serial.println(buffer);
+  } else {
+    File myFile=LittleFS.open("/Caldata.txt",FILE_WRITE);
+    CalData[0]=800;
+    for(int i=1;i<17;i++)
     {
-      File myFile=LittleFS.open("/Caldata.txt",FILE_READ);
-      myFile.read((byte *)&CalData, sizeof(CalData));
-      myFile.close();
-      char buffer[200];
-      sprintf(buffer, "CalData = %d, %d, %d, %d, %d, %d, %d, %d, %d", 
-        CalData[0], CalData[2], CalData[4], CalData[6], CalData[8],CalData[10], CalData[12],CalData[14], CalData[16]); // Convert the integer to a string
-      Serial.println(buffer);
-    } else {
-      File myFile=LittleFS.open("/Caldata.txt",FILE_WRITE);
-      CalData[0]=800;
-      for(int i=1;i<17;i++)
-      {
-        CalData[i]=CalData[i-1]+100; //preset all values
-      }
-      myFile.write((byte *)&CalData, sizeof(CalData));
-      myFile.close();
+      CalData[i]=CalData[i-1]+100; //preset all values
     }
+    myFile.write((byte *)&CalData, sizeof(CalData));
+    myFile.close();
   }
     
 }
@@ -472,98 +1218,98 @@ void getControllerStatus()
   SendData(ControllerData);
 }
 
+/**
+ * @brief Update BattState with the state of charge (0-100) and enter or leave
+ * the reduced power mode on low battery
+ * 
+ */
+void updateBatteryState()
+{
+  BattState = batterySoC();
+  telemetryPost(TEL_BATTERY, BattState, batteryMilliVolts());
+  bool low = batteryLow();
+  if(low != LowPowerMode)
+  {
+    LowPowerMode = low;
+    displaySetLowPower(LowPowerMode);
+    LOGI("%s", LowPowerMode ? "Low battery, reduced power mode" : "Battery OK, normal power mode");
+  }
+}
+
+/**
+ * @brief Idle time before deep sleep, learned from the gaps between presses
+ * (see IdleTimeout.h) and capped in the reduced power mode so the display and
+ * radio are on for less time
+ * 
+ */
+uint32_t idleInterval()
+{
+  uint32_t timeout=idleTimeout();
+  return LowPowerMode ? min(timeout, LowBattIdleInterval) : timeout;
+}
+
+/************Screen bindings************** */
+//values the screens in Pages.cpp are bound to, and their page actions
+int32_t flowValue() {return (int32_t)(O2Flow * 10);}  //flow in tenths of L/min
+int32_t battValue() {return BattState;}
+int32_t calPageValue() {return CalPageNum;}
+int32_t ipValue() {return (int32_t)(uint32_t)(WiFiState==WIFI_ST_PORTAL ? WiFi.softAPIP() : WiFi.localIP());}
+int32_t wifiStatusValue()
+{
+  if(WiFiState==WIFI_ST_READY && WiFi.channel()!=ESPNOW_CHANNEL) {return WIFI_ST_READY | (WiFi.channel() << 8);}
+  if(WiFiState!=WIFI_ST_RETRY) {return WiFiState;}
+  int32_t left=max((int32_t)(WiFiRetryAt-millis()), (int32_t)0);
+  return WIFI_ST_RETRY | (((left+999)/1000) << 8);  //seconds until the retry, rounded up
+}
+
+#define CAL_SAVED_PAGE 11  //calibration page shown once all points are entered
+#define CAL_ERROR_PAGE 12  //calibration page shown when the pot. is at a hard stop
+#define CAL_EXIT_DELAY 5000  //time the last calibration page stays up before leaving Cal. mode
+
 void drawStartPage()
 {
   if(OTAMode)
   {
-    u8g2.setDrawColor(1); // Set the draw color to white
-    u8g2.setFontMode(1); // Set the font mode to transparent
-    u8g2.clear();
-    u8g2.clearBuffer();
-    u8g2.setFont(u8g2_font_ncenB08_tr); // Set the font for text
-    u8g2.drawStr(10, 15, "IP Address:"); // Draw the formatted string at (0, 15)
-    u8g2.drawStr(10, 30, WiFi.localIP().toString().c_str()); // Draw the formatted string at (25, 10)
-    u8g2.drawStr(10, 45, "System Mode:"); // Draw the formatted string at (25, 10)
-    u8g2.drawStr(10, 60, "OTA Mode"); // Draw the formatted string at (25, 10)
-    u8g2.sendBuffer(); // Send the buffer to the display
+    screenShow(&OTAScreen);
+    OTAPageShown=true;
   } else {
-    u8g2.setDrawColor(1); // Set the draw color to white  
-    u8g2.setFontMode(1); // Set the font mode to transparent
-    u8g2.clear();
-    u8g2.clearBuffer();
-    u8g2.setFont(u8g2_font_ncenB08_tr); // Set the font for text
-    u8g2.drawStr(10, 15, "Waking...."); // Draw the formatted string at (0, 15)
-    u8g2.drawStr(10, 30, "Normal Mode"); // Draw the formatted string at (25, 10)
-    u8g2.sendBuffer(); // Send the buffer to the display
-    delay(1000);
+    screenShow(&WakeScreen);
+  }
+}
+
+/**
+ * @brief Ask the controller for its status and wait for the reply, then set
+ * O2Flow from the returned pot. ADC value
+ * 
+ */
+void queryControllerStatus()
+{
     getControllerStatus();
-    preMillis=millis();
-    if(!NewData){
-      Serial.println("waiting...");
-      while(millis()-preMillis<timeoutMillis)
-      {
-        if(NewData)
-        {
-          NewData=false;
-          break;
-        }
-      } 
-      if(ControllerData.potADC<100){Serial.println("timed out waiting for controller");}
-      char buffer[20];
-      snprintf(buffer, sizeof(buffer), "Wait Time = %d", millis()-preMillis); // Format O2Flow as a string  
-      Serial.println(buffer);
-    }
-    u8g2.clearBuffer();
-    char buffer[10]; // Create a buffer to hold the string
+    waitForReply();
+    if(ControllerData.potADC<100){LOGW("timed out waiting for controller");}
+    LOGI("Wait Time = %lu", millis()-preMillis);
     O2Flow=interpolateData(ControllerData.potADC);
-    dtostrf(O2Flow, 5, 1, buffer);
-    u8g2.drawStr(10, 30, buffer); // Draw the string on the display
-    u8g2.sendBuffer();
-
-  }
+}
 
+/**
+ * @brief Leave calibration mode, run by the scheduler CAL_EXIT_DELAY after the
+ * last calibration page is shown
+ * 
+ */
+void endCalibration()
+{
+    CalPageNum=1;
+    setMode(MODE_NORMAL);
+    LOGI("Cal Change millis = %lu, current millis = %lu", LastIdleTime, millis());
 }
 
 /**
- * @brief Function to print the calibration pages on the OLED display
+ * @brief Store the measured calibration points, filling in the half steps, 
+ * then leave calibration mode after CAL_EXIT_DELAY
  * 
- * @param PageNum The page number to print
  */
-void printCalPages(uint16_t PageNum)
+void saveCalibration()
 {
-  if(PageNum==1)
-  {
-      //First print instructions:
-      u8g2.clearBuffer();
-      u8g2.clear();
-      u8g2.setFont(u8g2_font_ncenB08_tr);
-      u8g2.drawStr(5,13,"Cal. Mode: Use Up or");
-      u8g2.drawStr(5,28,"Dwn to turn controller");
-      u8g2.drawStr(5,43,"to desired flow. Press");
-      u8g2.drawStr(5,58,"Up & Down to 'Enter'");
-      u8g2.sendBuffer();
-      EnterActive=true;  //Arm to allow Enter command
-  } else if(PageNum>1 && PageNum<11){
-    u8g2.clearBuffer();
-    u8g2.clear();
-    u8g2.setFont(u8g2_font_ncenB08_tr);
-    u8g2.drawStr(5,13,"Use Up/Dwn for");
-    uint16_t O2Target = (PageNum-2)+2;
-    char buffer[15];
-    snprintf(buffer, sizeof(buffer), "%d.0 L/min", O2Target);
-    u8g2.drawStr(25,28,buffer);
-    u8g2.drawStr(5,43,"Press Up & Down");
-    u8g2.drawStr(5,58,"to 'Enter'");
-    u8g2.sendBuffer();
-    EnterActive=true;  //Arm to allow Enter command
-  } else if(PageNum==11){
-    u8g2.clearBuffer();
-    u8g2.clear();
-    u8g2.setFont(u8g2_font_ncenB08_tr);
-    u8g2.drawStr(5,15,"Cal. Successful");
-     u8g2.drawStr(5,35,"Saving Data...");
-    u8g2.sendBuffer();
-    uint16_t index;
     for (int i=0;i<9;i++)
     {
       CalData[i*2]=CalDataInProcess[i];
@@ -573,76 +1319,74 @@ void printCalPages(uint16_t PageNum)
         CalData[i]=(CalData[i-1]+CalData[i+1])/2;
     }
     //write the CalData to file
-    File myFile = LittleFS.open("/Caldata.txt", FILE_WRITE);
-    if (myFile) {
-      myFile.write((byte *)&CalData, sizeof(CalData));
-      myFile.close();
-      Serial.println("Calibration data saved successfully.");
+    if (writeCalFile(CalData)) {
+      LOGI("Calibration data saved successfully.");
     } else {
-      Serial.println("Failed to open file for writing calibration data.");
+      LOGE("Failed to open file for writing calibration data.");
     }
-    delay(5000);
-    CalMode=false;
-    FirstDraw=true;
-    LastIdleTime=millis();
-    Serial.print("Cal Change millis = ");Serial.println(LastIdleTime);
-    Serial.print("Current millis = ");Serial.println(millis());
-  } else if(PageNum==12){
-    u8g2.clearBuffer();
-    u8g2.clear();
-    u8g2.setFont(u8g2_font_ncenB08_tr);
-    u8g2.drawStr(0,10,"Pot. at hard stop");
-     u8g2.drawStr(0,25,"<500 Range <3500");
-    u8g2.drawStr(0,40,"Reset Pot, then");
-    u8g2.drawStr(0,55,"repeat Cal.");
-    u8g2.sendBuffer();
-    delay(5000);
-    CalMode=false;
-    FirstDraw=true;
-    LastIdleTime=millis();
-  }
-
-
+    scheduleTask(endCalibration, CAL_EXIT_DELAY);
 }
 
-int readADCVolts()
-{
-uint32_t adcVoltsIn = 0;
-for (int i = 0; i < 75; i++)
+/**
+ * @brief The pot. reached a hard stop, leave calibration mode after CAL_EXIT_DELAY
+ * 
+ */
+void calAborted()
 {
-  adcVoltsIn = adcVoltsIn + analogReadMilliVolts(BattPin);
-  //delay(5);
-}
-adcVoltsIn= adcVoltsIn/75;
-return adcVoltsIn;
+    scheduleTask(endCalibration, CAL_EXIT_DELAY);
 }
 
 /**
- * @brief draw the battery charge state.
+ * @brief Function to print the calibration pages on the OLED display
  * 
+ * @param PageNum The page number to print
  */
-void drawBattery() 
+void printCalPages(uint16_t PageNum)
 {
-    
-  uint16_t chargeLevel;
-  chargeLevel = map(readADCVolts(), 474, 680, 0, 100);
-  // Define the dimensions of the battery
-    const int batteryWidth = 25;  // Width of the battery
-    const int batteryHeight = 12;   // Height of the battery
-    const int batteryX = 90;        // X position of the battery
-    const int batteryY = 5;        // Y position of the battery
-    // Draw the outer battery shape
-    u8g2.drawFrame(batteryX, batteryY, batteryWidth, batteryHeight); // x, y, width, height
-
-    // Draw the battery terminal
-    u8g2.drawBox(batteryX + batteryWidth, batteryY + (batteryHeight/4), 2, batteryHeight/2); // x, y, width, height
-
-    // Calculate the width of the inner battery level based on chargeLevel (0-100)
-    uint16_t innerWidth = (chargeLevel * (batteryWidth - 4)) / 100; // Subtract 2 for padding
-
-    // Draw the inner battery level
-    u8g2.drawBox(batteryX + 2, batteryY + 2, innerWidth, batteryHeight - 4); // x, y, width, height
+  if(PageNum==1)
+  {
+    screenShow(&CalIntroScreen);
+  } else if(PageNum>1 && PageNum<CAL_SAVED_PAGE){
+    if(screenCurrent()==&CalStepScreen)
+    {
+      screenUpdate();  //same page layout, only the target flow field changes
+    } else {
+      screenShow(&CalStepScreen);
+    }
+  } else if(PageNum==CAL_SAVED_PAGE){
+    screenShow(&CalSavedScreen);
+  } else if(PageNum==CAL_ERROR_PAGE){
+    screenShow(&CalErrorScreen);
+  }
+}
 
+/**
+ * @brief Up/Down button events in normal operation mode.  Each press or
+ * auto-repeat steps the flow by 0.5 L/min.
+ * 
+ */
+void normalButton(const ButtonEvent &event)
+{
+  if(event.type!=BTN_PRESS && event.type!=BTN_REPEAT) {return;}
+  if((event.button==BTN_UP || event.button==BTN_DOWN) && !DemandButtonPressed)
+  {
+    //the controller update follows DemandDelay after the last press.  Prewarm from the
+    //scheduler on the next pass, the radio start blocks and the new flow is drawn first
+    scheduleTask(radioPrewarm, 0);
+  }
+  if(event.button==BTN_UP || event.button==BTN_DOWN) {OTAPageShown=false;}  //back to the flow page
+  if (event.button==BTN_UP && !buttonDown(BTN_DOWN)) {//Up button pressed
+    DemandButtonPressed=true;
+    O2Flow += 0.5; // Increment O2Flow
+    if(O2Flow>10.0) O2Flow=10.0; //limit max flow to 10.0 L/min
+    LastDemandTime=millis();
+  } else if (event.button==BTN_DOWN && !buttonDown(BTN_UP)) {//down button pressed
+    DemandButtonPressed=true;
+    O2Flow -= 0.5; // Decrement O2Flow
+    if(O2Flow<2.0) O2Flow=2.0; //limit min flow to 2.0 L/min
+    LastDemandTime=millis();
+  }
+  // If both are pressed, do nothing
 }
 
 /**
@@ -655,150 +1399,141 @@ void normalOps()
   // Check if the interval has passed
   if (millis() - previousMillis >= interval) {
     previousMillis = millis(); // Save the last update time
-    // Read the state of GPIO13 and GPIO14
-    bool upState = digitalRead(UpButton) == LOW; // LOW means pressed
-    bool downState = digitalRead(DownButton) == LOW; // LOW means pressed
-
-    // Update O2Flow based on the states of GPIO13 and GPIO14
-    if (upState && !downState) {//Up button pressed
-      DemandButtonPressed=true;
-      O2Flow += 0.5; // Increment O2Flow if GPIO13 is low and GPIO14 is high
-      if(O2Flow>10.0) O2Flow=10.0; //limit max flow to 10.0 L/min
-      LastDemandTime=millis();
-      LastIdleTime=millis();
-    } else if (!upState && downState) {//down button pressed
-      DemandButtonPressed=true;
-      O2Flow -= 0.5; // Decrement O2Flow if GPIO14 is low and GPIO13 is high
-      if(O2Flow<2.0) O2Flow=2.0; //limit min flow to 2.0 L/min
-      LastDemandTime=millis();
-      LastIdleTime=millis();
-    }
-    // If both are low, do nothing
-    // If both are high, do nothing
-    // Print the current O2Flow value for debugging
-
-    u8g2.setDrawColor(1); // Set the draw color to white
-    u8g2.setFontMode(1); // Set the font mode to transparent
-    char buffer[100]; // Create a buffer to hold the formatted string
-    if (FirstDraw)
-      {
-        //u8g2.setFont(u8g2_font_ncenB08_tr); // Set the font for text
-        //u8g2.setFont(u8g2_font_10x20_tr); // Set the font for text
-        //u8g2.setFont(u8g2_font_helvB14_tr);
-        //u8g2.setFont(u8g2_font_helvB18_tr);
-        //u8g2.setFont(u8g2_font_helvB24_tr);
-        O2FlowLast=O2Flow; // Store the last O2Flow value
-        u8g2.clearBuffer();
-        u8g2.clear();
-        if(O2Flow>1)
-        {
-          drawBattery();
-          u8g2.setFont(u8g2_font_helvB24_tr);
-          //u8g2.drawStr(0, 25, "O2Flow:"); // Draw "O2Flow" at (25, 10)
-          memset(buffer, 0, sizeof(buffer));
-          if(O2Flow<10)// Format O2Flow as a string
-          {
-            snprintf(buffer, sizeof(buffer), "%.1f", O2Flow);
-          } else 
-          {
-            snprintf(buffer, sizeof(buffer), "%.f", O2Flow);
-          }
-          u8g2.drawStr(10, 45, buffer); // Draw the formatted O2Flow string at (25, 40)
-          u8g2.setFont(u8g2_font_helvB14_tr);
-          u8g2.drawStr(60,45, "L/min"); // Draw "L/min" at (25, 40)
-          u8g2.sendBuffer(); // Send the buffer to the display
-          Serial.println(O2Flow);
-        } else{
-          u8g2.drawStr(0,25,"No Flow Data");
-          u8g2.sendBuffer(); // Send the buffer to the display
-        }
+    updateBatteryState();
+  }
 
-      }
-    if (O2Flow != O2FlowLast)   //flow value has changed
+  const Screen *flowPage = (O2Flow>1) ? &FlowScreen : &NoFlowScreen;
+  if (OTAPageShown)
+  {
+    screenUpdate();  //WiFi progress and the IP address, until the first flow press
+  } else if (FirstDraw || screenCurrent()!=flowPage)
+  {
+    if (FirstDraw) {displayActivity();}
+    screenShow(flowPage);
+    LOGI("Flow %.1f", O2Flow);
+    telemetryPost(TEL_FLOW, (int32_t)(O2Flow * 10), 0);
+  } else
+  {
+    screenUpdate();  //only the flow or battery field is redrawn, if it changed
+    if (O2Flow != O2FlowLast)
     {
-      u8g2.setDrawColor(0);      
-      memset(buffer, 0, sizeof(buffer));
-      if(O2FlowLast<10)// Format O2Flow as a string
-      {
-        snprintf(buffer, sizeof(buffer), "%.1f", O2FlowLast);
-      } else 
-      {
-        snprintf(buffer, sizeof(buffer), "%.f", O2FlowLast);
-      }
-      u8g2.setFont(u8g2_font_helvB24_tr);
-      u8g2.drawStr(10, 45, buffer); // Erase the old O2Flow string
-      u8g2.sendBuffer(); // Send the buffer to the display
-      u8g2.setDrawColor(1); // Set the draw color to white (draw)
-      O2FlowLast = O2Flow; // Update the last O2Flow value
-      memset(buffer, 0, sizeof(buffer));
-      if(O2Flow<10)// Format O2Flow as a string
-      {
-        snprintf(buffer, sizeof(buffer), "%.1f", O2Flow);
-      } else 
-      {
-        snprintf(buffer, sizeof(buffer), "%.f", O2Flow);
-      }
-      u8g2.drawStr(10, 45, buffer); // Draw the new O2Flow string
-      u8g2.sendBuffer(); // Send the buffer to the display
-      Serial.println(O2Flow);
+      LOGI("Flow %.1f", O2Flow);
+      telemetryPost(TEL_FLOW, (int32_t)(O2Flow * 10), 0);
     }
+  }
+  O2FlowLast = O2Flow; // Update the last O2Flow value
 
-    FirstDraw = false; // Set FirstDraw to false after the first draw
+  FirstDraw = false; // Set FirstDraw to false after the first draw
 
-    if(!upState && !downState && DemandButtonPressed)
+  if(!buttonDown(BTN_UP) && !buttonDown(BTN_DOWN) && DemandButtonPressed)
+  {
+    if(millis()-LastDemandTime>DemandDelay) //wait one second after setting flow before updating controller
     {
-      if(millis()-LastDemandTime>1000) //wait one second after setting flow before updating controller
-      {
-        DemandButtonPressed=false;
-        uint16_t NewADCIndex =(uint16_t)((O2Flow-2.0)*2);
-        ControllerData.potADC=CalData[NewADCIndex];
-        ControllerData.cmdESP_Now=cmdGoTo;
-        SendData(ControllerData);
-        LastIdleTime=millis();
-        if(DeliverySuccess)
-        {  //Controller should respond with current potADC value.  Wait for result
-          preMillis=millis();
-          if(!NewData)
-          {
-            u8g2.clearBuffer();
-            u8g2.clear();
-            u8g2.setFont(u8g2_font_helvB14_tr);
-            u8g2.drawStr(10,20,"waiting...");
-            u8g2.sendBuffer();
-            Serial.println("waiting...");
-            SleepPermmissive=false;
-            while(millis()-preMillis<timeoutMillis)
-            {
-              LastIdleTime=millis();
-              if(NewData)
-              {
-                NewData=false;
-                break;
-              }
-            } 
-            SleepPermmissive=true;
-          }
-          O2Flow=interpolateData(ControllerData.potADC);
-          FirstDraw=true;
-          Serial.println(O2Flow);
-          LastIdleTime=millis();
-          Serial.println(O2Flow);
+      DemandButtonPressed=false;
+      uint16_t NewADCIndex =(uint16_t)((O2Flow-2.0)*2);
+      ControllerData.potADC=CalData[NewADCIndex];
+      ControllerData.cmdESP_Now=cmdGoTo;
+      SendData(ControllerData);
+      LastIdleTime=millis();
+      if(DeliverySuccess)
+      {  //Controller should respond with current potADC value.  Wait for result
+        if(!NewData)
+        {
+          screenShow(&WaitingScreen);
+          LOGI("waiting...");
         }
+        SleepPermmissive=false;
+        waitForReply();
+        SleepPermmissive=true;
+        O2Flow=interpolateData(ControllerData.potADC);
+        FirstDraw=true;
+        LOGI("Flow %.1f from the controller", O2Flow);
+        LastIdleTime=millis();
       }
     }
   }
 
-if((millis()-LastIdleTime>IdleInterval) && SleepPermmissive)
+if((millis()-LastIdleTime>idleInterval()) && SleepPermmissive && !OTAMode && !bulkActive())  //OTA mode stays reachable
   {
+    logFlush();  //the records still in the ring go out before the reports
     Serial.print("Norm Ops millis = ");Serial.println(LastIdleTime);
     Serial.print("Current millis = ");Serial.println(millis());
+    batteryReport();
+    displayPowerReport();
+    lightSleepReport();
+    cpuPowerReport();
+    radioReport();
+    idleTimeoutReport();
+    energyReport();
+    if(profileRunning()) {profileDump(serialSink);}  //the histogram is lost in deep sleep
+    displayEndInteraction();
+    energyEndInteraction(true);
     u8g2.sleepOn();
     Serial.println("Going to Sleep...");
+    wakeStubArm((uint32_t)bitmask);  //bounces on the wake pins go back to sleep before the boot
     esp_deep_sleep_start();
   }
 
 }
 
+/**
+ * @brief Store the calibration point and move to the next page
+ * 
+ */
+void calEnter()
+{
+  if(CalPageNum>1) {LOGD("Enter Pressed, CalDat[%d] = %u", CalPageNum-2, CalDataInProcess[CalPageNum-2]);}
+  CalPageNum++;
+  printCalPages(CalPageNum);
+  if(CalPageNum==CAL_SAVED_PAGE) {saveCalibration();}  //all points entered
+}
+
+/**
+ * @brief Turn the controller one step and record the pot. position it reports
+ * 
+ * @param cmd cmdUp or cmdDown
+ */
+void calStep(uint8_t cmd)
+{
+  ControllerData.cmdESP_Now=cmd;
+  SendData(ControllerData);
+  if(DeliverySuccess)
+  {  //Controller should respond with current potADC value.  Wait for result
+    waitForReply();
+    LOGD("ADC Value = %u", ControllerData.potADC);
+    if(ControllerData.potADC<500 || ControllerData.potADC>3500)
+    {
+      CalPageNum=CAL_ERROR_PAGE;
+      printCalPages(CalPageNum);
+      calAborted();
+      return;
+    }
+    CalDataInProcess[CalPageNum-2]=ControllerData.potADC;
+  }
+}
+
+/**
+ * @brief Up/Down button events during calibration.  Up and Down pressed
+ * together (a chord, see setMode()) is "Enter", a single button turns the
+ * controller.  The chord swallows its own presses, so neither leaks into a step.
+ * 
+ */
+void calButton(const ButtonEvent &event)
+{
+  if(CalPageNum>=CAL_SAVED_PAGE) {return;}  //last page is up, waiting for the scheduler to leave Cal. mode
+  if(event.type==BTN_CHORD)
+  {
+    calEnter();
+    return;
+  }
+  if(event.type!=BTN_PRESS && event.type!=BTN_REPEAT) {return;}
+  if(event.button!=BTN_UP && event.button!=BTN_DOWN) {return;}
+  if(CalPageNum>1)
+  {
+    calStep(event.button==BTN_UP ? cmdUp : cmdDown);
+  }
+}
+
 /**
  * @brief Function to perform during calibration
  * 
@@ -808,127 +1543,159 @@ void CalOps()
   SleepPermmissive=false;
   if(FirstDraw)
   {
+    displayActivity();
     printCalPages(CalPageNum);
     FirstDraw=false;
   }
-  bool upState = digitalRead(UpButton) == LOW; // LOW means pressed
-  bool downState = digitalRead(DownButton) == LOW; // LOW means pressed
-  //check for EnterActive Time delay
-  bool TimeDelayOK=false;
-  if(millis()-LastEnterActive>EnterDelayInterval)
-  {
-    TimeDelayOK=true;
-  }
-  if(upState && downState && EnterActive && TimeDelayOK) //Both buttons pressed
+}
+
+/**
+ * @brief Take the button events from the queue and hand them to the current mode.
+ * Any event counts as activity for the idle timer and the display.
+ * 
+ */
+void handleButtons()
+{
+  ButtonEvent event;
+  while(buttonEventGet(event))
   {
-    Serial.println("Enter Pressed");
-    for(int i=0;i<9;i++)
+    LOGD("Button %u event %u", event.button, event.type);  //ButtonId, ButtonEventType
+    telemetryPost(TEL_BUTTON, event.button, event.type);
+    if(event.type==BTN_PRESS || event.type==BTN_CHORD) {idleRecordPress();}
+    LastIdleTime=millis();
+    displayActivity();
+    if(event.button==BTN_OTA)
     {
-      Serial.print("CalDat[");Serial.print(i);Serial.print("] = ");Serial.print(CalDataInProcess[i]);Serial.print(", ");
-    }
-    Serial.println(":");
-    EnterActive=false;  // disarm Enter to prevent run aways
-    TimeDelayOK=false;
-    LastEnterActive=millis();
-    CalPageNum++;
-    printCalPages(CalPageNum);
-  }
-  if(upState && !downState && (CalPageNum>1))
-  {// Up button pressed
-    if((millis()-LastDemandTime < EnterDelayInterval))
-    {//if the button press was before the delay ignore the press
-      return;
-    } else 
-    { 
-      ControllerData.cmdESP_Now=cmdUp;
-      SendData(ControllerData);
-      if(DeliverySuccess)
-      {  //Controller should respond with current potADC value.  Wait for result
-        preMillis=millis();
-        if(!NewData)
-        {
-          Serial.println("waiting...");
-          while(millis()-preMillis<timeoutMillis)
-          {
-            if(NewData)
-            {
-              NewData=false;
-              break;
-            }
-          } 
-        }
-        Serial.print("ADC Value = ");Serial.println(ControllerData.potADC);
-        if(ControllerData.potADC<500 || ControllerData.potADC>3500)
-        {
-          CalPageNum=12;
-          printCalPages(CalPageNum);
-          return;
-        }
-        CalDataInProcess[CalPageNum-2]=ControllerData.potADC;
-        delay(250);
-        LastDemandTime=millis();
-      }
-    }
-    
-  } else if (!upState && downState && (CalPageNum>1))
-  {// Down button pressed
-    if((millis()-LastDemandTime < EnterDelayInterval))
+      if(event.type==BTN_PRESS) {OTAButtonPress();}
+    } else if(event.button==BTN_CAL && !OTAMode)
     {
-      return;
+      if(event.type==BTN_PRESS) {CalButtonPress();}
+    } else if(!CalMode)  //the flow buttons work in OTA mode too
+    {
+      normalButton(event);
     } else
     {
-      ControllerData.cmdESP_Now=cmdDown;
-      SendData(ControllerData);
-      if(DeliverySuccess)
-      {  //Controller should respond with current potADC value.  Wait for result
-        preMillis=millis();
-        if(!NewData)
-        {
-          Serial.println("waiting...");
-          while(millis()-preMillis<timeoutMillis)
-          {
-            if(NewData)
-            {
-              NewData=false;
-              break;
-            }
-          } 
-        }
-        Serial.print("ADC Value = ");Serial.println(ControllerData.potADC);
-        if(ControllerData.potADC<500 || ControllerData.potADC>3500)
-        {
-          CalPageNum=12;
-          printCalPages(CalPageNum);
-          return;
-        }
-        CalDataInProcess[CalPageNum-2]=ControllerData.potADC;
-        delay(250);
-        LastDemandTime=millis();
-      }
+      calButton(event);
     }
   }
-  
 }
 
-void setup() 
+/**
+ * @brief Find the button that woke the remote from deep sleep.  Read this
+ * early, before anything else can change the wake status.
+ * 
+ * @return BTN_UP or BTN_DOWN, -1 if the boot was not an ext1 wake
+ */
+int8_t decodeWakeButton()
 {
-  Serial.begin(115200);
-  prepareLittleFS();
-  getFileData(); // Get the system mode from the file system
+  esp_sleep_wakeup_cause_t cause=esp_sleep_get_wakeup_cause();
+  if(cause!=ESP_SLEEP_WAKEUP_EXT1)
+  {
+    Serial.printf("Boot, wake cause %d\n", (int)cause);
+    return -1;
+  }
+  //the wake stub has already debounced the press, use what it saw and fall back on the ext1 status
+  uint64_t pins=wakeStubPressed();
+  if(pins==0) {pins=esp_sleep_get_ext1_wakeup_status();}
+  int8_t button=-1;
+  if(pins & BUTTON_PIN_BITMASK(UpButton)) {button=BTN_UP;}
+  else if(pins & BUTTON_PIN_BITMASK(DownButton)) {button=BTN_DOWN;}
+  Serial.printf("Woken by %s, %lu bounces rejected by the wake stub\n",
+    button==BTN_UP ? "Up" : button==BTN_DOWN ? "Down" : "unknown pin", (unsigned long)wakeStubRejected());
+  return button;
+}
+
+/**
+ * @brief Time left until interval has passed since a millis() timestamp, for
+ * the ">" checks in the main loop
+ *
+ */
+uint32_t msUntil(uint32_t since, uint32_t interval)
+{
+  uint32_t elapsed=millis()-since;
+  return elapsed>interval ? 0 : interval-elapsed+1;
+}
+
+/**
+ * @brief Time until loop() has to run again with no new event: the scheduler,
+ * the button and display timers, the flow update and the idle timeout
+ *
+ * @return milliseconds, UINT32_MAX if only an event can change anything
+ */
+uint32_t nextDeadline()
+{
+  uint32_t next=schedulerNextDue();
+  next=min(next, buttonsNextDeadline());
+  next=min(next, displayPowerNextDeadline());
+  next=min(next, bulkNextDeadline());
+  if(!CalMode)
+  {
+    if(DemandButtonPressed) {next=min(next, msUntil(LastDemandTime, DemandDelay));}
+    else {next=min(next, radioNextDeadline());}
+    if(SleepPermmissive) {next=min(next, msUntil(LastIdleTime, idleInterval()));}
+  }
+  return next;
+}
 
+/**
+ * @brief End of loop(): light sleep until the next deadline or a button, or
+ * block on the event queue while the radio or a held button needs the CPU
+ *
+ */
+void idleUntilNextEvent()
+{
+  cpuBoost(false);  //back to the minimum frequency until the next event
+  logDrain();  //deferred log records, only what the UART takes without waiting
   if(OTAMode)
   {
-    initWiFi();
-    initOTA();
-    // Define the route for the "/ADC" endpoint
-    server.on("/CAL", HTTP_GET, handle_CAL); // Use the handle_ADC function
-    server.on("/MAC", HTTP_GET, handle_MAC); // Send the MAC address as a response
-    // Start the server
-    server.begin();
-    Serial.println("HTTP server started");
-  }else{
-    initESP_NOW();
+    eventWait(1);  //the web server is polled, keep it short
+    return;
+  }
+  uint32_t wait=nextDeadline();
+  if(wait==0 || eventsPending()) {return;}
+  batteryIdle(true);  //no battery samples while waiting, they would wake the CPU
+  if(SendPending || bulkActive() || buttonsAnyLow() || !lightSleep(wait))
+  {
+    eventWait(min(wait, LoopWaitMax));  //sleep until an ISR or the WiFi task posts an event
+    batteryIdle(false);
+    return;
   }
+  batteryIdle(false);
+  buttonsResync();  //edges are not seen while the interrupts are parked
+}
+
+void setup() 
+{
+  Serial.begin(115200);
+  metricsBegin();
+  WakeButton=decodeWakeButton();
+  if(WakeButton>=0) {metricsInc(MC_WAKES);}
+  energyBegin();
+  cpuPowerBegin();  //boosted until the end of setup()
+  idleTimeoutBegin(IdleInterval);
+  eventsBegin();
+  prepareLittleFS();
+  getFileData(); // Get the system mode from the file system
+  metricsBootPhase(BOOT_FS);
+
+  initESP_NOW();  //ESP-NOW runs in every mode, OTA mode adds WiFi on the same STA interface
+  bulkBegin(bulkTransmit, bulkReceived, bulkRequested);
+  //flow presses prewarm the radio DemandDelay before the send, WiFi keeps it on in OTA mode
+  radioSetLeadTime(OTAMode ? 0 : DemandDelay);
+  // Define the route for the "/ADC" endpoint, served once OTA mode is connected
+  server.on("/CAL", HTTP_GET, handle_CAL); // Calibration table as JSON, or raw with ?format=raw
+  server.on("/CAL", HTTP_PUT, handle_CAL_done, handle_CAL_data); // Restore a calibration table
+  server.on("/MAC", HTTP_GET, handle_MAC); // Send the MAC address as a response
+  server.on("/ENERGY", HTTP_GET, handle_ENERGY); // Energy accounting report
+  server.on("/FIRMWARE", HTTP_GET, handle_FW_status); // Firmware upload status
+  server.on("/FIRMWARE", HTTP_POST, handle_FW_done, handle_FW_data); // Streaming firmware upload
+  server.on("/metrics", HTTP_GET, handle_METRICS); // Prometheus metrics
+  server.on("/LOG", HTTP_GET, handle_LOG); // Deferred log records still in RAM
+  server.on("/events", HTTP_GET, handle_EVENTS); // Live telemetry stream (SSE)
+  server.on("/live", HTTP_GET, handle_LIVE); // Page plotting the telemetry stream
+  server.on("/BULK", HTTP_GET, handle_BULK); // ESP-NOW bulk transfers and their report
+  server.on("/PROFILE", HTTP_GET, handle_PROFILE); // CPU profiler control and dump
+  metricsBootPhase(BOOT_RADIO);
 
   Wire.begin(I2C_SDA, I2C_SCL); // Initialize I2C with custom SDA and SCL pins
 
@@ -947,19 +1714,29 @@ void setup()
   
     
   u8g2.begin();
+  screenBegin(u8g2);
+  displayPowerBegin(u8g2);
   //bootCount++;
 
-  drawStartPage();
-
-  pinMode(OTAButton, INPUT_PULLUP); // Set OTAButton pin as input
-  attachInterrupt(digitalPinToInterrupt(OTAButton), OTAButtonPress, FALLING); // Attach interrupt to OTAButton
-
-  pinMode(CalButton, INPUT_PULLUP); // Set OTAButton pin as input
-  attachInterrupt(digitalPinToInterrupt(CalButton), CalButtonPress, FALLING); // Attach interrupt to CalButton
+  const uint8_t buttonPins[BTN_COUNT] = {UpButton, DownButton, CalButton, OTAButton};
+  buttonsBegin(buttonPins, (1 << BTN_UP) | (1 << BTN_DOWN)); // Up and Down auto-repeat when held
+  lightSleepBegin(buttonPins, BTN_COUNT);  //any button wakes the loop from light sleep
+  //the press that woke us is queued now and handled by loop() once the status reply has set O2Flow,
+  //so the status query overlaps with the debounce and hold timing of that press
+  if(WakeButton>=0 && !OTAMode) {buttonsWakePress(WakeButton);}
 
   pinMode(BattPin, INPUT);
   analogReadResolution(12);
   analogSetAttenuation(ADC_0db);
+  batteryBegin(BattPin);  //sample the battery in the background, first read before the status TX
+
+  drawStartPage();
+  cpuMarkDisplayed();
+  metricsBootPhase(BOOT_DISPLAY);
+  queryControllerStatus();
+  metricsBootPhase(BOOT_STATUS);
+  if(OTAMode) {initWiFi();}  //after the status query, joining scans the other channels
+  if(WakeButton>=0 && !OTAMode) {idleSetWakeCost(millis());}  //what a sleep undone by the next press costs
 
   LastIdleTime=millis();
 /**********WiFi Server Begin *****/
@@ -972,24 +1749,53 @@ void setup()
 
 void loop() 
 {
-  ArduinoOTA.handle();  //handles Over The Air updates
-  if(OTAMode) {server.handleClient();} // Handle incoming client requests
+  cpuBoost(true);  //render and handle events at full speed
+  uint32_t loopStart=eventTimeNow();
+  handleSerialCommands();  //profiler control from the serial console
+  if(OTAMode)  //ArduinoOTA and the web server only run in OTA mode
+  {
+    wifiUpdate();  //WiFi comes up in the background
+    if(WiFiState==WIFI_ST_READY)
+    {
+      ArduinoOTA.handle();  //handles Over The Air updates
+      server.handleClient(); // Handle incoming client requests
+      telemetryPump();  //live telemetry streams, never waits on a slow client
+    }
+  }
 
-  if(updateOTA) // If OTA update is needed
+  if(updateOTA) // OTA mode was toggled, no restart: WiFi comes up or goes down next to ESP-NOW
   {
     updateOTA=false; // Reset the flag
     File myFile=LittleFS.open("/OTAdata.txt",FILE_WRITE);
     myFile.write((byte *)&OTAMode, sizeof(OTAMode));
     myFile.close();
-    ESP.restart(); // Restart the ESP32 to apply changes
+    if(OTAMode)
+    {
+      initWiFi();
+      drawStartPage();
+    } else {
+      wifiStop();
+      OTAPageShown=false;
+      FirstDraw=true;
+    }
   }
 
-if (!OTAMode && !CalMode) // If the system mode is normal
+  runScheduler();  //run timed transitions
+  pumpEvents();
+  bulkPump();  //bulk transfer frames received, windows and timeouts
+  handleButtons();
+
+if (!CalMode) // If the system mode is normal, or OTA which runs alongside it
 {
+  if(!OTAPageShown) {displayPowerUpdate();}  //the WiFi page stays lit
   normalOps();
-} else if(!OTAMode && CalMode){
+  if(!DemandButtonPressed && !SendPending && !bulkActive()) {radioUpdate();}  //power the radio down between exchanges
+} else {
   // we need to calibrate data:
+  displayPowerUpdate();
   CalOps();
 }
- 
+
+  metricsObserve(MH_LOOP_US, eventTimeNow()-loopStart);
+  idleUntilNextEvent();
 }
\ No newline at end of file
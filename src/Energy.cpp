@@ -0,0 +1,207 @@
+#include "Energy.h"
+#include <esp_timer.h>
+#include <sys/time.h>
+
+#define ENERGY_RTC_MAGIC 0x454E5247  //"ENRG"
+
+float EnergyCurrentMA[EN_COUNT] =
+{
+  12.0f,   //CPU active at the minimum frequency
+  13.0f,   //CPU at 240 MHz, on top of the minimum
+  45.0f,   //receiver on, on top of the CPU
+  120.0f,  //transmitting, on top of the receiver
+  0.0f,    //reply wait, the receiver is already counted
+  8.0f,    //OLED on
+  0.75f,   //light sleep (also the automatic one in esp_pm idle, counted as CPU here)
+  0.03f    //deep sleep, chip and regulator
+};
+
+static const char *const StateNames[EN_COUNT] =
+  {"cpu", "cpu boost", "radio", "tx", "wait", "display", "light sleep", "deep sleep"};
+
+//kept over deep sleep and restarts, checked with the magic after a power on
+struct EnergyTotals
+{
+  uint32_t magic;
+  uint32_t interactions;
+  uint64_t stateUs[EN_COUNT];
+  uint64_t elapsedUs;      //wall time covered by the totals
+  int64_t sleepStartUs;    //gettimeofday() when deep sleep started, 0 if not asleep
+};
+
+RTC_NOINIT_ATTR static EnergyTotals Totals;
+
+//current interaction
+static uint64_t StateUs[EN_COUNT];
+static bool StateOn[EN_COUNT];
+static int64_t StateSince[EN_COUNT];
+static int64_t InteractionStart = 0;
+static uint64_t LastDeepSleepUs = 0;
+
+/**
+ * @brief Time of the RTC clock, which keeps running through deep sleep, for
+ * measuring across sleeps
+ *
+ */
+int64_t energyWallTimeUs()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void accountState(EnergyState state, int64_t now)
+{
+  if (!StateOn[state]) {return;}
+  StateUs[state] += now - StateSince[state];
+  StateSince[state] = now;
+}
+
+/**
+ * @brief Start the interaction, and count the deep sleep before it.  Call
+ * early in setup().
+ *
+ */
+void energyBegin()
+{
+  if (Totals.magic != ENERGY_RTC_MAGIC)
+  {
+    memset(&Totals, 0, sizeof(Totals));
+    Totals.magic = ENERGY_RTC_MAGIC;
+  }
+  if (Totals.sleepStartUs != 0)
+  {
+    int64_t slept = energyWallTimeUs() - Totals.sleepStartUs;
+    LastDeepSleepUs = slept > 0 ? slept : 0;
+    Totals.stateUs[EN_DEEP_SLEEP] += LastDeepSleepUs;
+    Totals.elapsedUs += LastDeepSleepUs;
+    Totals.sleepStartUs = 0;
+  }
+  InteractionStart = esp_timer_get_time();
+}
+
+/**
+ * @brief Turn a load state on or off.  EN_CPU, EN_LIGHT_SLEEP and EN_DEEP_SLEEP
+ * are derived and ignored here.
+ *
+ */
+void energySet(EnergyState state, bool on)
+{
+  if (state == EN_CPU || state >= EN_LIGHT_SLEEP) {return;}
+  if (on == StateOn[state]) {return;}
+  int64_t now = esp_timer_get_time();
+  accountState(state, now);
+  StateOn[state] = on;
+  StateSince[state] = now;
+}
+
+/**
+ * @brief Count a light sleep that just ended.  The radio is off meanwhile,
+ * the display is not.
+ *
+ */
+void energyLightSleep(uint64_t sleptUs)
+{
+  StateUs[EN_LIGHT_SLEEP] += sleptUs;
+  if (StateOn[EN_RADIO])
+  {
+    accountState(EN_RADIO, esp_timer_get_time() - sleptUs);
+    StateSince[EN_RADIO] += sleptUs;
+  }
+}
+
+/**
+ * @brief Close every open state and fill in the CPU time
+ *
+ */
+static void closeStates(uint64_t stateUs[EN_COUNT])
+{
+  int64_t now = esp_timer_get_time();
+  for (uint8_t i = 0; i < EN_COUNT; i++)
+  {
+    accountState((EnergyState)i, now);
+    stateUs[i] = StateUs[i];
+  }
+  uint64_t awake = now - InteractionStart;
+  stateUs[EN_CPU] = awake > StateUs[EN_LIGHT_SLEEP] ? awake - StateUs[EN_LIGHT_SLEEP] : 0;
+  stateUs[EN_DEEP_SLEEP] = LastDeepSleepUs;
+}
+
+static float chargeMAh(const uint64_t stateUs[EN_COUNT])
+{
+  float mAh = 0;
+  for (uint8_t i = 0; i < EN_COUNT; i++)
+  {
+    mAh += EnergyCurrentMA[i] * (float)stateUs[i] / 3.6e9f;
+  }
+  return mAh;
+}
+
+/**
+ * @brief End the interaction and add it to the RTC totals.  Call just before
+ * deep sleep or a restart.
+ *
+ * @param deepSleep true if the time until the next boot is deep sleep
+ */
+void energyEndInteraction(bool deepSleep)
+{
+  uint64_t stateUs[EN_COUNT];
+  closeStates(stateUs);
+  for (uint8_t i = 0; i < EN_COUNT; i++)
+  {
+    if (i != EN_DEEP_SLEEP) {Totals.stateUs[i] += stateUs[i];}  //deep sleep was added at boot
+  }
+  Totals.elapsedUs += esp_timer_get_time() - InteractionStart;
+  Totals.interactions++;
+  Totals.sleepStartUs = deepSleep ? energyWallTimeUs() : 0;
+  InteractionStart = esp_timer_get_time();
+  LastDeepSleepUs = 0;
+  for (uint8_t i = 0; i < EN_COUNT; i++) {StateUs[i] = 0;}
+}
+
+/**
+ * @brief Write the report for the current interaction and the totals as text
+ *
+ * @return number of characters written
+ */
+size_t energyFormat(char *buf, size_t len)
+{
+  uint64_t stateUs[EN_COUNT];
+  closeStates(stateUs);
+  size_t n = 0;
+  #define ENERGY_PRINT(...) if (n < len) {n += snprintf(buf + n, len - n, __VA_ARGS__);}
+
+  float mAh = chargeMAh(stateUs);
+  ENERGY_PRINT("Energy this interaction: %.3f mAh\n", mAh);
+  for (uint8_t i = 0; i < EN_COUNT; i++)
+  {
+    ENERGY_PRINT("  %-11s %9lu ms %6.2f mA %.4f mAh\n", StateNames[i],
+      (unsigned long)(stateUs[i] / 1000), EnergyCurrentMA[i], EnergyCurrentMA[i] * (float)stateUs[i] / 3.6e9f);
+  }
+
+  float totalMAh = chargeMAh(Totals.stateUs);
+  float hours = (float)Totals.elapsedUs / 3.6e9f;
+  ENERGY_PRINT("Energy since power on: %lu interactions, %.2f h, %.3f mAh", (unsigned long)Totals.interactions, hours, totalMAh);
+  if (Totals.interactions > 0)
+  {
+    ENERGY_PRINT(", %.4f mAh per interaction", totalMAh / Totals.interactions);
+  }
+  if (hours > 0)
+  {
+    ENERGY_PRINT(", %.2f mAh per day", totalMAh * 24.0f / hours);
+  }
+  ENERGY_PRINT("\n");
+  #undef ENERGY_PRINT
+  return n < len ? n : len - 1;
+}
+
+/**
+ * @brief Print energyFormat() on the serial port
+ *
+ */
+void energyReport()
+{
+  static char report[ENERGY_REPORT_SIZE];
+  energyFormat(report, sizeof(report));
+  Serial.print(report);
+}
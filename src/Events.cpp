@@ -0,0 +1,143 @@
+#include "Events.h"
+#include <atomic>
+#include <esp_timer.h>
+
+struct EventSlot
+{
+  std::atomic<uint32_t> seq;  //slot is free for position seq, holds position seq-1 once written
+  Event event;
+};
+
+static EventSlot Slots[EVENT_QUEUE_SIZE];
+static std::atomic<uint32_t> EnqueuePos(0);
+static uint32_t DequeuePos = 0;  //only used by the main task
+static std::atomic<uint32_t> Dropped(0);
+static TaskHandle_t MainTask = NULL;
+
+/**
+ * @brief Set up the queue and remember the task that consumes it.  Call from
+ * setup(), which runs in the same task as loop().
+ *
+ */
+void eventsBegin()
+{
+  for (uint32_t i = 0; i < EVENT_QUEUE_SIZE; i++)
+  {
+    Slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+  EnqueuePos.store(0, std::memory_order_relaxed);
+  DequeuePos = 0;
+  MainTask = xTaskGetCurrentTaskHandle();
+}
+
+/**
+ * @brief Timestamp used for events, the esp_timer counter in microseconds
+ * truncated to 32 bits.  Only differences are meaningful.
+ *
+ */
+uint32_t IRAM_ATTR eventTimeNow()
+{
+  return (uint32_t)esp_timer_get_time();
+}
+
+/**
+ * @brief Claim a slot and write the event.  Lock-free, safe from any task or ISR.
+ *
+ */
+static bool IRAM_ATTR enqueue(uint8_t type, uint8_t arg, uint16_t value, int8_t aux)
+{
+  uint32_t pos = EnqueuePos.load(std::memory_order_relaxed);
+  EventSlot *slot;
+  for (;;)
+  {
+    slot = &Slots[pos & (EVENT_QUEUE_SIZE - 1)];
+    int32_t diff = (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+    if (diff == 0)
+    {
+      if (EnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {break;}
+    } else if (diff < 0)
+    {
+      Dropped.fetch_add(1, std::memory_order_relaxed);  //full
+      return false;
+    } else {
+      pos = EnqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+  slot->event.type = type;
+  slot->event.arg = arg;
+  slot->event.aux = aux;
+  slot->event.value = value;
+  slot->event.time = eventTimeNow();
+  slot->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+/**
+ * @brief Post an event from a task (e.g. the WiFi task running the ESP-NOW callbacks)
+ *
+ * @return false if the queue was full and the event was dropped
+ */
+bool eventPost(uint8_t type, uint8_t arg, uint16_t value, int8_t aux)
+{
+  bool posted = enqueue(type, arg, value, aux);
+  if (MainTask != NULL) {xTaskNotifyGive(MainTask);}
+  return posted;
+}
+
+/**
+ * @brief Post an event from an interrupt
+ *
+ * @return false if the queue was full and the event was dropped
+ */
+bool IRAM_ATTR eventPostFromISR(uint8_t type, uint8_t arg, uint16_t value, int8_t aux)
+{
+  bool posted = enqueue(type, arg, value, aux);
+  if (MainTask != NULL)
+  {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(MainTask, &woken);
+    if (woken) {portYIELD_FROM_ISR();}
+  }
+  return posted;
+}
+
+/**
+ * @brief Take the oldest event.  Main task only.
+ *
+ * @return false if there is no event ready
+ */
+bool eventGet(Event &event)
+{
+  EventSlot &slot = Slots[DequeuePos & (EVENT_QUEUE_SIZE - 1)];
+  if ((int32_t)(slot.seq.load(std::memory_order_acquire) - (DequeuePos + 1)) < 0) {return false;}
+  event = slot.event;
+  slot.seq.store(DequeuePos + EVENT_QUEUE_SIZE, std::memory_order_release);
+  DequeuePos++;
+  return true;
+}
+
+/**
+ * @brief Block the main task until an event is posted or the timeout passes.
+ * The CPU is free for the idle task (and automatic light sleep) meanwhile.
+ *
+ * @return true if woken by an event
+ */
+bool eventWait(uint32_t timeoutMs)
+{
+  return ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeoutMs)) > 0;
+}
+
+/**
+ * @brief Check if an event is ready without taking it
+ *
+ */
+bool eventsPending()
+{
+  EventSlot &slot = Slots[DequeuePos & (EVENT_QUEUE_SIZE - 1)];
+  return (int32_t)(slot.seq.load(std::memory_order_acquire) - (DequeuePos + 1)) >= 0;
+}
+
+uint32_t eventsDropped()
+{
+  return Dropped.load(std::memory_order_relaxed);
+}
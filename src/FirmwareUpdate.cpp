@@ -0,0 +1,410 @@
+#include "FirmwareUpdate.h"
+#include <esp_ota_ops.h>
+#include <esp_timer.h>
+#include <mbedtls/sha256.h>
+#include <rom/miniz.h>
+
+static FwState State = FW_IDLE;
+static FwEncoding Encoding = FW_RAW;
+static const esp_partition_t *Partition = NULL;
+static mbedtls_sha256_context Sha;
+static uint8_t Expected[32];
+static uint32_t Size = 0;
+static uint32_t Received = 0;   //bytes of the upload taken in (compressed for gzip)
+static uint32_t Written = 0;    //bytes of the image hashed, written or in SectorBuf
+static uint8_t SectorBuf[FW_SECTOR_SIZE];
+static uint32_t SectorFill = 0;
+static const char *Error = "";
+
+//gzip member (RFC 1952), parsed as it arrives
+#define GZ_MIN_SIZE 18           //fixed header and trailer
+enum GzStage {GZ_FIXED, GZ_EXTRA_LEN, GZ_EXTRA, GZ_NAME, GZ_COMMENT, GZ_HCRC, GZ_DEFLATE, GZ_DONE};
+static GzStage Stage = GZ_FIXED;
+static uint8_t GzFlags = 0;
+static uint32_t GzCount = 0;     //bytes of the current header field seen
+static uint32_t GzExtraLen = 0;
+static uint8_t Trailer[8];       //CRC-32 and the image size mod 2^32, the last 8 bytes of the upload
+static tinfl_decompressor *Inflater = NULL;
+static uint8_t *Window = NULL;   //TINFL_LZ_DICT_SIZE, the inflater writes its output here
+static uint32_t WindowPos = 0;
+
+//throughput over the time spent receiving
+static uint64_t TransferUs = 0;
+static int64_t RequestStart = 0;
+static uint32_t RequestStartOffset = 0;
+
+static void freeInflater()
+{
+  free(Inflater);
+  free(Window);
+  Inflater = NULL;
+  Window = NULL;
+}
+
+static void fail(const char *reason)
+{
+  if (State == FW_RECEIVING) {mbedtls_sha256_free(&Sha);}
+  freeInflater();
+  State = FW_FAILED;
+  Error = reason;
+  Serial.printf("Firmware update failed: %s\n", reason);
+}
+
+static bool parseSha(const char *hex, uint8_t out[32])
+{
+  if (hex == NULL || strlen(hex) != 64) {return false;}
+  for (uint8_t i = 0; i < 32; i++)
+  {
+    char byte[3] = {hex[2 * i], hex[2 * i + 1], 0};
+    char *end;
+    out[i] = (uint8_t)strtoul(byte, &end, 16);
+    if (*end != 0) {return false;}
+  }
+  return true;
+}
+
+/**
+ * @brief Erase the next sector of the partition and write the buffer to it
+ *
+ */
+static bool flushSector()
+{
+  uint32_t sectorStart = Written - SectorFill;
+  if (esp_partition_erase_range(Partition, sectorStart, FW_SECTOR_SIZE) != ESP_OK) {return false;}
+  uint32_t len = (SectorFill + 15) & ~15U;  //flash writes are padded to 16 bytes (encryption block)
+  memset(SectorBuf + SectorFill, 0xFF, len - SectorFill);
+  if (esp_partition_write(Partition, sectorStart, SectorBuf, len) != ESP_OK) {return false;}
+  SectorFill = 0;
+  return true;
+}
+
+/**
+ * @brief Hash and store the next part of the image itself
+ *
+ */
+static bool storeImage(const uint8_t *data, size_t len)
+{
+  if (Written + len > Partition->size)
+  {
+    fail("image does not fit the partition");
+    return false;
+  }
+  mbedtls_sha256_update(&Sha, data, len);
+  while (len > 0)
+  {
+    size_t take = FW_SECTOR_SIZE - SectorFill;
+    if (take > len) {take = len;}
+    memcpy(SectorBuf + SectorFill, data, take);
+    SectorFill += take;
+    Written += take;
+    data += take;
+    len -= take;
+    if (SectorFill == FW_SECTOR_SIZE && !flushSector())
+    {
+      fail("flash write error");
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief The first header field after the one just done, from the header flags
+ *
+ */
+static GzStage nextHeaderStage(GzStage done)
+{
+  if (done < GZ_EXTRA_LEN && (GzFlags & 0x04)) {return GZ_EXTRA_LEN;}
+  if (done < GZ_NAME && (GzFlags & 0x08)) {return GZ_NAME;}
+  if (done < GZ_COMMENT && (GzFlags & 0x10)) {return GZ_COMMENT;}
+  if (done < GZ_HCRC && (GzFlags & 0x02)) {return GZ_HCRC;}
+  return GZ_DEFLATE;
+}
+
+/**
+ * @brief Take one byte of the gzip header
+ *
+ * @return false if it is not a deflate gzip member
+ */
+static bool gzipHeaderByte(uint8_t b)
+{
+  switch (Stage)
+  {
+    case GZ_FIXED:  //ID1 ID2 CM FLG MTIME(4) XFL OS
+      if ((GzCount == 0 && b != 0x1f) || (GzCount == 1 && b != 0x8b) || (GzCount == 2 && b != 8)) {return false;}
+      if (GzCount == 3) {GzFlags = b;}
+      if (++GzCount < 10) {return true;}
+      break;
+    case GZ_EXTRA_LEN:
+      GzExtraLen |= (uint32_t)b << (8 * GzCount);
+      if (++GzCount < 2) {return true;}
+      if (GzExtraLen > 0)
+      {
+        Stage = GZ_EXTRA;
+        GzCount = 0;
+        return true;
+      }
+      break;
+    case GZ_EXTRA:
+      if (++GzCount < GzExtraLen) {return true;}
+      break;
+    case GZ_NAME:
+    case GZ_COMMENT:  //zero terminated
+      if (b != 0) {return true;}
+      break;
+    case GZ_HCRC:
+      if (++GzCount < 2) {return true;}
+      break;
+    default:
+      return false;
+  }
+  Stage = nextHeaderStage(Stage);
+  GzCount = 0;
+  return true;
+}
+
+/**
+ * @brief Inflate the next part of a gzip upload and store what comes out.
+ * The trailer is taken by its position, the last 8 bytes of the upload: the
+ * ROM's tinfl reads ahead into its bit buffer and may not give the bytes past
+ * the end of the deflate stream back.
+ *
+ * @param data the part of the upload that ends at Received
+ * @return false if the upload failed
+ */
+static bool inflateUpload(const uint8_t *data, size_t len)
+{
+  uint32_t trailerStart = Size - sizeof(Trailer);
+  uint32_t start = Received - len;
+  if (start + len > trailerStart)
+  {
+    uint32_t skip = start < trailerStart ? trailerStart - start : 0;
+    memcpy(Trailer + (start + skip - trailerStart), data + skip, len - skip);
+  }
+  while (len > 0 && Stage < GZ_DEFLATE)
+  {
+    if (!gzipHeaderByte(*data++))
+    {
+      fail("not a gzip image");
+      return false;
+    }
+    len--;
+  }
+  tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+  while (Stage == GZ_DEFLATE && (len > 0 || status == TINFL_STATUS_HAS_MORE_OUTPUT))
+  {
+    size_t in = len;
+    size_t out = TINFL_LZ_DICT_SIZE - WindowPos;
+    status = tinfl_decompress(Inflater, data, &in, Window, Window + WindowPos, &out, TINFL_FLAG_HAS_MORE_INPUT);
+    data += in;
+    len -= in;
+    if (out > 0 && !storeImage(Window + WindowPos, out)) {return false;}
+    WindowPos = (WindowPos + out) & (TINFL_LZ_DICT_SIZE - 1);
+    if (status < TINFL_STATUS_DONE)
+    {
+      fail("corrupt compressed image");
+      return false;
+    }
+    if (status == TINFL_STATUS_DONE) {Stage = GZ_DONE;}
+  }
+  if (len > 0 && Received - len < trailerStart)  //only the trailer may follow the deflate stream
+  {
+    fail("data after the end of the compressed image");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Start or resume an upload
+ *
+ * @param offset 0 to start over, otherwise the number of bytes already received
+ * @param size total upload size, compressed for gzip
+ * @param sha256Hex expected SHA-256 of the whole image, 64 hex characters
+ * @param encoding FW_GZIP for an image packed by tools/pack_firmware.py
+ * @return false if rejected, see fwStatus()
+ */
+bool fwBegin(uint32_t offset, uint32_t size, const char *sha256Hex, FwEncoding encoding)
+{
+  uint8_t sha[32];
+  if (!parseSha(sha256Hex, sha))
+  {
+    Error = "sha256 missing or malformed";
+    return false;
+  }
+  if (offset == 0)
+  {
+    if (State == FW_RECEIVING) {mbedtls_sha256_free(&Sha);}
+    freeInflater();
+    State = FW_IDLE;
+    Partition = esp_ota_get_next_update_partition(NULL);
+    if (Partition == NULL)
+    {
+      fail("no OTA partition");
+      return false;
+    }
+    if (size == 0 || size > Partition->size)
+    {
+      fail("image does not fit the partition");
+      return false;
+    }
+    if (encoding == FW_GZIP && size < GZ_MIN_SIZE)
+    {
+      fail("compressed image truncated");
+      return false;
+    }
+    if (encoding == FW_GZIP)
+    {
+      Inflater = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+      Window = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+      if (Inflater == NULL || Window == NULL)
+      {
+        fail("no memory to inflate");
+        return false;
+      }
+      tinfl_init(Inflater);
+    }
+    memcpy(Expected, sha, sizeof(Expected));
+    Encoding = encoding;
+    Size = size;
+    Received = 0;
+    Written = 0;
+    SectorFill = 0;
+    Stage = GZ_FIXED;
+    GzFlags = 0;
+    GzCount = 0;
+    GzExtraLen = 0;
+    WindowPos = 0;
+    TransferUs = 0;
+    mbedtls_sha256_init(&Sha);
+    mbedtls_sha256_starts(&Sha, 0);
+    State = FW_RECEIVING;
+    Error = "";
+  } else if (State != FW_RECEIVING || size != Size || encoding != Encoding || memcmp(sha, Expected, sizeof(Expected)) != 0)
+  {
+    Error = "nothing to resume, start at offset 0";
+    return false;
+  } else if (offset != Received)
+  {
+    Error = "resume offset mismatch";
+    return false;
+  }
+  RequestStart = esp_timer_get_time();
+  RequestStartOffset = Received;
+  return true;
+}
+
+/**
+ * @brief Take the next part of the upload
+ *
+ * @return false if the upload failed
+ */
+bool fwWrite(const uint8_t *data, size_t len)
+{
+  if (State != FW_RECEIVING) {return false;}
+  if (Received + len > Size)
+  {
+    fail("more data than the declared size");
+    return false;
+  }
+  Received += len;
+  return Encoding == FW_GZIP ? inflateUpload(data, len) : storeImage(data, len);
+}
+
+/**
+ * @brief Upload throughput and, for a compressed image, the transfer time it saved
+ *
+ */
+static float transferKBps()
+{
+  return TransferUs ? (float)Received * 1000.0f / TransferUs : 0;
+}
+
+static uint32_t savedMs()
+{
+  float kBps = transferKBps();
+  return (Written > Received && kBps > 0) ? (uint32_t)((Written - Received) / kBps) : 0;
+}
+
+/**
+ * @brief End of a request body.  If the image is complete it is verified and
+ * set to boot.
+ *
+ * @param aborted the connection dropped, keep what came in for a resume
+ */
+FwState fwEnd(bool aborted)
+{
+  if (State != FW_RECEIVING) {return State;}
+  TransferUs += esp_timer_get_time() - RequestStart;
+  Serial.printf("Firmware: %lu of %lu bytes (+%lu this request)%s, %.1f kB/s\n",
+    (unsigned long)Received, (unsigned long)Size, (unsigned long)(Received - RequestStartOffset),
+    aborted ? ", connection lost" : "", transferKBps());
+  if (aborted || Received < Size) {return State;}
+
+  if (Encoding == FW_GZIP)
+  {
+    uint32_t isize = Trailer[4] | (Trailer[5] << 8) | (Trailer[6] << 16) | ((uint32_t)Trailer[7] << 24);
+    if (Stage != GZ_DONE || isize != Written)
+    {
+      fail("compressed image truncated");
+      return State;
+    }
+    freeInflater();
+  }
+  if (SectorFill > 0 && !flushSector())
+  {
+    fail("flash write error");
+    return State;
+  }
+  uint8_t sha[32];
+  mbedtls_sha256_finish(&Sha, sha);
+  mbedtls_sha256_free(&Sha);
+  State = FW_IDLE;
+  if (memcmp(sha, Expected, sizeof(sha)) != 0)
+  {
+    State = FW_FAILED;
+    Error = "sha256 mismatch";
+    Serial.println("Firmware update failed: sha256 mismatch");
+    return State;
+  }
+  if (esp_ota_set_boot_partition(Partition) != ESP_OK)  //also checks the image
+  {
+    State = FW_FAILED;
+    Error = "image rejected";
+    Serial.println("Firmware update failed: image rejected");
+    return State;
+  }
+  State = FW_VERIFIED;
+  Serial.printf("Firmware verified, boot set to %s\n", Partition->label);
+  if (Encoding == FW_GZIP)
+  {
+    Serial.printf("Firmware: %lu byte image sent as %lu bytes (%.1f%%), about %lu ms of transfer saved\n",
+      (unsigned long)Written, (unsigned long)Received, 100.0f * Received / Written, (unsigned long)savedMs());
+  }
+  return State;
+}
+
+FwState fwState()
+{
+  return State;
+}
+
+uint32_t fwOffset()
+{
+  return Received;
+}
+
+/**
+ * @brief Upload state as JSON
+ *
+ * @return number of characters written
+ */
+size_t fwStatus(char *buf, size_t len)
+{
+  static const char *const names[] = {"idle", "receiving", "verified", "failed"};
+  int n = snprintf(buf, len, "{\"state\":\"%s\",\"encoding\":\"%s\",\"offset\":%lu,\"size\":%lu,\"image\":%lu,"
+    "\"kBps\":%.1f,\"savedMs\":%lu,\"error\":\"%s\"}",
+    names[State], Encoding == FW_GZIP ? "gzip" : "raw", (unsigned long)Received, (unsigned long)Size,
+    (unsigned long)Written, transferKBps(), (unsigned long)savedMs(), Error);
+  return n < (int)len ? n : len - 1;
+}
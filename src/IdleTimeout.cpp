@@ -0,0 +1,166 @@
+#include "IdleTimeout.h"
+#include "Energy.h"
+
+#define IDLE_RTC_MAGIC 0x49444C45  //"IDLE"
+#define IDLE_BUCKETS 19
+
+float IdleMidSessionMax = 0.10f;
+
+//upper edge (ms) of each gap bucket, the last one is open
+static const uint32_t BucketEdge[IDLE_BUCKETS] =
+{
+  250, 500, 1000, 1500, 2000, 3000, 4000, 5000, 6000, 8000,
+  10000, 12000, 15000, 20000, 25000, 30000, 45000, 60000, UINT32_MAX
+};
+
+struct IdleHistory
+{
+  uint32_t magic;
+  uint16_t count[IDLE_BUCKETS];
+  uint32_t total;
+  int64_t lastPressUs;   //wall clock of the last press, 0 if none
+  uint32_t wakeMs;       //time from a wake to the end of the status query (smoothed)
+};
+
+RTC_DATA_ATTR static IdleHistory History;
+
+static uint32_t DefaultMs = 15000;
+static uint32_t TimeoutMs = 15000;
+static float ExpectedMAs = 0;   //expected charge per idle period at TimeoutMs
+static float MidSession = 0;    //chance of sleeping during a pause at TimeoutMs
+
+//mean gap (s) assumed for a bucket
+static float bucketMidS(uint8_t b)
+{
+  uint32_t lo = b == 0 ? 0 : BucketEdge[b - 1];
+  uint32_t hi = BucketEdge[b] == UINT32_MAX ? 2 * lo : BucketEdge[b];
+  return (lo + hi) / 2000.0f;
+}
+
+/**
+ * @brief Pick the timeout with the lowest expected charge that respects the
+ * mid-session bound
+ *
+ */
+static void choose()
+{
+  if (History.total < IDLE_MIN_SAMPLES)
+  {
+    TimeoutMs = DefaultMs;
+    return;
+  }
+  //awake and idle: mostly light sleep with the display on
+  float idleMA = EnergyCurrentMA[EN_LIGHT_SLEEP] + EnergyCurrentMA[EN_DISPLAY];
+  float activeMA = EnergyCurrentMA[EN_CPU] + EnergyCurrentMA[EN_CPU_BOOST] + EnergyCurrentMA[EN_RADIO];
+  float wakeMAs = activeMA * History.wakeMs / 1000.0f;
+
+  uint32_t sessionTotal = 0;
+  for (uint8_t b = 0; b < IDLE_BUCKETS && BucketEdge[b] <= IDLE_SESSION_GAP_MS; b++) {sessionTotal += History.count[b];}
+
+  bool found = false;
+  for (uint8_t t = 0; t < IDLE_BUCKETS; t++)
+  {
+    uint32_t candidate = BucketEdge[t];
+    if (candidate < IDLE_MIN_MS || candidate > IDLE_MAX_MS) {continue;}
+    float cost = 0;
+    uint32_t pausesMissed = 0;
+    for (uint8_t b = 0; b < IDLE_BUCKETS; b++)
+    {
+      float p = (float)History.count[b] / History.total;
+      if (BucketEdge[b] <= candidate)
+      {
+        cost += p * bucketMidS(b) * idleMA;
+      } else {
+        cost += p * (candidate / 1000.0f * idleMA + wakeMAs);
+        if (BucketEdge[b] <= IDLE_SESSION_GAP_MS) {pausesMissed += History.count[b];}
+      }
+    }
+    float mid = sessionTotal ? (float)pausesMissed / sessionTotal : 0;
+    if (mid > IdleMidSessionMax) {continue;}
+    if (!found || cost < ExpectedMAs)
+    {
+      found = true;
+      TimeoutMs = candidate;
+      ExpectedMAs = cost;
+      MidSession = mid;
+    }
+  }
+  if (!found) {TimeoutMs = IDLE_MAX_MS;}  //pauses are too long for the bound, stay up as long as allowed
+}
+
+/**
+ * @brief Start with the RTC history, or an empty one after a power on
+ *
+ * @param defaultMs timeout to use until enough gaps are known
+ */
+void idleTimeoutBegin(uint32_t defaultMs)
+{
+  DefaultMs = defaultMs;
+  if (History.magic != IDLE_RTC_MAGIC)
+  {
+    memset(&History, 0, sizeof(History));
+    History.magic = IDLE_RTC_MAGIC;
+  }
+  choose();
+}
+
+/**
+ * @brief Count the gap since the previous press.  Call on every button press.
+ *
+ */
+void idleRecordPress()
+{
+  int64_t now = energyWallTimeUs();
+  if (History.lastPressUs != 0 && now > History.lastPressUs)
+  {
+    uint64_t gapMs = (now - History.lastPressUs) / 1000;
+    uint8_t b = 0;
+    while (BucketEdge[b] != UINT32_MAX && gapMs > BucketEdge[b]) {b++;}
+    History.count[b]++;
+    History.total++;
+    if (History.total >= IDLE_DECAY_TOTAL)
+    {
+      History.total = 0;
+      for (uint8_t i = 0; i < IDLE_BUCKETS; i++)
+      {
+        History.count[i] /= 2;
+        History.total += History.count[i];
+      }
+    }
+    choose();
+  }
+  History.lastPressUs = now;
+}
+
+/**
+ * @brief Time a wake took from boot to the end of the status query, the cost
+ * paid by every sleep that the next press undoes
+ *
+ */
+void idleSetWakeCost(uint32_t wakeMs)
+{
+  History.wakeMs = History.wakeMs == 0 ? wakeMs : (History.wakeMs * 3 + wakeMs) / 4;
+  choose();
+}
+
+uint32_t idleTimeout()
+{
+  return TimeoutMs;
+}
+
+/**
+ * @brief Print the chosen timeout and the gap histogram
+ *
+ */
+void idleTimeoutReport()
+{
+  Serial.printf("Idle timeout %lu ms from %lu gaps (wake %lu ms), expected %.3f mAs per idle, pause sleep chance %.0f%%\n",
+    (unsigned long)TimeoutMs, (unsigned long)History.total, (unsigned long)History.wakeMs,
+    ExpectedMAs, MidSession * 100.0f);
+  for (uint8_t b = 0; b < IDLE_BUCKETS; b++)
+  {
+    if (History.count[b] == 0) {continue;}
+    if (BucketEdge[b] == UINT32_MAX) {Serial.printf("  >%lu ms: %u\n", (unsigned long)BucketEdge[b - 1], History.count[b]);}
+    else {Serial.printf("  <=%lu ms: %u\n", (unsigned long)BucketEdge[b], History.count[b]);}
+  }
+}
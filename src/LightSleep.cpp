@@ -0,0 +1,84 @@
+#include "LightSleep.h"
+#include "Energy.h"
+#include <driver/gpio.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+
+#define LS_MAX_PINS 8
+
+static uint8_t WakePins[LS_MAX_PINS];
+static uint8_t WakePinCount = 0;
+
+//time in light sleep since the wake from deep sleep
+static uint64_t SleepUs = 0;
+static uint32_t SleepCount = 0;
+
+/**
+ * @brief Set the pins that wake the chip when pulled low.  Their interrupts
+ * must already be attached (they are restored to any edge after each sleep).
+ *
+ */
+void lightSleepBegin(const uint8_t *pins, uint8_t count)
+{
+  WakePinCount = count > LS_MAX_PINS ? LS_MAX_PINS : count;
+  for (uint8_t i = 0; i < WakePinCount; i++) {WakePins[i] = pins[i];}
+}
+
+/**
+ * @brief Light sleep until a wake pin goes low or maxMs passes.
+ *
+ * @param maxMs longest sleep, UINT32_MAX to wait for a pin only
+ * @return false if the wait is too short to be worth sleeping or the sleep was rejected
+ */
+bool lightSleep(uint32_t maxMs)
+{
+  if (maxMs < LS_MIN_SLEEP_MS) {return false;}
+  Serial.flush();  //the UART stops in light sleep
+
+  for (uint8_t i = 0; i < WakePinCount; i++)
+  {
+    gpio_num_t pin = (gpio_num_t)WakePins[i];
+    gpio_intr_disable(pin);  //a level interrupt would fire continuously after the wake
+    gpio_wakeup_enable(pin, GPIO_INTR_LOW_LEVEL);
+  }
+  esp_sleep_enable_gpio_wakeup();
+  if (maxMs != UINT32_MAX) {esp_sleep_enable_timer_wakeup((uint64_t)maxMs * 1000);}
+
+  int64_t start = esp_timer_get_time();
+  esp_err_t result = esp_light_sleep_start();
+  int64_t slept = esp_timer_get_time() - start;
+
+  //only ext1 must stay armed for the deep sleep
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_TIMER);
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_GPIO);
+  for (uint8_t i = 0; i < WakePinCount; i++)
+  {
+    gpio_num_t pin = (gpio_num_t)WakePins[i];
+    gpio_wakeup_disable(pin);
+    gpio_set_intr_type(pin, GPIO_INTR_ANYEDGE);
+    gpio_intr_enable(pin);
+  }
+
+  if (result != ESP_OK) {return false;}
+  SleepUs += slept;
+  SleepCount++;
+  energyLightSleep(slept);
+  return true;
+}
+
+/**
+ * @brief Print the CPU duty cycle since the wake and the average current it
+ * implies.  Call just before deep sleep.
+ *
+ */
+void lightSleepReport()
+{
+  uint64_t totalUs = esp_timer_get_time();
+  if (totalUs == 0) {return;}
+  uint64_t awakeUs = totalUs > SleepUs ? totalUs - SleepUs : 0;
+  float duty = (float)awakeUs / (float)totalUs;
+  float avgMA = duty * EnergyCurrentMA[EN_CPU] + (1.0f - duty) * EnergyCurrentMA[EN_LIGHT_SLEEP];
+  Serial.printf("Light sleep: %lu sleeps, awake %lu ms, asleep %lu ms, duty %.1f%%, avg CPU %.1f mA\n",
+    (unsigned long)SleepCount, (unsigned long)(awakeUs / 1000), (unsigned long)(SleepUs / 1000),
+    duty * 100.0f, avgMA);
+}
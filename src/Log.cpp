@@ -0,0 +1,197 @@
+#include "Log.h"
+
+struct LogRecord
+{
+  uint32_t time;     //millis()
+  const char *fmt;
+  uint32_t args[LOG_MAX_ARGS];
+  uint8_t level;
+  uint8_t count;
+  uint8_t floats;    //bit i set: args[i] is a float
+};
+
+static LogRecord Ring[LOG_RING_SIZE];
+static uint32_t Head = 0;       //position of the next record, record p is in Ring[p % LOG_RING_SIZE]
+static uint32_t SerialPos = 0;  //next record to print on the serial port
+static uint32_t Lost = 0;       //overwritten before they were printed
+static portMUX_TYPE LogMux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Store a record, called through the LOGx macros.  Safe from any task.
+ *
+ */
+void logWrite(uint8_t level, const char *fmt, const uint32_t *args, uint8_t count, uint8_t floats)
+{
+  uint32_t now = millis();
+  portENTER_CRITICAL_SAFE(&LogMux);
+  LogRecord &record = Ring[Head & (LOG_RING_SIZE - 1)];
+  record.time = now;
+  record.fmt = fmt;
+  for (uint8_t i = 0; i < count; i++) {record.args[i] = args[i];}
+  record.level = level;
+  record.count = count;
+  record.floats = floats;
+  Head++;
+  if (Head - SerialPos > LOG_RING_SIZE)
+  {
+    SerialPos++;
+    Lost++;
+  }
+  portEXIT_CRITICAL_SAFE(&LogMux);
+}
+
+/**
+ * @brief Copy record pos out of the ring
+ *
+ * @return false if it is not written yet or already overwritten
+ */
+static bool readRecord(uint32_t pos, LogRecord &record)
+{
+  portENTER_CRITICAL_SAFE(&LogMux);
+  bool held = (int32_t)(Head - pos) > 0 && Head - pos <= LOG_RING_SIZE;
+  if (held) {record = Ring[pos & (LOG_RING_SIZE - 1)];}
+  portEXIT_CRITICAL_SAFE(&LogMux);
+  return held;
+}
+
+/**
+ * @brief Record pos is out on the serial port, unless a writer overtook it meanwhile
+ *
+ */
+static void markPrinted(uint32_t pos)
+{
+  portENTER_CRITICAL_SAFE(&LogMux);
+  if (SerialPos == pos) {SerialPos++;}
+  portEXIT_CRITICAL_SAFE(&LogMux);
+}
+
+/**
+ * @brief Format one conversion of the record's format string
+ *
+ */
+static int formatArg(char *buf, size_t len, const char *spec, char conv, const LogRecord &record, uint8_t arg)
+{
+  uint32_t bits = arg < record.count ? record.args[arg] : 0;
+  bool isFloat = record.floats & (1 << arg);
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  switch (conv)
+  {
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+      return snprintf(buf, len, spec, isFloat ? (double)f : (double)(int32_t)bits);
+    case 's':
+      return snprintf(buf, len, spec, (const char *)(uintptr_t)bits);
+    case 'd': case 'i': case 'c':
+      return snprintf(buf, len, spec, isFloat ? (int)f : (int)bits);
+    default:  //u x X o
+      return snprintf(buf, len, spec, isFloat ? (unsigned)f : (unsigned)bits);
+  }
+}
+
+/**
+ * @brief Render a record as one line, "<millis> <level> <text>\n"
+ *
+ * @return number of characters written
+ */
+static size_t formatRecord(const LogRecord &record, char *buf, size_t len)
+{
+  static const char levels[] = "?EWID";
+  int n = snprintf(buf, len, "%lu %c ", (unsigned long)record.time, levels[record.level <= LOG_LEVEL_DEBUG ? record.level : 0]);
+  const char *p = record.fmt;
+  uint8_t arg = 0;
+  while (*p && n < (int)len - 2)
+  {
+    if (*p != '%' || p[1] == '%')
+    {
+      buf[n++] = *p;
+      p += (*p == '%') ? 2 : 1;
+      continue;
+    }
+    char spec[12];
+    size_t s = 0;
+    spec[s++] = *p++;
+    while (*p && strchr("diucxXofFeEgGs", *p) == NULL)  //flags, width, precision
+    {
+      if (*p != 'l' && *p != 'h' && s < sizeof(spec) - 2) {spec[s++] = *p;}  //arguments are 32 bits already
+      p++;
+    }
+    if (!*p) {break;}
+    char conv = *p++;
+    spec[s++] = conv;
+    spec[s] = 0;
+    int w = formatArg(buf + n, len - 1 - n, spec, conv, record, arg++);
+    if (w > 0) {n += w;}
+    if (n > (int)len - 2) {n = len - 2;}
+  }
+  buf[n++] = '\n';
+  buf[n] = 0;
+  return n;
+}
+
+/**
+ * @brief Print the pending records that fit in the UART's TX buffer.  Call
+ * from loop() when it is about to wait, never blocks.
+ *
+ */
+void logDrain()
+{
+  LogRecord record;
+  char line[LOG_LINE_SIZE];
+  uint32_t pos = SerialPos;
+  while (readRecord(pos, record))
+  {
+    size_t n = formatRecord(record, line, sizeof(line));
+    if (Serial.availableForWrite() < (int)n) {return;}  //the rest goes out on a later pass
+    Serial.write((const uint8_t *)line, n);
+    markPrinted(pos);
+    pos = SerialPos;
+  }
+}
+
+/**
+ * @brief Print every pending record and wait until they are out.  Call
+ * before deep sleep or a restart.
+ *
+ */
+void logFlush()
+{
+  LogRecord record;
+  char line[LOG_LINE_SIZE];
+  uint32_t pos = SerialPos;
+  while (readRecord(pos, record))
+  {
+    Serial.write((const uint8_t *)line, formatRecord(record, line, sizeof(line)));
+    markPrinted(pos);
+    pos = SerialPos;
+  }
+  Serial.flush();
+}
+
+/**
+ * @brief Hand every record still in the ring to the sink, oldest first, one
+ * line at a time.  The serial drain is not affected.
+ *
+ */
+void logDump(LogSink sink)
+{
+  char line[LOG_LINE_SIZE];
+  int n = snprintf(line, sizeof(line), "# %lu records lost before they were printed\n", (unsigned long)logLost());
+  sink(line, n);
+  portENTER_CRITICAL_SAFE(&LogMux);
+  uint32_t end = Head;
+  portEXIT_CRITICAL_SAFE(&LogMux);
+  uint32_t pos = end > LOG_RING_SIZE ? end - LOG_RING_SIZE : 0;
+  LogRecord record;
+  for (; pos != end; pos++)
+  {
+    if (readRecord(pos, record)) {sink(line, formatRecord(record, line, sizeof(line)));}
+  }
+}
+
+uint32_t logLost()
+{
+  portENTER_CRITICAL_SAFE(&LogMux);
+  uint32_t lost = Lost;
+  portEXIT_CRITICAL_SAFE(&LogMux);
+  return lost;
+}
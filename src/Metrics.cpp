@@ -0,0 +1,182 @@
+#include "Metrics.h"
+#include <esp_timer.h>
+
+#define METRICS_RTC_MAGIC 0x4D455432  //"MET2", change it when the store layout changes
+#define METRICS_PREFIX "remote_"
+
+struct MetricInfo
+{
+  const char *name;
+  const char *help;
+};
+
+static const MetricInfo CounterInfo[MC_COUNT] =
+{
+  {"boots_total", "Boots since power on"},
+  {"wakes_total", "Boots by a button wake from deep sleep"},
+  {"espnow_sent_total", "ESP-NOW packets accepted for sending"},
+  {"espnow_send_errors_total", "ESP-NOW packets refused by esp_now_send"},
+  {"espnow_acked_total", "ESP-NOW packets acknowledged by the controller"},
+  {"espnow_not_acked_total", "ESP-NOW packets not acknowledged"},
+  {"espnow_replies_total", "ESP-NOW replies received from the controller"},
+  {"reply_timeouts_total", "Reply waits that timed out"},
+  {"bulk_frames_total", "Bulk transfer frames sent"},
+  {"bulk_retransmits_total", "Bulk transfer chunks sent again"},
+};
+
+struct SampledInfo
+{
+  MetricInfo info;
+  const char *type;  //"counter" for a total kept by another module
+};
+
+static const SampledInfo GaugeInfo[MG_COUNT] =
+{
+  {{"battery_millivolts", "Filtered battery voltage"}, "gauge"},
+  {{"heap_free_bytes", "Free 8 bit heap"}, "gauge"},
+  {{"heap_largest_block_bytes", "Largest free 8 bit heap block"}, "gauge"},
+  {{"events_dropped_total", "Events dropped on a full event queue since the boot"}, "counter"},
+  {{"wake_stub_rejects_total", "Wake bounces sent back to sleep by the wake stub"}, "counter"},
+};
+
+struct HistInfo
+{
+  MetricInfo info;
+  uint8_t numBuckets;
+  uint32_t bounds[METRICS_HIST_MAX_BUCKETS];  //upper bound of each bucket, +Inf is implied
+};
+
+static const HistInfo Hists[MH_COUNT] =
+{
+  {{"reply_rtt_ms", "Time from a send to the controller reply"}, 10,
+    {5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000}},
+  {{"loop_busy_us", "Busy time of one main loop iteration"}, 8,
+    {50, 100, 200, 500, 1000, 5000, 20000, 100000}},
+};
+
+static const char *const PhaseNames[BOOT_PHASE_COUNT] = {"fs", "radio", "display", "status"};
+
+struct HistData
+{
+  uint32_t counts[METRICS_HIST_MAX_BUCKETS + 1];
+  uint64_t sum;
+  uint32_t count;
+};
+
+struct MetricsStore
+{
+  uint32_t magic;
+  uint32_t counters[MC_COUNT];
+  HistData hists[MH_COUNT];
+};
+
+RTC_NOINIT_ATTR static MetricsStore Store;
+static int32_t Gauges[MG_COUNT];
+static uint32_t PhaseMs[BOOT_PHASE_COUNT];
+static int64_t PhaseStart = 0;
+
+/**
+ * @brief Keep the RTC counters, or clear them after a power on.  Call first in
+ * setup().
+ *
+ */
+void metricsBegin()
+{
+  if (Store.magic != METRICS_RTC_MAGIC)
+  {
+    memset(&Store, 0, sizeof(Store));
+    Store.magic = METRICS_RTC_MAGIC;
+  }
+  Store.counters[MC_BOOTS]++;
+  PhaseStart = esp_timer_get_time();
+}
+
+void metricsInc(MetricCounter counter)
+{
+  Store.counters[counter]++;
+}
+
+void metricsSet(MetricGauge gauge, int32_t value)
+{
+  Gauges[gauge] = value;
+}
+
+void metricsObserve(MetricHist hist, uint32_t value)
+{
+  const HistInfo &info = Hists[hist];
+  HistData &data = Store.hists[hist];
+  uint8_t b = 0;
+  while (b < info.numBuckets && value > info.bounds[b]) {b++;}
+  data.counts[b]++;
+  data.sum += value;
+  data.count++;
+}
+
+/**
+ * @brief End a boot phase: its duration is the time since the previous phase
+ * ended (or metricsBegin())
+ *
+ */
+void metricsBootPhase(BootPhase phase)
+{
+  int64_t now = esp_timer_get_time();
+  PhaseMs[phase] = (uint32_t)((now - PhaseStart) / 1000);
+  PhaseStart = now;
+}
+
+static void writeHeader(MetricsSink sink, char *line, size_t len, const MetricInfo &info, const char *type)
+{
+  int n = snprintf(line, len, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n",
+    info.name, info.help, info.name, type);
+  sink(line, n);
+}
+
+/**
+ * @brief Render every metric in the Prometheus text format
+ *
+ */
+void metricsWrite(MetricsSink sink)
+{
+  char line[160];
+  int n;
+  for (uint8_t i = 0; i < MC_COUNT; i++)
+  {
+    writeHeader(sink, line, sizeof(line), CounterInfo[i], "counter");
+    n = snprintf(line, sizeof(line), METRICS_PREFIX "%s %lu\n", CounterInfo[i].name, (unsigned long)Store.counters[i]);
+    sink(line, n);
+  }
+  for (uint8_t i = 0; i < MG_COUNT; i++)
+  {
+    writeHeader(sink, line, sizeof(line), GaugeInfo[i].info, GaugeInfo[i].type);
+    n = snprintf(line, sizeof(line), METRICS_PREFIX "%s %ld\n", GaugeInfo[i].info.name, (long)Gauges[i]);
+    sink(line, n);
+  }
+  static const MetricInfo phaseInfo = {"boot_phase_ms", "Duration of each phase of the last boot"};
+  writeHeader(sink, line, sizeof(line), phaseInfo, "gauge");
+  for (uint8_t i = 0; i < BOOT_PHASE_COUNT; i++)
+  {
+    n = snprintf(line, sizeof(line), METRICS_PREFIX "boot_phase_ms{phase=\"%s\"} %lu\n", PhaseNames[i], (unsigned long)PhaseMs[i]);
+    sink(line, n);
+  }
+  for (uint8_t h = 0; h < MH_COUNT; h++)
+  {
+    const HistInfo &info = Hists[h];
+    const HistData &data = Store.hists[h];
+    writeHeader(sink, line, sizeof(line), info.info, "histogram");
+    uint32_t cumulative = 0;
+    for (uint8_t b = 0; b <= info.numBuckets; b++)
+    {
+      cumulative += data.counts[b];
+      if (b < info.numBuckets)
+      {
+        n = snprintf(line, sizeof(line), METRICS_PREFIX "%s_bucket{le=\"%lu\"} %lu\n", info.info.name, (unsigned long)info.bounds[b], (unsigned long)cumulative);
+      } else {
+        n = snprintf(line, sizeof(line), METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %lu\n", info.info.name, (unsigned long)cumulative);
+      }
+      sink(line, n);
+    }
+    n = snprintf(line, sizeof(line), METRICS_PREFIX "%s_sum %llu\n" METRICS_PREFIX "%s_count %lu\n",
+      info.info.name, (unsigned long long)data.sum, info.info.name, (unsigned long)data.count);
+    sink(line, n);
+  }
+}
@@ -0,0 +1,158 @@
+#include "Pages.h"
+
+/*
+Every page of the OLED is described here as static text plus dynamic fields.
+Fields are bound to a value function and redrawn by screenUpdate() only
+when that value changes.  Pages only render: side effects (saving
+calibration data, leaving calibration mode) belong to the code that moves to
+the page, and any timed transition is done with scheduleTask(), never delay().
+
+This file only depends on U8g2 and the screen engine, so the same pages can
+be rendered by the host test build in test/test_screens.
+*/
+
+/**
+ * @brief draw the battery charge state.  Screen field draw function, the
+ * battery is drawn inside the field area.
+ * 
+ */
+void drawBattery(U8G2 &display, const ScreenField &field, int32_t chargeLevel) 
+{
+  // Define the dimensions of the battery
+    const int batteryWidth = field.w - 3;  // Width of the battery, leave room for the terminal
+    const int batteryHeight = field.h;   // Height of the battery
+    const int batteryX = field.x;        // X position of the battery
+    const int batteryY = field.y;        // Y position of the battery
+    // Draw the outer battery shape
+    display.drawFrame(batteryX, batteryY, batteryWidth, batteryHeight); // x, y, width, height
+
+    // Draw the battery terminal
+    display.drawBox(batteryX + batteryWidth, batteryY + (batteryHeight/4), 2, batteryHeight/2); // x, y, width, height
+
+    // Calculate the width of the inner battery level based on chargeLevel (0-100)
+    uint16_t innerWidth = (chargeLevel * (batteryWidth - 4)) / 100; // Subtract 2 for padding
+
+    // Draw the inner battery level
+    display.drawBox(batteryX + 2, batteryY + 2, innerWidth, batteryHeight - 4); // x, y, width, height
+
+}
+
+static void drawFlow(U8G2 &display, const ScreenField &field, int32_t flowTenths)
+{
+  char buffer[10];
+  float flow = flowTenths / 10.0;
+  if(flow<10)// Format O2Flow as a string
+  {
+    snprintf(buffer, sizeof(buffer), "%.1f", flow);
+  } else 
+  {
+    snprintf(buffer, sizeof(buffer), "%.f", flow);
+  }
+  drawFieldText(display, field, buffer);
+}
+
+static void drawCalTarget(U8G2 &display, const ScreenField &field, int32_t pageNum)
+{
+  char buffer[15];
+  snprintf(buffer, sizeof(buffer), "%d.0 L/min", (int)(pageNum-2)+2);
+  drawFieldText(display, field, buffer);
+}
+
+static void drawIP(U8G2 &display, const ScreenField &field, int32_t ip)
+{
+  char buffer[16];
+  uint32_t addr = (uint32_t)ip;  //first octet in the low byte
+  snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", (unsigned)(addr & 0xFF), (unsigned)((addr >> 8) & 0xFF),
+    (unsigned)((addr >> 16) & 0xFF), (unsigned)(addr >> 24));
+  drawFieldText(display, field, buffer);
+}
+
+static void drawWifiStatus(U8G2 &display, const ScreenField &field, int32_t status)
+{
+  char buffer[24];
+  switch (status & 0xFF)
+  {
+    case WIFI_ST_CONNECTING: drawFieldText(display, field, "Connecting..."); break;
+    case WIFI_ST_PORTAL: drawFieldText(display, field, "AP: Chris Remote"); break;
+    case WIFI_ST_RETRY:
+      snprintf(buffer, sizeof(buffer), "Retry in %d s", (int)(status >> 8));
+      drawFieldText(display, field, buffer);
+      break;
+    default:
+      if (status >> 8)  //AP on another channel than the controller
+      {
+        snprintf(buffer, sizeof(buffer), "No ESP-NOW: ch %d", (int)(status >> 8));
+        drawFieldText(display, field, buffer);
+      } else {
+        drawFieldText(display, field, "OTA Mode");
+      }
+      break;
+  }
+}
+
+const ScreenText OTATexts[] = {
+  {10, 15, u8g2_font_ncenB08_tr, "IP Address:"},
+  {10, 45, u8g2_font_ncenB08_tr, "System Mode:"},
+};
+const ScreenField OTAFields[] = {
+  {10, 20, 110, 11, u8g2_font_ncenB08_tr, ipValue, drawIP},
+  {10, 50, 110, 11, u8g2_font_ncenB08_tr, wifiStatusValue, drawWifiStatus},
+};
+const Screen OTAScreen = {SCREEN_TEXTS(OTATexts), SCREEN_FIELDS(OTAFields)};
+
+const ScreenText WakeTexts[] = {
+  {10, 15, u8g2_font_ncenB08_tr, "Waking...."},
+  {10, 30, u8g2_font_ncenB08_tr, "Normal Mode"},
+};
+const Screen WakeScreen = {SCREEN_TEXTS(WakeTexts), SCREEN_NO_FIELDS};
+
+const ScreenText FlowTexts[] = {
+  {60, 45, u8g2_font_helvB14_tr, "L/min"},
+};
+const ScreenField FlowFields[] = {
+  {10, 20, 49, 26, u8g2_font_helvB24_tr, flowValue, drawFlow},
+  {90, 5, 28, 12, NULL, battValue, drawBattery},
+};
+const Screen FlowScreen = {SCREEN_TEXTS(FlowTexts), SCREEN_FIELDS(FlowFields)};
+
+const ScreenText NoFlowTexts[] = {
+  {0, 25, u8g2_font_ncenB08_tr, "No Flow Data"},
+};
+const Screen NoFlowScreen = {SCREEN_TEXTS(NoFlowTexts), SCREEN_NO_FIELDS};
+
+const ScreenText WaitingTexts[] = {
+  {10, 20, u8g2_font_helvB14_tr, "waiting..."},
+};
+const Screen WaitingScreen = {SCREEN_TEXTS(WaitingTexts), SCREEN_NO_FIELDS};
+
+const ScreenText CalIntroTexts[] = {
+  {5, 13, u8g2_font_ncenB08_tr, "Cal. Mode: Use Up or"},
+  {5, 28, u8g2_font_ncenB08_tr, "Dwn to turn controller"},
+  {5, 43, u8g2_font_ncenB08_tr, "to desired flow. Press"},
+  {5, 58, u8g2_font_ncenB08_tr, "Up & Down to 'Enter'"},
+};
+const Screen CalIntroScreen = {SCREEN_TEXTS(CalIntroTexts), SCREEN_NO_FIELDS};
+
+const ScreenText CalStepTexts[] = {
+  {5, 13, u8g2_font_ncenB08_tr, "Use Up/Dwn for"},
+  {5, 43, u8g2_font_ncenB08_tr, "Press Up & Down"},
+  {5, 58, u8g2_font_ncenB08_tr, "to 'Enter'"},
+};
+const ScreenField CalStepFields[] = {
+  {25, 17, 80, 12, u8g2_font_ncenB08_tr, calPageValue, drawCalTarget},
+};
+const Screen CalStepScreen = {SCREEN_TEXTS(CalStepTexts), SCREEN_FIELDS(CalStepFields)};
+
+const ScreenText CalSavedTexts[] = {
+  {5, 15, u8g2_font_ncenB08_tr, "Cal. Successful"},
+  {5, 35, u8g2_font_ncenB08_tr, "Saving Data..."},
+};
+const Screen CalSavedScreen = {SCREEN_TEXTS(CalSavedTexts), SCREEN_NO_FIELDS};
+
+const ScreenText CalErrorTexts[] = {
+  {0, 10, u8g2_font_ncenB08_tr, "Pot. at hard stop"},
+  {0, 25, u8g2_font_ncenB08_tr, "<500 Range <3500"},
+  {0, 40, u8g2_font_ncenB08_tr, "Reset Pot, then"},
+  {0, 55, u8g2_font_ncenB08_tr, "repeat Cal."},
+};
+const Screen CalErrorScreen = {SCREEN_TEXTS(CalErrorTexts), SCREEN_NO_FIELDS};
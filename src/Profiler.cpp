@@ -0,0 +1,109 @@
+#include "Profiler.h"
+#include <xtensa/xtensa_context.h>
+
+struct ProfileSlot
+{
+  uint32_t pc;     //0 for a free slot
+  uint32_t count;
+};
+
+static ProfileSlot Slots[PROFILE_SLOTS];
+static volatile uint32_t Samples = 0;
+static volatile uint32_t Lost = 0;
+static hw_timer_t *Timer = NULL;
+static uint32_t Hz = 0;
+static uint32_t StartMs = 0;
+static uint32_t StopMs = 0;
+
+/**
+ * @brief Timer ISR: count the PC the interrupt was taken at.  On entry to the
+ * outermost interrupt FreeRTOS saves the stack pointer, which points at the
+ * exception frame, in pxTopOfStack, the first member of the running task's TCB.
+ *
+ */
+static void IRAM_ATTR sample()
+{
+  const XtExcFrame *frame = *(const XtExcFrame *const *)xTaskGetCurrentTaskHandle();
+  uint32_t pc = frame->pc;
+  uint32_t slot = ((pc * 2654435761u) >> 16) & (PROFILE_SLOTS - 1);  //Fibonacci hash
+  Samples++;
+  for (uint8_t probe = 0; probe < PROFILE_PROBES; probe++)
+  {
+    ProfileSlot &s = Slots[(slot + probe) & (PROFILE_SLOTS - 1)];
+    if (s.pc == pc)
+    {
+      s.count++;
+      return;
+    }
+    if (s.pc == 0)
+    {
+      s.pc = pc;
+      s.count = 1;
+      return;
+    }
+  }
+  Lost++;
+}
+
+/**
+ * @brief Clear the histogram and start sampling
+ *
+ * @param hz samples per second, 0 for PROFILE_DEFAULT_HZ
+ * @return false if the rate is out of range or no timer is free
+ */
+bool profileStart(uint32_t hz)
+{
+  if (hz == 0) {hz = PROFILE_DEFAULT_HZ;}
+  if (hz > PROFILE_MAX_HZ) {return false;}
+  profileStop();
+  memset(Slots, 0, sizeof(Slots));
+  Samples = 0;
+  Lost = 0;
+  Timer = timerBegin(PROFILE_TIMER_HZ);
+  if (Timer == NULL) {return false;}
+  timerAttachInterrupt(Timer, sample);
+  Hz = hz;
+  StartMs = millis();
+  timerAlarm(Timer, PROFILE_TIMER_HZ / hz, true, 0);  //auto reload, forever
+  return true;
+}
+
+/**
+ * @brief Stop sampling, the histogram is kept for profileDump()
+ *
+ */
+void profileStop()
+{
+  if (Timer == NULL) {return;}
+  timerEnd(Timer);
+  Timer = NULL;
+  StopMs = millis();
+}
+
+bool profileRunning()
+{
+  return Timer != NULL;
+}
+
+/**
+ * @brief Write the histogram line by line to the sink.  Sampling pauses
+ * while the table is read.
+ *
+ */
+void profileDump(ProfileSink sink)
+{
+  char line[96];
+  if (Timer) {timerStop(Timer);}
+  uint32_t ms = (Timer ? millis() : StopMs) - StartMs;
+  int n = snprintf(line, sizeof(line), "# profile hz=%lu samples=%lu lost=%lu ms=%lu running=%d\n",
+    (unsigned long)Hz, (unsigned long)Samples, (unsigned long)Lost, (unsigned long)ms, Timer != NULL);
+  sink(line, n);
+  for (uint32_t i = 0; i < PROFILE_SLOTS; i++)
+  {
+    if (Slots[i].pc == 0) {continue;}
+    n = snprintf(line, sizeof(line), "0x%08lx %lu\n", (unsigned long)Slots[i].pc, (unsigned long)Slots[i].count);
+    sink(line, n);
+  }
+  sink("# end\n", 6);
+  if (Timer) {timerStart(Timer);}
+}
@@ -0,0 +1,140 @@
+#include "Radio.h"
+#include "Energy.h"
+#include <esp_wifi.h>
+#include <esp_timer.h>
+
+static bool RadioOn = false;
+static uint32_t LeadMs = 0;          //0: sends come without warning, never stop
+static uint32_t LastActivity = 0;    //millis() of the last exchange or prewarm
+
+//restart statistics
+static uint32_t Restarts = 0;
+static uint32_t LateStarts = 0;
+static uint32_t Stops = 0;
+static uint32_t RestartAvgUs = 0;
+static uint32_t RestartMaxUs = 0;
+
+static void startRadio()
+{
+  int64_t start = esp_timer_get_time();
+  esp_err_t result = esp_wifi_start();
+  uint32_t took = (uint32_t)(esp_timer_get_time() - start);
+  if (result != ESP_OK)
+  {
+    Serial.printf("Radio start failed (%d)\n", (int)result);
+    return;
+  }
+  RadioOn = true;
+  energySet(EN_RADIO, true);
+  Restarts++;
+  RestartAvgUs = (Restarts == 1) ? took : (RestartAvgUs * 7 + took) / 8;
+  if (took > RestartMaxUs) {RestartMaxUs = took;}
+}
+
+/**
+ * @brief The radio was just started by initESP_NOW()
+ *
+ */
+void radioBegin()
+{
+  RadioOn = true;
+  energySet(EN_RADIO, true);
+  LastActivity = millis();
+}
+
+/**
+ * @brief Set the guaranteed time between radioPrewarm() and the send.  0 keeps
+ * the radio on.
+ *
+ */
+void radioSetLeadTime(uint32_t leadMs)
+{
+  LeadMs = leadMs;
+}
+
+/**
+ * @brief A command will be sent soon, start the radio now if it is off
+ *
+ */
+void radioPrewarm()
+{
+  LastActivity = millis();
+  if (!RadioOn) {startRadio();}
+}
+
+/**
+ * @brief Called right before a send.  The radio should already be on.
+ *
+ */
+void radioEnsureOn()
+{
+  LastActivity = millis();
+  if (RadioOn) {return;}
+  LateStarts++;
+  startRadio();
+}
+
+/**
+ * @brief An exchange is in progress or just ended, restart the linger time
+ *
+ */
+void radioActivity()
+{
+  LastActivity = millis();
+}
+
+static uint32_t lingerMs()
+{
+  uint32_t byCost = 2 * RestartAvgUs / 1000;  //a shorter gap costs more to restart than to listen through
+  return byCost > RADIO_LINGER_MS ? byCost : RADIO_LINGER_MS;
+}
+
+static bool cyclingAllowed()
+{
+  return LeadMs > 0 && RestartMaxUs / 1000 + RADIO_MARGIN_MS < LeadMs;
+}
+
+/**
+ * @brief Stop the radio once it has been idle for the linger time.  Call from
+ * loop() when no exchange is pending.
+ *
+ */
+void radioUpdate()
+{
+  if (!RadioOn || !cyclingAllowed()) {return;}
+  if (millis() - LastActivity < lingerMs()) {return;}
+  if (esp_wifi_stop() != ESP_OK) {return;}
+  RadioOn = false;
+  energySet(EN_RADIO, false);
+  Stops++;
+}
+
+/**
+ * @brief Time until radioUpdate() stops the radio
+ *
+ * @return milliseconds, UINT32_MAX if the radio stays as it is
+ */
+uint32_t radioNextDeadline()
+{
+  if (!RadioOn || !cyclingAllowed()) {return UINT32_MAX;}
+  uint32_t idle = millis() - LastActivity;
+  uint32_t linger = lingerMs();
+  return idle >= linger ? 0 : linger - idle;
+}
+
+bool radioIsOn()
+{
+  return RadioOn;
+}
+
+/**
+ * @brief Print the restart count and cost.  Call just before deep sleep.
+ *
+ */
+void radioReport()
+{
+  Serial.printf("Radio: %lu stops, %lu restarts (%lu late), restart avg %lu us max %lu us, linger %lu ms, cycling %s\n",
+    (unsigned long)Stops, (unsigned long)Restarts, (unsigned long)LateStarts,
+    (unsigned long)RestartAvgUs, (unsigned long)RestartMaxUs, (unsigned long)lingerMs(),
+    cyclingAllowed() ? "on" : "off");
+}
@@ -0,0 +1,108 @@
+#include "Scheduler.h"
+
+struct SchedEntry
+{
+  SchedTask task;    //function to call, NULL if the slot is free
+  uint32_t start;    //millis() when the task was scheduled
+  uint32_t delayMs;  //time to wait before running the task
+};
+
+static SchedEntry SchedTable[SCHED_MAX_TASKS];
+
+/**
+ * @brief Schedule a function to run once after delayMs.  If the task is already
+ * pending it is re-armed with the new delay instead of being added twice.
+ *
+ * @param task function to call from runScheduler()
+ * @param delayMs time to wait in milliseconds
+ * @return true if the task was scheduled, false if the table is full
+ */
+bool scheduleTask(SchedTask task, uint32_t delayMs)
+{
+  int freeSlot = -1;
+  for (int i = 0; i < SCHED_MAX_TASKS; i++)
+  {
+    if (SchedTable[i].task == task)
+    {
+      freeSlot = i;
+      break;
+    }
+    if (SchedTable[i].task == NULL && freeSlot == -1)
+    {
+      freeSlot = i;
+    }
+  }
+  if (freeSlot == -1)
+  {
+    Serial.println("Scheduler full");
+    return false;
+  }
+  SchedTable[freeSlot].task = task;
+  SchedTable[freeSlot].start = millis();
+  SchedTable[freeSlot].delayMs = delayMs;
+  return true;
+}
+
+/**
+ * @brief Remove a pending task, if it is scheduled
+ *
+ * @param task function to remove
+ */
+void cancelTask(SchedTask task)
+{
+  for (int i = 0; i < SCHED_MAX_TASKS; i++)
+  {
+    if (SchedTable[i].task == task) {SchedTable[i].task = NULL;}
+  }
+}
+
+/**
+ * @brief Check if a task is waiting to run
+ *
+ * @param task function to look for
+ */
+bool taskPending(SchedTask task)
+{
+  for (int i = 0; i < SCHED_MAX_TASKS; i++)
+  {
+    if (SchedTable[i].task == task) {return true;}
+  }
+  return false;
+}
+
+/**
+ * @brief Run every task whose delay has passed.  Call this from loop().
+ * The slot is freed before the task runs so a task can re-schedule itself.
+ *
+ */
+void runScheduler()
+{
+  for (int i = 0; i < SCHED_MAX_TASKS; i++)
+  {
+    SchedTask task = SchedTable[i].task;
+    if (task != NULL && (millis() - SchedTable[i].start >= SchedTable[i].delayMs))
+    {
+      SchedTable[i].task = NULL;
+      task();
+    }
+  }
+}
+
+/**
+ * @brief Time until the next task is due, used to decide how long the main
+ * loop can sleep
+ *
+ * @return milliseconds, 0 if a task is due now, UINT32_MAX if none is pending
+ */
+uint32_t schedulerNextDue()
+{
+  uint32_t next = UINT32_MAX;
+  for (int i = 0; i < SCHED_MAX_TASKS; i++)
+  {
+    if (SchedTable[i].task == NULL) {continue;}
+    uint32_t elapsed = millis() - SchedTable[i].start;
+    uint32_t due = elapsed >= SchedTable[i].delayMs ? 0 : SchedTable[i].delayMs - elapsed;
+    if (due < next) {next = due;}
+  }
+  return next;
+}
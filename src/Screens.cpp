@@ -0,0 +1,137 @@
+#include "Screens.h"
+
+static U8G2 *Display = NULL;
+static const Screen *CurrentScreen = NULL;
+static int32_t FieldValues[SCREEN_MAX_FIELDS];  //last value drawn for each field
+static bool ScreenDirty = true;  //redraw the whole screen on the next update
+
+/**
+ * @brief Set the display the screens are drawn on.  Call after u8g2.begin()
+ *
+ * @param display u8g2 display object
+ */
+void screenBegin(U8G2 &display)
+{
+  Display = &display;
+}
+
+/**
+ * @brief Draws a field and stores the value it was drawn for
+ *
+ */
+static void drawField(uint8_t i)
+{
+  const ScreenField &field = CurrentScreen->fields[i];
+  FieldValues[i] = field.value();
+  Display->setDrawColor(1);
+  if (field.font != NULL) {Display->setFont(field.font);}
+  field.draw(*Display, field, FieldValues[i]);
+}
+
+/**
+ * @brief Draws every element of the current screen into the buffer and sends
+ * the whole buffer to the display
+ *
+ */
+static void drawFullScreen()
+{
+  Display->clearBuffer();
+  Display->setDrawColor(1); // Set the draw color to white
+  Display->setFontMode(1); // Set the font mode to transparent
+  for (uint8_t i = 0; i < CurrentScreen->numTexts; i++)
+  {
+    const ScreenText &text = CurrentScreen->texts[i];
+    Display->setFont(text.font);
+    Display->drawStr(text.x, text.y, text.text);
+  }
+  for (uint8_t i = 0; i < CurrentScreen->numFields && i < SCREEN_MAX_FIELDS; i++)
+  {
+    drawField(i);
+  }
+  Display->sendBuffer();
+  ScreenDirty = false;
+}
+
+/**
+ * @brief Sends only the 8x8 pixel tiles covering a field to the display.
+ * The buffer is kept in the display's own orientation, so for U8G2_R2 the
+ * tile area is mirrored.
+ *
+ */
+static void sendFieldArea(const ScreenField &field)
+{
+  uint8_t tx = field.x / 8;
+  uint8_t ty = field.y / 8;
+  uint8_t tw = (field.x + field.w + 7) / 8 - tx;
+  uint8_t th = (field.y + field.h + 7) / 8 - ty;
+  uint8_t tilesWide = Display->getBufferTileWidth();
+  uint8_t tilesHigh = Display->getBufferTileHeight();
+  if (tx + tw > tilesWide) {tw = tilesWide - tx;}
+  if (ty + th > tilesHigh) {th = tilesHigh - ty;}
+  if (Display->getU8g2()->cb == U8G2_R2)
+  {
+    tx = tilesWide - tx - tw;
+    ty = tilesHigh - ty - th;
+  }
+  Display->updateDisplayArea(tx, ty, tw, th);
+}
+
+/**
+ * @brief Show a screen.  Static text and fields are drawn at once.  Never
+ * blocks, timed transitions must be done with the scheduler.
+ *
+ * @param screen screen descriptor
+ */
+void screenShow(const Screen *screen)
+{
+  CurrentScreen = screen;
+  drawFullScreen();
+}
+
+/**
+ * @brief Redraw the fields of the current screen whose bound value has
+ * changed.  Call from loop(), cheap when nothing changed.
+ *
+ */
+void screenUpdate()
+{
+  if (CurrentScreen == NULL || Display == NULL) {return;}
+  if (ScreenDirty)
+  {
+    drawFullScreen();
+    return;
+  }
+  for (uint8_t i = 0; i < CurrentScreen->numFields && i < SCREEN_MAX_FIELDS; i++)
+  {
+    const ScreenField &field = CurrentScreen->fields[i];
+    if (field.value() == FieldValues[i]) {continue;}
+    Display->setDrawColor(0);  //erase the old content of the field
+    Display->drawBox(field.x, field.y, field.w, field.h);
+    drawField(i);
+    sendFieldArea(field);
+  }
+}
+
+/**
+ * @brief Force the current screen to be fully redrawn on the next screenUpdate()
+ *
+ */
+void screenInvalidate()
+{
+  ScreenDirty = true;
+}
+
+const Screen *screenCurrent()
+{
+  return CurrentScreen;
+}
+
+/**
+ * @brief Helper for text fields: draws text with its base line at the bottom
+ * of the field area
+ *
+ */
+void drawFieldText(U8G2 &display, const ScreenField &field, const char *text)
+{
+  display.drawStr(field.x, field.y + field.h - 1, text);
+}
@@ -0,0 +1,203 @@
+#include "Telemetry.h"
+#include "Buttons.h"
+#include <lwip/sockets.h>
+
+struct TelemetryRecord
+{
+  uint32_t time;  //millis()
+  uint8_t type;   //TelemetryType
+  int32_t a;
+  int32_t b;
+};
+
+struct TelemetryClient
+{
+  WiFiClient client;  //a copy keeps the socket open after the web server lets go of it
+  bool active;
+  uint32_t cursor;    //next record to send
+  char line[TELEMETRY_LINE_SIZE];
+  uint16_t lineLen;
+  uint16_t lineSent;
+  uint32_t dropped;
+};
+
+static TelemetryRecord Ring[TELEMETRY_RING_SIZE];
+static uint32_t Head = 0;  //position of the next record
+static TelemetryClient Clients[TELEMETRY_MAX_CLIENTS];
+static uint8_t ClientCount = 0;
+
+/**
+ * @brief Record what just happened.  Main task only.
+ *
+ */
+void telemetryPost(TelemetryType type, int32_t a, int32_t b)
+{
+  if (ClientCount == 0) {return;}
+  TelemetryRecord &record = Ring[Head & (TELEMETRY_RING_SIZE - 1)];
+  record.time = millis();
+  record.type = type;
+  record.a = a;
+  record.b = b;
+  Head++;
+}
+
+/**
+ * @brief Start streaming to a client that asked for GET /events.  The response
+ * headers are written here, the web server must not send a reply.
+ *
+ * @return false if all client slots are taken
+ */
+bool telemetryAddClient(WiFiClient &client)
+{
+  for (uint8_t i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+  {
+    TelemetryClient &c = Clients[i];
+    if (c.active) {continue;}
+    c.client = client;
+    c.client.setNoDelay(true);
+    c.active = true;
+    c.cursor = Head;  //only what happens from now on
+    c.dropped = 0;
+    c.lineLen = snprintf(c.line, sizeof(c.line),
+      "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+      "Access-Control-Allow-Origin: *\r\n\r\n");
+    c.lineSent = 0;
+    ClientCount++;
+    return true;
+  }
+  return false;
+}
+
+static void dropClient(TelemetryClient &c)
+{
+  c.client.stop();
+  c.client = WiFiClient();
+  c.active = false;
+  ClientCount--;
+}
+
+/**
+ * @brief Format the next message for a client: a "drop" event if it fell
+ * behind the ring, otherwise its next record
+ *
+ * @return false if there is nothing to send
+ */
+static bool nextLine(TelemetryClient &c)
+{
+  static const char *const types[] = {"flow", "send", "sendDone", "reply", "battery", "button"};
+  if (Head - c.cursor > TELEMETRY_RING_SIZE)
+  {
+    uint32_t oldest = Head - TELEMETRY_RING_SIZE;
+    c.dropped += oldest - c.cursor;
+    c.lineLen = snprintf(c.line, sizeof(c.line), "event: drop\ndata: %lu\n\n", (unsigned long)(oldest - c.cursor));
+    c.cursor = oldest;
+    return true;
+  }
+  if (c.cursor == Head) {return false;}
+  const TelemetryRecord &r = Ring[c.cursor & (TELEMETRY_RING_SIZE - 1)];
+  c.cursor++;
+  int n = snprintf(c.line, sizeof(c.line), "data: {\"t\":%lu,\"type\":\"%s\"", (unsigned long)r.time, types[r.type]);
+  switch (r.type)
+  {
+    case TEL_FLOW:
+      n += snprintf(c.line + n, sizeof(c.line) - n, ",\"flow\":%.1f", r.a / 10.0);
+      break;
+    case TEL_SEND:
+      n += snprintf(c.line + n, sizeof(c.line) - n, ",\"cmd\":%ld,\"potADC\":%ld", (long)r.a, (long)r.b);
+      break;
+    case TEL_SEND_DONE:
+      n += snprintf(c.line + n, sizeof(c.line) - n, ",\"acked\":%s", r.a ? "true" : "false");
+      break;
+    case TEL_REPLY:
+      n += snprintf(c.line + n, sizeof(c.line) - n, ",\"potADC\":%ld,\"rssi\":%ld", (long)r.a, (long)r.b);
+      break;
+    case TEL_BATTERY:
+      n += snprintf(c.line + n, sizeof(c.line) - n, ",\"soc\":%ld,\"mV\":%ld", (long)r.a, (long)r.b);
+      break;
+    case TEL_BUTTON:
+    {
+      ButtonEvent event = {(uint8_t)r.a, (uint8_t)r.b, 0};
+      n += snprintf(c.line + n, sizeof(c.line) - n, ",\"button\":\"%s\"", buttonEventName(event));
+      break;
+    }
+  }
+  n += snprintf(c.line + n, sizeof(c.line) - n, "}\n\n");
+  c.lineLen = n < (int)sizeof(c.line) ? n : sizeof(c.line) - 1;
+  return true;
+}
+
+/**
+ * @brief Send what each client's socket takes without waiting.  Call from
+ * loop() in OTA mode.
+ *
+ */
+void telemetryPump()
+{
+  for (uint8_t i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+  {
+    TelemetryClient &c = Clients[i];
+    if (!c.active) {continue;}
+    for (uint8_t lines = 0; lines < TELEMETRY_PUMP_LINES; lines++)
+    {
+      if (c.lineSent == c.lineLen)
+      {
+        c.lineSent = c.lineLen = 0;
+        if (!nextLine(c)) {break;}
+      }
+      ssize_t sent = send(c.client.fd(), c.line + c.lineSent, c.lineLen - c.lineSent, MSG_DONTWAIT);
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {break;}  //socket buffer full, try on the next pass
+      if (sent <= 0)
+      {
+        Serial.printf("Telemetry client %u gone, %lu records dropped\n", i, (unsigned long)c.dropped);
+        dropClient(c);
+        break;
+      }
+      c.lineSent += sent;
+      if (c.lineSent < c.lineLen) {break;}
+    }
+  }
+}
+
+uint8_t telemetryClients()
+{
+  return ClientCount;
+}
+
+/**
+ * @brief Close every stream, when WiFi goes down
+ *
+ */
+void telemetryStop()
+{
+  for (uint8_t i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+  {
+    if (Clients[i].active) {dropClient(Clients[i]);}
+  }
+}
+
+//GET /live: plots the flow and the RSSI from /events and lists the other records
+const char TelemetryPage[] PROGMEM = R"HTML(<!DOCTYPE html>
+<html><head><meta charset="utf-8"><meta name="viewport" content="width=device-width">
+<title>Chris Remote live</title>
+<style>body{font-family:sans-serif;margin:1em}canvas{border:1px solid #999;width:100%;height:240px}
+#log{font-family:monospace;font-size:12px;height:12em;overflow:auto;white-space:pre}</style></head>
+<body><h3>Chris Remote live</h3>
+<div>flow <b id="flow">-</b> L/min, potADC <b id="adc">-</b>, RSSI <b id="rssi">-</b> dBm,
+battery <b id="batt">-</b>, dropped <b id="drop">0</b></div>
+<canvas id="plot" width="800" height="240"></canvas><div id="log"></div>
+<script>
+var N=300,flow=[],rssi=[],dropped=0,c=document.getElementById('plot'),g=c.getContext('2d');
+function set(id,v){document.getElementById(id).textContent=v;}
+function line(d,lo,hi,color){g.strokeStyle=color;g.beginPath();
+ d.forEach(function(v,i){var x=i*c.width/N,y=c.height-(v-lo)*c.height/(hi-lo);i?g.lineTo(x,y):g.moveTo(x,y);});g.stroke();}
+function draw(){g.clearRect(0,0,c.width,c.height);line(flow,0,10,'#06c');line(rssi,-100,-20,'#c60');}
+function push(a,v){a.push(v);if(a.length>N)a.shift();}
+var es=new EventSource('/events');
+es.addEventListener('drop',function(e){dropped+=+e.data;set('drop',dropped);});
+es.onmessage=function(e){var r=JSON.parse(e.data),log=document.getElementById('log');
+ if(r.type=='flow'){push(flow,r.flow);set('flow',r.flow);}
+ else if(r.type=='reply'){push(rssi,r.rssi);set('adc',r.potADC);set('rssi',r.rssi);}
+ else if(r.type=='battery'){set('batt',r.soc+'% '+r.mV+' mV');}
+ log.textContent=e.data+'\n'+log.textContent.slice(0,4000);draw();};
+</script></body></html>
+)HTML";
@@ -0,0 +1,71 @@
+#include "WakeStub.h"
+#include <esp_sleep.h>
+#include <esp_wake_stub.h>
+#include <esp_rom_sys.h>
+#include <soc/rtc_io_reg.h>
+#include <soc/rtc_cntl_reg.h>
+
+//shared with the stub, so in RTC memory
+RTC_DATA_ATTR static uint32_t StubPinMask = 0;   //wake pins, pressed reads low
+RTC_DATA_ATTR static uint32_t StubPressed = 0;   //pins the stub saw pressed on this wake
+RTC_DATA_ATTR static uint32_t StubRejected = 0;  //bounces sent back to sleep since power on
+
+/**
+ * @brief Runs from RTC fast memory on every wake from deep sleep.  Only RTC
+ * memory and ROM functions can be used here.
+ *
+ */
+static void RTC_IRAM_ATTR wakeStub()
+{
+  uint32_t pressed = 0;
+  uint32_t stable = 0;
+  for (uint32_t i = 0; i < WAKE_STUB_SAMPLES && stable < WAKE_STUB_STABLE; i++)
+  {
+    uint32_t low = ~REG_GET_FIELD(RTC_GPIO_IN_REG, RTC_GPIO_IN_NEXT) & StubPinMask;
+    if (low != 0 && low == pressed)
+    {
+      stable++;
+    } else {
+      pressed = low;
+      stable = (low != 0) ? 1 : 0;
+    }
+    if (stable < WAKE_STUB_STABLE) {esp_rom_delay_us(1000);}
+  }
+  if (stable >= WAKE_STUB_STABLE)
+  {
+    StubPressed = pressed;
+    esp_default_wake_deep_sleep();  //carry on with the normal boot
+    return;
+  }
+  StubRejected++;
+  REG_SET_BIT(RTC_CNTL_EXT_WAKEUP1_REG, RTC_CNTL_EXT_WAKEUP1_STATUS_CLR);
+  esp_wake_stub_sleep(&wakeStub);
+}
+
+/**
+ * @brief Install the stub for the next deep sleep.  Call just before
+ * esp_deep_sleep_start().
+ *
+ * @param pinMask bit (1 << RTC IO) of each ext1 wake pin
+ */
+void wakeStubArm(uint32_t pinMask)
+{
+  StubPinMask = pinMask;
+  StubPressed = 0;
+  esp_set_deep_sleep_wake_stub(&wakeStub);
+}
+
+/**
+ * @brief Pins the stub accepted as pressed on this wake, 0 if the stub did not
+ * run (power on, reset or a wake by another source)
+ *
+ */
+uint32_t wakeStubPressed()
+{
+  return StubPressed;
+}
+
+uint32_t wakeStubRejected()
+{
+  return StubRejected;
+}
@@ -0,0 +1,31 @@
+#ifndef ARDUINO_SHIM_H
+#define ARDUINO_SHIM_H
+
+//Minimal Arduino.h for the host build (env:native).  Only what Screens.cpp
+//and Pages.cpp use outside of U8g2, and the Serial prints of
+//FirmwareUpdate.cpp.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+class HostSerial
+{
+public:
+  int printf(const char *format, ...)
+  {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+    return n;
+  }
+  void println(const char *text) {puts(text);}
+};
+
+inline HostSerial Serial;
+
+#endif
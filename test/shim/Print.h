@@ -0,0 +1,22 @@
+#ifndef PRINT_SHIM_H
+#define PRINT_SHIM_H
+
+//Minimal Print base class for U8g2lib.h in the host build (env:native)
+
+#include <stdint.h>
+#include <stddef.h>
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size)
+  {
+    size_t n = 0;
+    while (size--) {n += write(*buffer++);}
+    return n;
+  }
+};
+
+#endif
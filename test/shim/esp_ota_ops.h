@@ -0,0 +1,55 @@
+#ifndef ESP_OTA_OPS_SHIM_H
+#define ESP_OTA_OPS_SHIM_H
+
+//OTA partition for the host build (env:native): one partition in RAM that
+//behaves like NOR flash, erase sets bits and a write can only clear them.
+//hostFlash() gives the tests its contents.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+#define HOST_PARTITION_SIZE (1536 * 1024)
+
+typedef struct
+{
+  uint32_t size;
+  const char *label;
+} esp_partition_t;
+
+inline esp_partition_t HostPartition = {HOST_PARTITION_SIZE, "ota_1"};
+inline std::vector<uint8_t> &hostFlash()
+{
+  static std::vector<uint8_t> flash(HOST_PARTITION_SIZE, 0x00);
+  return flash;
+}
+
+inline const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start)
+{
+  return &HostPartition;
+}
+
+inline esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+  if (offset % 4096 || size % 4096 || offset + size > partition->size) {return ESP_FAIL;}
+  for (size_t i = 0; i < size; i++) {hostFlash()[offset + i] = 0xFF;}
+  return ESP_OK;
+}
+
+inline esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *src, size_t size)
+{
+  if (offset + size > partition->size) {return ESP_FAIL;}
+  for (size_t i = 0; i < size; i++) {hostFlash()[offset + i] &= ((const uint8_t *)src)[i];}
+  return ESP_OK;
+}
+
+inline esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+  return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef ESP_TIMER_SHIM_H
+#define ESP_TIMER_SHIM_H
+
+//esp_timer_get_time() for the host build (env:native)
+
+#include <stdint.h>
+#include <chrono>
+
+inline int64_t esp_timer_get_time()
+{
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
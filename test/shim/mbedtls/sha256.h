@@ -0,0 +1,111 @@
+#ifndef MBEDTLS_SHA256_SHIM_H
+#define MBEDTLS_SHA256_SHIM_H
+
+//SHA-256 (FIPS 180-4) with mbedtls' interface for the host build
+//(env:native).  SHA-224 is not supported.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef struct
+{
+  uint32_t state[8];
+  uint64_t length;    //bytes hashed
+  uint8_t block[64];
+  size_t fill;
+} mbedtls_sha256_context;
+
+static const uint32_t Sha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+inline uint32_t sha256Rotr(uint32_t x, int n) {return (x >> n) | (x << (32 - n));}
+
+inline void sha256Block(mbedtls_sha256_context *ctx, const uint8_t *p)
+{
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+  {
+    w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++)
+  {
+    uint32_t s0 = sha256Rotr(w[i - 15], 7) ^ sha256Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = sha256Rotr(w[i - 2], 17) ^ sha256Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t v[8];
+  memcpy(v, ctx->state, sizeof(v));
+  for (int i = 0; i < 64; i++)
+  {
+    uint32_t s1 = sha256Rotr(v[4], 6) ^ sha256Rotr(v[4], 11) ^ sha256Rotr(v[4], 25);
+    uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+    uint32_t t1 = v[7] + s1 + ch + Sha256K[i] + w[i];
+    uint32_t s0 = sha256Rotr(v[0], 2) ^ sha256Rotr(v[0], 13) ^ sha256Rotr(v[0], 22);
+    uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+    memmove(v + 1, v, 7 * sizeof(uint32_t));
+    v[4] += t1;
+    v[0] = t1 + s0 + maj;
+  }
+  for (int i = 0; i < 8; i++) {ctx->state[i] += v[i];}
+}
+
+inline void mbedtls_sha256_init(mbedtls_sha256_context *ctx) {memset(ctx, 0, sizeof(*ctx));}
+inline void mbedtls_sha256_free(mbedtls_sha256_context *ctx) {memset(ctx, 0, sizeof(*ctx));}
+
+inline int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224)
+{
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  memcpy(ctx->state, initial, sizeof(initial));
+  ctx->length = 0;
+  ctx->fill = 0;
+  return is224 ? -1 : 0;
+}
+
+inline int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t len)
+{
+  ctx->length += len;
+  while (len > 0)
+  {
+    size_t take = 64 - ctx->fill;
+    if (take > len) {take = len;}
+    memcpy(ctx->block + ctx->fill, input, take);
+    ctx->fill += take;
+    input += take;
+    len -= take;
+    if (ctx->fill == 64)
+    {
+      sha256Block(ctx, ctx->block);
+      ctx->fill = 0;
+    }
+  }
+  return 0;
+}
+
+inline int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char output[32])
+{
+  uint64_t bits = ctx->length * 8;
+  uint8_t pad[72] = {0x80};
+  size_t padLen = (ctx->fill < 56 ? 56 : 120) - ctx->fill;
+  for (int i = 0; i < 8; i++) {pad[padLen + i] = (uint8_t)(bits >> (56 - 8 * i));}
+  mbedtls_sha256_update(ctx, pad, padLen + 8);
+  for (int i = 0; i < 8; i++)
+  {
+    output[4 * i] = ctx->state[i] >> 24;
+    output[4 * i + 1] = ctx->state[i] >> 16;
+    output[4 * i + 2] = ctx->state[i] >> 8;
+    output[4 * i + 3] = ctx->state[i];
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef MINIZ_SHIM_H
+#define MINIZ_SHIM_H
+
+//The ROM's tinfl interface for the host build (env:native), on zlib's raw
+//inflate.  Like the ROM's tinfl it does not give back the input its bit
+//buffer read past the end of the deflate stream: on DONE up to
+//TINFL_READ_AHEAD bytes more than zlib needed are reported as taken.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zlib.h>
+
+#define TINFL_LZ_DICT_SIZE 32768
+#define TINFL_FLAG_HAS_MORE_INPUT 2
+#define TINFL_READ_AHEAD 4
+
+typedef enum
+{
+  TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS = -4,
+  TINFL_STATUS_BAD_PARAM = -3,
+  TINFL_STATUS_ADLER32_MISMATCH = -2,
+  TINFL_STATUS_FAILED = -1,
+  TINFL_STATUS_DONE = 0,
+  TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+  TINFL_STATUS_HAS_MORE_OUTPUT = 2
+} tinfl_status;
+
+typedef struct
+{
+  z_stream stream;  //zlib's state is not freed, the test process is short
+  bool done;
+} tinfl_decompressor;
+
+inline void tinfl_init(tinfl_decompressor *r)
+{
+  *r = {};
+  inflateInit2(&r->stream, -15);
+}
+
+inline tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *pIn_buf_next, size_t *pIn_buf_size,
+  uint8_t *pOut_buf_start, uint8_t *pOut_buf_next, size_t *pOut_buf_size, uint32_t decomp_flags)
+{
+  if (r->done)
+  {
+    *pIn_buf_size = 0;
+    *pOut_buf_size = 0;
+    return TINFL_STATUS_DONE;
+  }
+  size_t inSize = *pIn_buf_size;
+  size_t outSize = *pOut_buf_size;
+  r->stream.next_in = (Bytef *)pIn_buf_next;
+  r->stream.avail_in = inSize;
+  r->stream.next_out = pOut_buf_next;
+  r->stream.avail_out = outSize;
+  int result = inflate(&r->stream, Z_NO_FLUSH);
+  *pIn_buf_size = inSize - r->stream.avail_in;
+  *pOut_buf_size = outSize - r->stream.avail_out;
+  if (result == Z_STREAM_END)
+  {
+    r->done = true;
+    size_t ahead = r->stream.avail_in < TINFL_READ_AHEAD ? r->stream.avail_in : TINFL_READ_AHEAD;
+    *pIn_buf_size += ahead;
+    return TINFL_STATUS_DONE;
+  }
+  if (result != Z_OK && result != Z_BUF_ERROR) {return TINFL_STATUS_FAILED;}
+  return r->stream.avail_out == 0 ? TINFL_STATUS_HAS_MORE_OUTPUT : TINFL_STATUS_NEEDS_MORE_INPUT;
+}
+
+#endif
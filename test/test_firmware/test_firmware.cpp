@@ -0,0 +1,195 @@
+/*
+Host tests of the streaming firmware update (env:native)
+========================================================
+A synthetic image is packed by tools/pack_firmware.py, and by the gzip tool
+(which adds a file name field to the header), then fed to FirmwareUpdate.cpp
+in chunks of several sizes.  The shims stand in for the flash partition, the
+ROM's tinfl (with its read-ahead past the end of the deflate stream) and
+mbedtls; the SHA-256 the remote checks is the one pack_firmware.py prints.
+
+Needs python3 and gzip on the PATH.
+*/
+
+#include <unity.h>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "FirmwareUpdate.h"
+#include <esp_ota_ops.h>
+
+#define IMAGE_SIZE (300 * 1024)
+
+static std::vector<uint8_t> Image;
+static std::vector<uint8_t> Packed;   //by pack_firmware.py
+static std::vector<uint8_t> Gzipped;  //by gzip -9
+static std::string Sha;
+
+/**
+ * @brief Firmware-like content: an image header, runs of repeated code-like
+ * words and stretches of noise, so it compresses about as well as a real image
+ *
+ */
+static std::vector<uint8_t> makeImage(size_t size)
+{
+  std::vector<uint8_t> image(size);
+  uint32_t x = 0x2545F491;
+  for (size_t i = 0; i < size; i++)
+  {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    image[i] = ((i / 4096) % 3 == 0) ? (uint8_t)x : (uint8_t)(0x36 + (i % 24) * 7 + ((i / 512) & 3));
+  }
+  image[0] = 0xE9;  //ESP image magic
+  return image;
+}
+
+static std::string repoPath(const char *relative)
+{
+  std::string path = __FILE__;
+  path = path.substr(0, path.find_last_of("/\\") + 1);
+  return path + "../../" + relative;
+}
+
+static std::vector<uint8_t> readFile(const std::string &path)
+{
+  std::vector<uint8_t> contents;
+  FILE *file = fopen(path.c_str(), "rb");
+  TEST_ASSERT_NOT_NULL_MESSAGE(file, path.c_str());
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {contents.insert(contents.end(), chunk, chunk + n);}
+  fclose(file);
+  return contents;
+}
+
+static std::string run(const std::string &command)
+{
+  std::string output;
+  FILE *pipe = popen(command.c_str(), "r");
+  TEST_ASSERT_NOT_NULL_MESSAGE(pipe, command.c_str());
+  char line[256];
+  while (fgets(line, sizeof(line), pipe) != NULL) {output += line;}
+  TEST_ASSERT_EQUAL_INT_MESSAGE(0, pclose(pipe), command.c_str());
+  return output;
+}
+
+/**
+ * @brief Pack the image both ways, first test, the others use the results
+ *
+ */
+void test_pack_image()
+{
+  std::filesystem::path dir = std::filesystem::temp_directory_path() / "test_firmware";
+  std::filesystem::create_directories(dir);
+  std::string bin = (dir / "firmware.bin").string();
+  FILE *file = fopen(bin.c_str(), "wb");
+  fwrite(Image.data(), 1, Image.size(), file);
+  fclose(file);
+
+  std::string output = run("python3 " + repoPath("tools/pack_firmware.py") + " " + bin + " -o " + bin + ".gz");
+  size_t at = output.find("sha256");
+  TEST_ASSERT_TRUE_MESSAGE(at != std::string::npos, output.c_str());
+  Sha = output.substr(output.find_first_not_of(' ', at + 6), 64);
+  Packed = readFile(bin + ".gz");
+  run("gzip -9 -c " + bin + " > " + bin + ".cli.gz");
+  Gzipped = readFile(bin + ".cli.gz");
+}
+
+/**
+ * @brief Upload a packed image in chunks of chunkSize and finish it
+ *
+ */
+static FwState upload(const std::vector<uint8_t> &packed, size_t chunkSize)
+{
+  if (!fwBegin(0, packed.size(), Sha.c_str(), FW_GZIP)) {return fwState();}
+  for (size_t at = 0; at < packed.size(); at += chunkSize)
+  {
+    size_t len = packed.size() - at < chunkSize ? packed.size() - at : chunkSize;
+    if (!fwWrite(packed.data() + at, len)) {break;}
+  }
+  return fwEnd(false);
+}
+
+static void checkFlash()
+{
+  TEST_ASSERT_EQUAL_MEMORY(Image.data(), hostFlash().data(), Image.size());
+}
+
+void setUp()
+{
+  std::fill(hostFlash().begin(), hostFlash().end(), 0x00);
+}
+
+void tearDown() {}
+
+void test_packed_image_round_trip()
+{
+  const size_t chunks[] = {1436, 4096, 1, 7, 65536};  //a TCP segment, a sector, and sizes that split the trailer
+  for (size_t chunk : chunks)
+  {
+    TEST_ASSERT_EQUAL_INT_MESSAGE(FW_VERIFIED, upload(Packed, chunk), std::to_string(chunk).c_str());
+    checkFlash();
+  }
+}
+
+void test_whole_image_in_one_write()
+{
+  TEST_ASSERT_EQUAL_INT(FW_VERIFIED, upload(Packed, Packed.size()));
+  checkFlash();
+}
+
+void test_gzip_tool_round_trip()
+{
+  TEST_ASSERT_EQUAL_UINT8(0x08, Gzipped[3]);  //FNAME set, the header parser skips it
+  TEST_ASSERT_EQUAL_INT(FW_VERIFIED, upload(Gzipped, 1436));
+  checkFlash();
+}
+
+void test_resume_after_a_dropped_connection()
+{
+  TEST_ASSERT_TRUE(fwBegin(0, Packed.size(), Sha.c_str(), FW_GZIP));
+  size_t half = Packed.size() / 2;
+  TEST_ASSERT_TRUE(fwWrite(Packed.data(), half));
+  TEST_ASSERT_EQUAL_INT(FW_RECEIVING, fwEnd(true));
+  TEST_ASSERT_EQUAL_UINT32(half, fwOffset());
+  TEST_ASSERT_TRUE(fwBegin(fwOffset(), Packed.size(), Sha.c_str(), FW_GZIP));
+  TEST_ASSERT_TRUE(fwWrite(Packed.data() + half, Packed.size() - half));
+  TEST_ASSERT_EQUAL_INT(FW_VERIFIED, fwEnd(false));
+  checkFlash();
+}
+
+void test_bad_size_in_trailer_is_rejected()
+{
+  std::vector<uint8_t> packed = Packed;
+  packed.back() ^= 0x01;  //ISIZE
+  TEST_ASSERT_EQUAL_INT(FW_FAILED, upload(packed, 1436));
+}
+
+void test_data_after_the_trailer_is_rejected()
+{
+  std::vector<uint8_t> packed = Packed;
+  packed.insert(packed.end(), 16, 0x00);
+  TEST_ASSERT_EQUAL_INT(FW_FAILED, upload(packed, 1436));
+}
+
+void test_truncated_image_is_rejected()
+{
+  std::vector<uint8_t> packed(Packed.begin(), Packed.end() - 20);
+  TEST_ASSERT_EQUAL_INT(FW_FAILED, upload(packed, 1436));
+}
+
+int main(int argc, char **argv)
+{
+  Image = makeImage(IMAGE_SIZE);
+  UNITY_BEGIN();
+  RUN_TEST(test_pack_image);
+  RUN_TEST(test_packed_image_round_trip);
+  RUN_TEST(test_whole_image_in_one_write);
+  RUN_TEST(test_gzip_tool_round_trip);
+  RUN_TEST(test_resume_after_a_dropped_connection);
+  RUN_TEST(test_bad_size_in_trailer_is_rejected);
+  RUN_TEST(test_data_after_the_trailer_is_rejected);
+  RUN_TEST(test_truncated_image_is_rejected);
+  return UNITY_END();
+}
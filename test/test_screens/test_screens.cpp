@@ -0,0 +1,301 @@
+/*
+Host tests of the OLED screens (env:native)
+===========================================
+Every screen in Pages.cpp is rendered by the real screen engine into U8g2's
+SH1106 frame buffer, with a byte callback that counts what would go over I2C
+instead of driving a display.
+
+Golden images are plain PBM files in test/test_screens/golden, in the
+orientation the user sees.  A missing golden fails the test.  Run with
+UPDATE_GOLDEN=1 to write them from the current renders, after a new screen
+or an intended layout change, then review and commit them.  On a mismatch
+the render is written next to the golden as <name>.actual.pbm.
+
+Bytes sent to the display and render time of each screen and field update
+are printed as a table at the end, run with "pio test -e native -v".
+*/
+
+#include <unity.h>
+#include <chrono>
+#include <filesystem>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include "Pages.h"
+
+#define DISPLAY_W 128
+#define DISPLAY_H 64
+#define TIMING_RUNS 100  //renders averaged for the timing figure
+
+static uint32_t DisplayBytes = 0;  //bytes sent to the display controller
+
+static uint8_t countBytes(u8x8_t *u8x8, uint8_t msg, uint8_t arg_int, void *arg_ptr)
+{
+  if (msg == U8X8_MSG_BYTE_SEND) {DisplayBytes += arg_int;}
+  return 1;
+}
+
+static uint8_t noGpio(u8x8_t *u8x8, uint8_t msg, uint8_t arg_int, void *arg_ptr)
+{
+  return 1;
+}
+
+//SH1106 with the device's rotation, rendering into the frame buffer only
+class HostDisplay : public U8G2
+{
+public:
+  HostDisplay()
+  {
+    u8g2_Setup_sh1106_i2c_128x64_noname_f(&u8g2, U8G2_R2, countBytes, noGpio);
+  }
+};
+
+static HostDisplay Display;
+
+//values the screens are bound to
+static int32_t FakeFlow = 35;
+static int32_t FakeBatt = 80;
+static int32_t FakeCalPage = 2;
+static int32_t FakeIP = (int32_t)(192u | (168u << 8) | (0u << 16) | (140u << 24));  //192.168.0.140
+static int32_t FakeWifi = WIFI_ST_READY;
+
+int32_t flowValue() {return FakeFlow;}
+int32_t battValue() {return FakeBatt;}
+int32_t calPageValue() {return FakeCalPage;}
+int32_t ipValue() {return FakeIP;}
+int32_t wifiStatusValue() {return FakeWifi;}
+
+struct RenderCost
+{
+  std::string name;
+  uint32_t bytes;
+  double micros;
+};
+
+static RenderCost Costs[32];
+static int NumCosts = 0;
+
+static void recordCost(const char *name, uint32_t bytes, double micros)
+{
+  if (NumCosts < 32) {Costs[NumCosts++] = {name, bytes, micros};}
+}
+
+/**
+ * @brief Pixel as the user sees it.  The buffer is in the controller's
+ * orientation, 8 pixel high tile rows, so U8G2_R2 is undone here.
+ *
+ */
+static bool pixel(int x, int y)
+{
+  const uint8_t *buffer = Display.getBufferPtr();
+  int nx = DISPLAY_W - 1 - x;
+  int ny = DISPLAY_H - 1 - y;
+  return (buffer[(ny / 8) * DISPLAY_W + nx] >> (ny % 8)) & 1;
+}
+
+static std::string renderPBM()
+{
+  std::string pbm = "P1\n128 64\n";
+  for (int y = 0; y < DISPLAY_H; y++)
+  {
+    for (int x = 0; x < DISPLAY_W; x++)
+    {
+      pbm += pixel(x, y) ? '1' : '0';
+    }
+    pbm += '\n';
+  }
+  return pbm;
+}
+
+static std::string goldenPath(const char *name, const char *suffix)
+{
+  std::string path = __FILE__;
+  path = path.substr(0, path.find_last_of("/\\") + 1);
+  return path + "golden/" + name + suffix;
+}
+
+static bool readFile(const std::string &path, std::string &contents)
+{
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == NULL) {return false;}
+  char chunk[512];
+  size_t n;
+  contents.clear();
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {contents.append(chunk, n);}
+  fclose(file);
+  return true;
+}
+
+static void writeFile(const std::string &path, const std::string &contents)
+{
+  std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+  FILE *file = fopen(path.c_str(), "wb");
+  TEST_ASSERT_NOT_NULL_MESSAGE(file, path.c_str());
+  fwrite(contents.data(), 1, contents.size(), file);
+  fclose(file);
+}
+
+/**
+ * @brief Compare the frame buffer with the golden image of a screen
+ *
+ */
+static void checkGolden(const char *name)
+{
+  std::string actual = renderPBM();
+  std::string golden;
+  std::string path = goldenPath(name, ".pbm");
+  if (getenv("UPDATE_GOLDEN") != NULL)
+  {
+    writeFile(path, actual);
+    TEST_MESSAGE(("golden image written, review and commit it: " + path).c_str());
+    return;
+  }
+  if (!readFile(path, golden))
+  {
+    writeFile(goldenPath(name, ".actual.pbm"), actual);
+    TEST_FAIL_MESSAGE(("no golden image " + path + ", write it with UPDATE_GOLDEN=1").c_str());
+  }
+  if (actual != golden)
+  {
+    writeFile(goldenPath(name, ".actual.pbm"), actual);
+    TEST_FAIL_MESSAGE(("render differs from golden " + path).c_str());
+  }
+}
+
+/**
+ * @brief Show a screen, record what it cost, then time TIMING_RUNS more renders
+ *
+ */
+static void showAndMeasure(const char *name, const Screen *screen)
+{
+  DisplayBytes = 0;
+  screenShow(screen);
+  uint32_t bytes = DisplayBytes;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < TIMING_RUNS; i++) {screenShow(screen);}
+  std::chrono::duration<double, std::micro> spent = std::chrono::steady_clock::now() - start;
+  recordCost(name, bytes, spent.count() / TIMING_RUNS);
+}
+
+/**
+ * @brief Run screenUpdate() after a bound value changed and record its cost
+ *
+ */
+static uint32_t updateAndMeasure(const char *name)
+{
+  DisplayBytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  screenUpdate();
+  std::chrono::duration<double, std::micro> spent = std::chrono::steady_clock::now() - start;
+  recordCost(name, DisplayBytes, spent.count());
+  return DisplayBytes;
+}
+
+void setUp()
+{
+  FakeFlow = 35;
+  FakeBatt = 80;
+  FakeCalPage = 2;
+  FakeWifi = WIFI_ST_READY;
+}
+
+void tearDown() {}
+
+void test_static_screens()
+{
+  struct {const char *name; const Screen *screen;} screens[] = {
+    {"ota", &OTAScreen},
+    {"wake", &WakeScreen},
+    {"no_flow", &NoFlowScreen},
+    {"waiting", &WaitingScreen},
+    {"cal_intro", &CalIntroScreen},
+    {"cal_saved", &CalSavedScreen},
+    {"cal_error", &CalErrorScreen},
+  };
+  for (auto &s : screens)
+  {
+    showAndMeasure(s.name, s.screen);
+    checkGolden(s.name);
+  }
+}
+
+void test_flow_screen()
+{
+  showAndMeasure("flow_3.5", &FlowScreen);
+  checkGolden("flow_3.5");
+  FakeFlow = 100;
+  showAndMeasure("flow_10", &FlowScreen);
+  checkGolden("flow_10");
+}
+
+void test_flow_field_update()
+{
+  screenShow(&FlowScreen);
+  uint32_t fullBytes = DisplayBytes;
+  FakeFlow = 40;
+  uint32_t updateBytes = updateAndMeasure("flow 3.5->4.0 update");
+  TEST_ASSERT_TRUE(updateBytes > 0);
+  TEST_ASSERT_TRUE(updateBytes < fullBytes);
+  checkGolden("flow_4.0");
+}
+
+void test_battery_field_update()
+{
+  screenShow(&FlowScreen);
+  FakeBatt = 10;
+  TEST_ASSERT_TRUE(updateAndMeasure("battery 80->10 update") > 0);
+  checkGolden("flow_batt_10");
+}
+
+void test_unchanged_update_sends_nothing()
+{
+  screenShow(&FlowScreen);
+  TEST_ASSERT_EQUAL_UINT32(0, updateAndMeasure("flow unchanged update"));
+}
+
+void test_ota_wifi_status()
+{
+  FakeWifi = WIFI_ST_CONNECTING;
+  showAndMeasure("ota_connecting", &OTAScreen);
+  checkGolden("ota_connecting");
+  FakeWifi = WIFI_ST_RETRY | (20 << 8);
+  TEST_ASSERT_TRUE(updateAndMeasure("ota connecting->retry update") > 0);
+  checkGolden("ota_retry_20");
+  FakeWifi = WIFI_ST_READY | (6 << 8);
+  TEST_ASSERT_TRUE(updateAndMeasure("ota retry->AP ch 6 update") > 0);
+  checkGolden("ota_no_espnow");
+}
+
+void test_cal_pages()
+{
+  showAndMeasure("cal_step_2", &CalStepScreen);
+  checkGolden("cal_step_2");
+  FakeCalPage = 10;
+  updateAndMeasure("cal page 2->10 update");
+  checkGolden("cal_step_10");
+}
+
+static void printCosts()
+{
+  printf("\n%-26s %10s %12s\n", "render", "I2C bytes", "time (us)");
+  for (int i = 0; i < NumCosts; i++)
+  {
+    printf("%-26s %10u %12.2f\n", Costs[i].name.c_str(), (unsigned)Costs[i].bytes, Costs[i].micros);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Display.begin();
+  screenBegin(Display);
+  UNITY_BEGIN();
+  RUN_TEST(test_static_screens);
+  RUN_TEST(test_flow_screen);
+  RUN_TEST(test_flow_field_update);
+  RUN_TEST(test_battery_field_update);
+  RUN_TEST(test_unchanged_update_sends_nothing);
+  RUN_TEST(test_ota_wifi_status);
+  RUN_TEST(test_cal_pages);
+  printCosts();
+  return UNITY_END();
+}
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""
+Pack a firmware image for POST /FIRMWARE
+========================================
+Compresses the image with gzip, prints the SHA-256 the remote checks (of the
+image itself, not of the .gz) and what the compression saves in transfer
+time, and optionally uploads it, resuming from the remote's offset if the
+link drops.
+
+  tools/pack_firmware.py .pio/build/esp32-s2-saola-1-ota/firmware.bin
+  tools/pack_firmware.py firmware.bin --upload 192.168.0.140
+"""
+
+import argparse
+import gzip
+import hashlib
+import json
+import sys
+import time
+import urllib.error
+import urllib.request
+
+RETRIES = 5  # resumes before giving up on an upload
+
+
+def pack(image):
+    # no file name and a zero mtime, so the same image always packs the same
+    return gzip.compress(image, compresslevel=9, mtime=0)
+
+
+def report(image, packed, kbps):
+    saved = len(image) - len(packed)
+    print(f"image    {len(image):9d} bytes  {len(image) / 1024 / kbps:7.1f} s at {kbps:g} kB/s")
+    print(f"gzip     {len(packed):9d} bytes  {len(packed) / 1024 / kbps:7.1f} s  ({100.0 * len(packed) / len(image):.1f}%)")
+    print(f"saved    {saved:9d} bytes  {saved / 1024 / kbps:7.1f} s")
+
+
+def status(host):
+    with urllib.request.urlopen(f"http://{host}/FIRMWARE", timeout=10) as reply:
+        return json.load(reply)
+
+
+def upload(host, packed, sha):
+    offset = 0
+    for attempt in range(RETRIES + 1):
+        url = (f"http://{host}/FIRMWARE?offset={offset}&size={len(packed)}"
+               f"&sha256={sha}&encoding=gzip")
+        request = urllib.request.Request(url, data=packed[offset:], method="POST",
+                                         headers={"Content-Type": "application/octet-stream"})
+        start = time.monotonic()
+        try:
+            with urllib.request.urlopen(request, timeout=60) as reply:
+                result = json.load(reply)
+                code = reply.status
+        except urllib.error.HTTPError as error:
+            result = json.load(error)
+            code = error.code
+        except OSError as error:
+            print(f"upload interrupted ({error}), resuming")
+            offset = status(host)["offset"]
+            continue
+        spent = time.monotonic() - start
+        print(f"{code} {json.dumps(result)} ({len(packed) - offset} bytes in {spent:.1f} s)")
+        if code == 200:
+            return True
+        if code != 202:
+            return False
+        offset = result["offset"]
+    return False
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    parser.add_argument("image", help="firmware.bin from the PlatformIO build")
+    parser.add_argument("-o", "--output", help="packed image, default <image>.gz")
+    parser.add_argument("--kbps", type=float, default=60.0,
+                        help="link rate for the time estimates, kB/s (the remote reports its own)")
+    parser.add_argument("--upload", metavar="HOST", help="remote in OTA mode to send the image to")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as file:
+        image = file.read()
+    packed = pack(image)
+    output = args.output or args.image + ".gz"
+    with open(output, "wb") as file:
+        file.write(packed)
+    sha = hashlib.sha256(image).hexdigest()
+    print(f"{output}\nsha256   {sha}")
+    report(image, packed, args.kbps)
+    if args.upload:
+        return 0 if upload(args.upload, packed, sha) else 1
+    print(f"curl -X POST -H 'Content-Type: application/octet-stream' --data-binary @{output} "
+          f"'http://<remote>/FIRMWARE?offset=0&size={len(packed)}&sha256={sha}&encoding=gzip'")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
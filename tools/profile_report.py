@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""
+Flat profile from a CPU profiler dump
+=====================================
+Symbolises the "0x<pc> <count>" lines of a profiler dump (GET /PROFILE, or
+"profile dump" on the serial console) against the firmware ELF with
+addr2line and prints the functions, or source lines, by samples.  PCs that
+addr2line can't place, e.g. in ROM, go to the nearest symbol from nm, which
+has the ROM functions the linker scripts provide.
+
+  tools/profile_report.py .pio/build/esp32-s2-saola-1/firmware.elf capture.txt
+  pio device monitor | tee capture.txt     (then "profile dump")
+  tools/profile_report.py firmware.elf --host 192.168.0.140 --seconds 10
+"""
+
+import argparse
+import bisect
+import re
+import subprocess
+import sys
+import time
+import urllib.request
+
+TOOLCHAIN = "xtensa-esp32s2-elf-"
+HEADER = re.compile(r"# profile hz=(\d+) samples=(\d+) lost=(\d+) ms=(\d+)")
+SAMPLE = re.compile(r"(0x[0-9a-fA-F]+) (\d+)\s*$")
+
+
+def parse(text):
+    """The last dump block in the text, a serial capture may hold several"""
+    header, counts, block = None, {}, None
+    for line in text.splitlines():
+        match = HEADER.search(line)
+        if match:
+            header, block = match, {}
+        elif block is not None and "# end" in line:
+            counts, block = block, None
+        elif block is not None:
+            match = SAMPLE.search(line)
+            if match:
+                block[int(match.group(1), 16)] = int(match.group(2))
+    if header is None or block is not None:
+        sys.exit("no complete '# profile' ... '# end' block in the input")
+    hz, samples, lost, ms = (int(g) for g in header.groups())
+    return hz, samples, lost, ms, counts
+
+
+def fetch(host, hz, seconds):
+    if seconds:
+        urllib.request.urlopen(f"http://{host}/PROFILE?start={hz}", timeout=10).read()
+        time.sleep(seconds)
+        url = f"http://{host}/PROFILE?stop"
+    else:
+        url = f"http://{host}/PROFILE"
+    with urllib.request.urlopen(url, timeout=30) as reply:
+        return reply.read().decode()
+
+
+def symbols(nm, elf):
+    """Sorted (address, name) of the code symbols, for the nm fallback"""
+    out = subprocess.run([nm, "-n", "-C", "--defined-only", elf], capture_output=True,
+                         text=True, check=True).stdout
+    table = []
+    for line in out.splitlines():
+        parts = line.split(None, 2)
+        if len(parts) == 3 and parts[1] in "tTwWaA":
+            table.append((int(parts[0], 16), parts[2]))
+    return table
+
+
+def nearest(table, pc):
+    i = bisect.bisect_right(table, (pc, "\uffff")) - 1
+    if i < 0:
+        return "??"
+    address, name = table[i]
+    return f"{name}+0x{pc - address:x}" if pc != address else name
+
+
+def locate(addr2line, elf, pcs, table):
+    """pc -> (function, file:line)"""
+    text = "\n".join(f"0x{pc:08x}" for pc in pcs)
+    out = subprocess.run([addr2line, "-e", elf, "-a", "-f", "-C"], input=text,
+                         capture_output=True, text=True, check=True).stdout.splitlines()
+    where = {}
+    for i in range(0, len(out) - 2, 3):
+        pc = int(out[i], 16)
+        function, location = out[i + 1], out[i + 2]
+        if function == "??":
+            function = nearest(table, pc).split("+")[0]
+            location = "rom" if pc < 0x40020000 else "??"
+        where[pc] = (function, location.split(" (discriminator")[0])
+    return where
+
+
+def report(hz, samples, lost, ms, counts, where, by_line, top):
+    profile = {}
+    for pc, count in counts.items():
+        function, location = where.get(pc, ("??", "??"))
+        key = (location, function) if by_line else (function, location.rsplit(":", 1)[0])
+        profile[key] = profile.get(key, 0) + count
+    total = sum(counts.values()) or 1
+    print(f"{samples} samples at {hz} Hz over {ms / 1000:.1f} s, {lost} lost, "
+          f"{len(counts)} distinct PCs")
+    print(f"{'samples':>8} {'%':>6} {'cum%':>6}  {'line' if by_line else 'function'}")
+    cumulative = 0
+    for (name, detail), count in sorted(profile.items(), key=lambda item: -item[1])[:top]:
+        cumulative += count
+        print(f"{count:8d} {100.0 * count / total:6.2f} {100.0 * cumulative / total:6.2f}  {name}  ({detail})")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Flat profile from a remote CPU profiler dump")
+    parser.add_argument("elf", help="firmware.elf of the build that ran")
+    parser.add_argument("dump", nargs="?", default="-", help="dump or serial capture, - for stdin")
+    parser.add_argument("--host", help="fetch the dump from GET /PROFILE instead")
+    parser.add_argument("--seconds", type=float, default=0, help="with --host: start, wait, stop")
+    parser.add_argument("--hz", type=int, default=0, help="with --seconds: sample rate, 0 for the default")
+    parser.add_argument("--lines", action="store_true", help="by source line instead of function")
+    parser.add_argument("--top", type=int, default=30, help="rows to print")
+    parser.add_argument("--toolchain", default=TOOLCHAIN, help="prefix of addr2line and nm")
+    args = parser.parse_args()
+
+    if args.host:
+        text = fetch(args.host, args.hz, args.seconds)
+    elif args.dump == "-":
+        text = sys.stdin.read()
+    else:
+        with open(args.dump, errors="replace") as f:
+            text = f.read()
+    hz, samples, lost, ms, counts = parse(text)
+    table = symbols(args.toolchain + "nm", args.elf)
+    where = locate(args.toolchain + "addr2line", args.elf, sorted(counts), table)
+    report(hz, samples, lost, ms, counts, where, args.lines, args.top)
+
+
+if __name__ == "__main__":
+    main()